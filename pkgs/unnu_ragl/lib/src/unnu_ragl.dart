@@ -18,8 +18,106 @@ final DynamicLibrary _dylib = () {
 
 typedef RagEmbedding = ({int id, String text});
 
+/// Frees a native vector block once the Dart view over its values is
+/// collected, see [_embeddingsView].
+final Pointer<NativeFinalizerFunction> _freeEmbedVector = _dylib
+    .lookup<NativeFinalizerFunction>('unnu_ragl_free_embedvector');
+
+/// Zero-copy view over the values of [response]. The vector is a single
+/// native block, so the view owns it and the caller must not free it.
+Float32List _embeddingsView(Pointer<UnnuRagEmbdVec_t> response) =>
+    response.ref.values.asTypedList(
+      response.ref.count,
+      finalizer: _freeEmbedVector,
+      token: response.cast(),
+    );
+
+typedef RagCacheStats =
+    ({
+      int lookups,
+      int embeddingHits,
+      int resultHits,
+      int misses,
+      int entries,
+      double savedMs,
+    });
+
+/// Scope of a filtered query: fragments of documents matching every non-empty
+/// list.
+typedef RagFilter =
+    ({List<String> documentIds, List<String> uris, List<String> corpora});
+
+/// Native copy of [filter], released with [_freeFilter] once the call
+/// returned; the strings are copied before the query starts.
+Pointer<UnnuRaglFilter> _nativeFilter(RagFilter filter) {
+  Pointer<Pointer<Char>> strings(List<String> values) {
+    final ptr = ffi.calloc<Pointer<Char>>(values.length);
+    for (var i = 0; i < values.length; i++) {
+      ptr[i] = values[i].toNativeUtf8().cast<Char>();
+    }
+    return ptr;
+  }
+
+  final native = ffi.calloc<UnnuRaglFilter>();
+  native.ref.document_ids = strings(filter.documentIds);
+  native.ref.document_count = filter.documentIds.length;
+  native.ref.uris = strings(filter.uris);
+  native.ref.uri_count = filter.uris.length;
+  native.ref.corpora = strings(filter.corpora);
+  native.ref.corpus_count = filter.corpora.length;
+  return native;
+}
+
+void _freeFilter(Pointer<UnnuRaglFilter> native) {
+  void strings(Pointer<Pointer<Char>> ptr, int count) {
+    for (var i = 0; i < count; i++) {
+      ffi.calloc.free(ptr[i]);
+    }
+    ffi.calloc.free(ptr);
+  }
+
+  strings(native.ref.document_ids, native.ref.document_count);
+  strings(native.ref.uris, native.ref.uri_count);
+  strings(native.ref.corpora, native.ref.corpus_count);
+  ffi.calloc.free(native);
+}
+
+typedef RagModelStatus =
+    ({
+      bool stale,
+      bool reindexing,
+      bool failed,
+      int failures,
+      int reindexed,
+      int fragments,
+    });
+
+typedef RagMaintenanceStats =
+    ({
+      int fragments,
+      int tombstones,
+      double fragmentation,
+      int compactions,
+      bool ftsPending,
+      int ftsFailures,
+      int compactFailures,
+    });
+
 enum RagEmbeddingVectorType { EMBEDDING, QUERY, ID }
 
+typedef RagFragment =
+    ({String id, String text, String documentIds, double score, int kb});
+
+typedef RagStageMetrics =
+    ({
+      UnnuRaglStage stage,
+      int processed,
+      int documents,
+      int queued,
+      int capacity,
+      double busyMs,
+    });
+
 typedef RagEmbeddingVector =
     ({
       RagEmbeddingVectorType type,
@@ -72,7 +170,71 @@ class RagLite with ChangeNotifier {
     return val != 0;
   }
 
-  Future<List<String>> query(String text) async {
+  /// Opens another knowledge base next to the one of [setup] and returns its
+  /// handle, 0 when the database could not be opened.
+  static int openKnowledgeBase(String? path) {
+    init();
+    final errorCode = ffi.calloc<Int>();
+    final tag = path?.toNativeUtf8();
+    final handle = unnu_rag_lite_kb_open(
+      tag?.cast<Char>() ?? nullptr,
+      errorCode,
+    );
+    if (tag != null) {
+      ffi.calloc.free(tag);
+    }
+    ffi.calloc.free(errorCode);
+    return handle;
+  }
+
+  static void closeKnowledgeBase(int kb) {
+    unnu_rag_lite_kb_close(kb);
+  }
+
+  /// Moves the ingested document [documentId] of [kb] to [corpus], or out of
+  /// any corpus when null.
+  static void setCorpus(int kb, String documentId, String? corpus) {
+    final id = documentId.toNativeUtf8();
+    final tag = corpus?.toNativeUtf8();
+    unnu_rag_lite_kb_set_corpus(
+      kb,
+      id.cast<Char>(),
+      tag?.cast<Char>() ?? nullptr,
+    );
+    ffi.calloc.free(id);
+    if (tag != null) {
+      ffi.calloc.free(tag);
+    }
+  }
+
+  /// Writes the knowledge base [kb] to [dir] as Parquet files with a
+  /// manifest of the model settings. Returns 0 or the error code.
+  static int exportKnowledgeBase(int kb, String dir) {
+    final errorCode = ffi.calloc<Int>();
+    final tag = dir.toNativeUtf8();
+    unnu_rag_lite_export(kb, tag.cast<Char>(), errorCode);
+    ffi.calloc.free(tag);
+    final val = errorCode.value;
+    ffi.calloc.free(errorCode);
+    return val;
+  }
+
+  /// Loads an export of [exportKnowledgeBase] into [kb] and builds its indexes
+  /// once. Returns 0, 5645 when the export was made with other model settings,
+  /// or the error code.
+  static int importKnowledgeBase(int kb, String dir) {
+    final errorCode = ffi.calloc<Int>();
+    final tag = dir.toNativeUtf8();
+    unnu_rag_lite_import(kb, tag.cast<Char>(), errorCode);
+    ffi.calloc.free(tag);
+    final val = errorCode.value;
+    ffi.calloc.free(errorCode);
+    return val;
+  }
+
+  /// Searches the knowledge base [kb], or all of [kbs] merged by score;
+  /// without either the knowledge base of [setup] is searched.
+  Future<List<String>> query(String text, {int? kb, List<int>? kbs}) async {
     if (kDebugMode) {
       print('RagLite::query($text)');
     }
@@ -130,7 +292,18 @@ class RagLite with ChangeNotifier {
     unnu_set_ragl_result_callback(nativeResponseCallable!.nativeFunction);
 
     final query = text.toNativeUtf8();
-    unnu_rag_lite_query(query.cast<Char>());
+    if (kbs != null) {
+      final handles = ffi.calloc<Int32>(kbs.length);
+      for (var i = 0; i < kbs.length; i++) {
+        handles[i] = kbs[i];
+      }
+      unnu_rag_lite_kb_query_many(handles, kbs.length, query.cast<Char>());
+      ffi.calloc.free(handles);
+    } else if (kb != null) {
+      unnu_rag_lite_kb_query(kb, query.cast<Char>());
+    } else {
+      unnu_rag_lite_query(query.cast<Char>());
+    }
 
     /// Stream of token responses.
     return completer.future.whenComplete(
@@ -138,7 +311,113 @@ class RagLite with ChangeNotifier {
     );
   }
 
-  Stream<RagEmbeddingVector> embed(String text) async* {
+  /// Fragments of [query] in score order as soon as each one is ready, so a
+  /// prompt can be assembled before the full result set arrives. A [filter]
+  /// restricts the search to its scope.
+  Stream<RagFragment> queryStream(
+    String text, {
+    int? kb,
+    List<int>? kbs,
+    RagFilter? filter,
+  }) async* {
+    NativeCallable<UnnuRaglResponseCallbackFunction>? nativeResponseCallable;
+
+    void release() {
+      if (nativeResponseCallable != null) {
+        nativeResponseCallable!.close();
+        unnu_unset_ragl_result_callback();
+        nativeResponseCallable = null;
+      }
+    }
+
+    final responseStreamController = StreamController<RagFragment>.broadcast(
+      onCancel: release,
+      sync: true,
+    );
+
+    void onResponseCallback(Pointer<UnnuRaglResult> response) {
+      try {
+        if (response.ref.type == UnnuRaglResultType.UNNU_RAGL_QUERY) {
+          for (var i = 0; i < response.ref.count; i++) {
+            final fragment = (response.ref.fragments + i).value.ref;
+            responseStreamController.add((
+              id: fragment.ref_id.cast<ffi.Utf8>().toDartString(
+                length: fragment.reflen,
+              ),
+              text: fragment.text.cast<ffi.Utf8>().toDartString(
+                length: fragment.length,
+              ),
+              documentIds: fragment.document_id.cast<ffi.Utf8>().toDartString(
+                length: fragment.doclen,
+              ),
+              score: fragment.score,
+              kb: fragment.kb,
+            ));
+          }
+        } else if (response.ref.type == UnnuRaglResultType.UNNU_RAGL_FINISH ||
+            response.ref.type == UnnuRaglResultType.UNNU_RAGL_ERROR) {
+          release();
+          if (!responseStreamController.isClosed) {
+            unawaited(responseStreamController.close());
+          }
+        }
+      } finally {
+        unnu_ragl_free_result(response);
+      }
+    }
+
+    nativeResponseCallable =
+        NativeCallable<UnnuRaglResponseCallbackFunction>.listener(
+          onResponseCallback,
+        );
+
+    nativeResponseCallable!.keepIsolateAlive = false;
+
+    unnu_set_ragl_result_callback(nativeResponseCallable!.nativeFunction);
+
+    final query = text.toNativeUtf8();
+    final targets = kbs ?? (kb != null ? [kb] : null);
+    if (filter != null) {
+      final scope = _nativeFilter(filter);
+      if (targets != null) {
+        final handles = ffi.calloc<Int32>(targets.length);
+        for (var i = 0; i < targets.length; i++) {
+          handles[i] = targets[i];
+        }
+        unnu_rag_lite_kb_query_filtered(
+          handles,
+          targets.length,
+          query.cast<Char>(),
+          scope,
+          1,
+        );
+        ffi.calloc.free(handles);
+      } else {
+        unnu_rag_lite_query_filtered(query.cast<Char>(), scope, 1);
+      }
+      _freeFilter(scope);
+    } else if (targets != null) {
+      final handles = ffi.calloc<Int32>(targets.length);
+      for (var i = 0; i < targets.length; i++) {
+        handles[i] = targets[i];
+      }
+      unnu_rag_lite_kb_query_stream(handles, targets.length, query.cast<Char>());
+      ffi.calloc.free(handles);
+    } else {
+      unnu_rag_lite_query_stream(query.cast<Char>());
+    }
+    ffi.calloc.free(query);
+
+    yield* responseStreamController.stream;
+  }
+
+  /// Ingests [text]; fragments of a [corpus] can be scoped to with a
+  /// [RagFilter].
+  Stream<RagEmbeddingVector> embed(
+    String text, {
+    int? kb,
+    String? corpus,
+  }) async* {
     NativeCallable<UnnuRaglEmbeddingCallbackFunction>? nativeEmbeddingCallable;
 
     var completed = false;
@@ -159,6 +438,12 @@ class RagLite with ChangeNotifier {
     }
 
     void onEmbeddingCallback(Pointer<UnnuRagEmbdVec_t> response) {
+      var retained = false;
+      Float32List values() {
+        retained = true;
+        return _embeddingsView(response);
+      }
+
       try {
         if (response.ref.type == UnnuRaglResultType.UNNU_RAGL_EMBEDDING) {
           if (response.ref.count > 0 &&
@@ -172,9 +457,7 @@ class RagLite with ChangeNotifier {
               document: response.ref.text.cast<ffi.Utf8>().toDartString(
                 length: response.ref.length,
               ),
-              embeddings: response.ref.values
-                  .asTypedList(response.ref.count)
-                  .toList(growable: false),
+              embeddings: values(),
             ));
           }
         } else {
@@ -213,9 +496,7 @@ class RagLite with ChangeNotifier {
               charList.toList(),
               allowMalformed: true,
             ),
-            embeddings: response.ref.values
-                .asTypedList(response.ref.count)
-                .toList(growable: false),
+            embeddings: values(),
           ));
         } on Exception catch (e, s) {
           if (kDebugMode) {
@@ -223,7 +504,9 @@ class RagLite with ChangeNotifier {
           }
         }
       } finally {
-        unnu_ragl_free_embedvector(response);
+        if (!retained) {
+          unnu_ragl_free_embedvector(response);
+        }
         if (completed) {
           if (!responseStreamController.isClosed) {
             unawaited(closeStreamAsync());
@@ -242,7 +525,19 @@ class RagLite with ChangeNotifier {
     unnu_set_ragl_embedding_callback(nativeEmbeddingCallable!.nativeFunction);
 
     final query = text.toNativeUtf8();
-    unnu_rag_lite_embed(query.cast<Char>());
+    if (corpus != null) {
+      final tag = corpus.toNativeUtf8();
+      if (kb != null) {
+        unnu_rag_lite_kb_embed_corpus(kb, query.cast<Char>(), tag.cast<Char>());
+      } else {
+        unnu_rag_lite_embed_corpus(query.cast<Char>(), tag.cast<Char>());
+      }
+      ffi.calloc.free(tag);
+    } else if (kb != null) {
+      unnu_rag_lite_kb_embed(kb, query.cast<Char>());
+    } else {
+      unnu_rag_lite_embed(query.cast<Char>());
+    }
 
     /// Stream of token responses.
     yield* responseStreamController.stream;
@@ -250,23 +545,31 @@ class RagLite with ChangeNotifier {
     ffi.calloc.free(query);
   }
 
-  void addMapping(String uri, String documentId) {
+  void addMapping(String uri, String documentId, {int? kb}) {
     final docUri = uri.toNativeUtf8();
     final docId = documentId.toNativeUtf8();
-    unnu_rag_lite_mapping(docUri.cast<Char>(), docId.cast<Char>());
+    if (kb != null) {
+      unnu_rag_lite_kb_mapping(kb, docUri.cast<Char>(), docId.cast<Char>());
+    } else {
+      unnu_rag_lite_mapping(docUri.cast<Char>(), docId.cast<Char>());
+    }
     ffi.calloc.free(docId);
     ffi.calloc.free(docUri);
   }
 
-  void deleteEmbedding(String uri, String documentId) {
+  void deleteEmbedding(String uri, String documentId, {int? kb}) {
     final docUri = uri.toNativeUtf8();
     final docId = documentId.toNativeUtf8();
-    unnu_rag_lite_delete(docId.cast<Char>(), docUri.cast<Char>());
+    if (kb != null) {
+      unnu_rag_lite_kb_delete(kb, docId.cast<Char>(), docUri.cast<Char>());
+    } else {
+      unnu_rag_lite_delete(docId.cast<Char>(), docUri.cast<Char>());
+    }
     ffi.calloc.free(docId);
     ffi.calloc.free(docUri);
   }
 
-  Stream<RagEmbeddingVector> retrieve(String id) async* {
+  Stream<RagEmbeddingVector> retrieve(String id, {int? kb}) async* {
     if (kDebugMode) {
       print('RagLite::retrieve($id)');
     }
@@ -289,6 +592,12 @@ class RagLite with ChangeNotifier {
     }
 
     void onEmbeddingCallback(Pointer<UnnuRagEmbdVec_t> response) {
+      var retained = false;
+      Float32List values() {
+        retained = true;
+        return _embeddingsView(response);
+      }
+
       try {
         if (response.ref.type == UnnuRaglResultType.UNNU_RAGL_EMBEDDING) {
           if (response.ref.length > 0) {
@@ -299,9 +608,7 @@ class RagLite with ChangeNotifier {
               length: response.ref.reflen,
             );
             final count = response.ref.count;
-            final embd = response.ref.values
-                .asTypedList(count)
-                .toList(growable: false);
+            final embd = values();
             responseStreamController.add((
               type: RagEmbeddingVectorType.EMBEDDING,
               documentId: refId,
@@ -316,7 +623,9 @@ class RagLite with ChangeNotifier {
           }
         }
       } finally {
-        unnu_ragl_free_embedvector(response);
+        if (!retained) {
+          unnu_ragl_free_embedvector(response);
+        }
       }
     }
 
@@ -330,7 +639,11 @@ class RagLite with ChangeNotifier {
     unnu_set_ragl_embedding_callback(nativeEmbeddingCallable!.nativeFunction);
 
     final docId = id.toNativeUtf8();
-    unnu_rag_lite_retrieve(docId.cast<Char>());
+    if (kb != null) {
+      unnu_rag_lite_kb_retrieve(kb, docId.cast<Char>());
+    } else {
+      unnu_rag_lite_retrieve(docId.cast<Char>());
+    }
 
     /// Stream of token responses.
     yield* responseStreamController.stream;
@@ -348,6 +661,12 @@ class RagLite with ChangeNotifier {
     final completer = Completer<RagEmbeddingVector>();
 
     void onEmbeddingCallback(Pointer<UnnuRagEmbdVec_t> response) {
+      var retained = false;
+      Float32List values() {
+        retained = true;
+        return _embeddingsView(response);
+      }
+
       try {
         if (response.ref.type == UnnuRaglResultType.UNNU_RAGL_QUERY) {
           if (response.ref.length > 0) {
@@ -356,9 +675,7 @@ class RagLite with ChangeNotifier {
             );
 
             final count = response.ref.count;
-            final embd = response.ref.values
-                .asTypedList(count)
-                .toList(growable: false);
+            final embd = values();
             completer.complete((
               type: RagEmbeddingVectorType.QUERY,
               documentId: '',
@@ -392,9 +709,7 @@ class RagLite with ChangeNotifier {
           final output = utf8.decode(charList.toList(), allowMalformed: true);
 
           final count = response.ref.count;
-          final embd = response.ref.values
-              .asTypedList(count)
-              .toList(growable: false);
+          final embd = values();
           completer.complete((
             type: RagEmbeddingVectorType.QUERY,
             documentId: '',
@@ -418,7 +733,9 @@ class RagLite with ChangeNotifier {
           ));
         }
       } finally {
-        unnu_ragl_free_embedvector(response);
+        if (!retained) {
+          unnu_ragl_free_embedvector(response);
+        }
       }
     }
 
@@ -448,10 +765,23 @@ class RagLite with ChangeNotifier {
     unnu_rag_lite_set_chunk_size(sz);
   }
 
+  /// Chunks by [tokens] of the model tokenizer with [overlap] tokens carried
+  /// between chunks; 0 tokens switches back to character chunking.
+  void setTokenChunking(int tokens, {int overlap = 32}) {
+    unnu_rag_lite_set_token_chunking(tokens, overlap);
+  }
+
+  /// Stored embedding width. Below the model output the pooled vector is
+  /// truncated to its first [sz] values and renormalised (Matryoshka models).
   void setEmbeddingSize(int sz) {
     unnu_rag_lite_update_dims(sz);
   }
 
+  /// Keeps the untruncated vectors to rescore the vector candidates with.
+  void keepFullVectors(bool val) {
+    unnu_rag_lite_keep_full_vectors(val ? 1 : 0);
+  }
+
   void enableParagraphChunking(bool val) {
     unnu_rag_lite_enable_paragraph_chunking(val ? 0 : 1);
   }
@@ -464,6 +794,226 @@ class RagLite with ChangeNotifier {
     unnu_rag_lite_set_pooling_type(type);
   }
 
+  void setCandidateLimit(int lmt) {
+    unnu_rag_lite_set_candidate_limit(lmt);
+  }
+
+  void setFusionStrategy(int strategy) {
+    unnu_rag_lite_set_fusion_strategy(strategy);
+  }
+
+  void setFusionWeights(double embedding, double fts) {
+    unnu_rag_lite_set_fusion_weights(embedding, fts);
+  }
+
+  void setRrfK(int k) {
+    unnu_rag_lite_set_rrf_k(k);
+  }
+
+  void setRerankLimit(int lmt) {
+    unnu_rag_lite_set_rerank_limit(lmt);
+  }
+
+  /// Loads the cross-encoder at [model_path], null unloads it. Returns 0, or
+  /// the error code when it fails to load and the previous one is kept.
+  static int configureReranker(String? model_path) {
+    init();
+    final errorCode = ffi.calloc<Int>();
+    final input = model_path?.toNativeUtf8();
+    unnu_rag_lite_init_reranker(input?.cast<Char>() ?? nullptr, errorCode);
+    if (input != null) {
+      ffi.calloc.free(input);
+    }
+    final val = errorCode.value;
+    ffi.calloc.free(errorCode);
+    return val;
+  }
+
+  void setMaxBatchTokens(int tokens) {
+    unnu_rag_lite_set_max_batch_tokens(tokens);
+  }
+
+  /// Thread budgets for the embedding encoder (taken by the next [configure]),
+  /// ingestion workers and the database; 0 keeps the default.
+  static void setThreadBudget({int encoder = 0, int ingest = 0, int db = 0}) {
+    init();
+    unnu_rag_lite_set_thread_budget(encoder, ingest, db);
+  }
+
+  /// Limits background ingestion to [maxBatches] encoder batches in flight,
+  /// e.g. while the chat model is generating; 0 pauses, -1 lifts the limit.
+  void throttleIngestion(int maxBatches) {
+    unnu_rag_lite_throttle_ingest(maxBatches);
+  }
+
+  void pauseIngestion() => throttleIngestion(0);
+
+  void resumeIngestion() => throttleIngestion(-1);
+
+  void setBulkCommit(int documents) {
+    unnu_rag_lite_set_bulk_commit(documents);
+  }
+
+  void flushIngest() {
+    unnu_rag_lite_flush_ingest();
+  }
+
+  void setQueryCacheCapacity(int entries) {
+    unnu_rag_lite_set_query_cache_capacity(entries);
+  }
+
+  void enableQueryCachePersistence(bool val) {
+    unnu_rag_lite_enable_query_cache_persistence(val ? 1 : 0);
+  }
+
+  void clearQueryCache() {
+    unnu_rag_lite_clear_query_cache();
+  }
+
+  RagCacheStats queryCacheStats() {
+    final stats = ffi.calloc<UnnuRaglCacheStats_t>();
+    try {
+      unnu_rag_lite_query_cache_stats(stats);
+      return (
+        lookups: stats.ref.lookups,
+        embeddingHits: stats.ref.embedding_hits,
+        resultHits: stats.ref.result_hits,
+        misses: stats.ref.misses,
+        entries: stats.ref.entries,
+        savedMs: stats.ref.saved_ms,
+      );
+    } finally {
+      ffi.calloc.free(stats);
+    }
+  }
+
+  void setPipelineDepth(int documents) {
+    unnu_rag_lite_set_pipeline_depth(documents);
+  }
+
+  /// Vector storage of knowledge bases opened after the call: 0 float with
+  /// the HNSW index, 1 int8 codes, 2 binary codes. Quantized modes rescore
+  /// [rescoreFactor] times the candidate limit with the float vectors.
+  void setStorageMode(int mode, {int rescoreFactor = 4}) {
+    unnu_rag_lite_set_storage_mode(mode, rescoreFactor);
+  }
+
+  /// Connections each knowledge base keeps for concurrent queries.
+  void setConnectionPoolSize(int connections) {
+    unnu_rag_lite_set_connection_pool_size(connections);
+  }
+
+  /// Per-stage progress of the ingestion pipeline until the subscription is
+  /// cancelled.
+  Stream<RagStageMetrics> pipelineMetrics() {
+    NativeCallable<UnnuRaglPipelineCallbackFunction>? nativePipelineCallable;
+
+    late final StreamController<RagStageMetrics> metricsStreamController;
+    metricsStreamController = StreamController<RagStageMetrics>.broadcast(
+      onCancel: () {
+        unnu_unset_ragl_pipeline_callback();
+        nativePipelineCallable?.close();
+        nativePipelineCallable = null;
+      },
+    );
+
+    void onPipelineCallback(Pointer<UnnuRaglStageMetrics> metrics) {
+      try {
+        if (!metricsStreamController.isClosed) {
+          metricsStreamController.add((
+            stage: metrics.ref.stage,
+            processed: metrics.ref.processed,
+            documents: metrics.ref.documents,
+            queued: metrics.ref.queued,
+            capacity: metrics.ref.capacity,
+            busyMs: metrics.ref.busy_ms,
+          ));
+        }
+      } finally {
+        unnu_ragl_free_stage_metrics(metrics);
+      }
+    }
+
+    nativePipelineCallable =
+        NativeCallable<UnnuRaglPipelineCallbackFunction>.listener(
+          onPipelineCallback,
+        );
+    unnu_set_ragl_pipeline_callback(nativePipelineCallable!.nativeFunction);
+
+    return metricsStreamController.stream;
+  }
+
+  void setFtsDebounce(Duration delay) {
+    unnu_rag_lite_set_fts_debounce(delay.inMilliseconds);
+  }
+
+  void flushFts() {
+    unnu_rag_lite_flush_fts();
+  }
+
+  /// Deletes leave tombstones that a background compaction reclaims, at once
+  /// when they reach [ratio] of the fragments, otherwise after [idle].
+  void setCompaction({
+    double ratio = 0.1,
+    Duration idle = const Duration(seconds: 30),
+  }) {
+    unnu_rag_lite_set_compaction(ratio, idle.inMilliseconds);
+  }
+
+  void compact() {
+    unnu_rag_lite_compact();
+  }
+
+  /// Whether the vectors of [kb] come from another model than the loaded one,
+  /// and the progress of their re-embedding. Queries use BM25 only until the
+  /// new vectors are swapped in. [failed] once the re-embedding gave up after
+  /// [failures] attempts; ingestion into [kb] is refused until the next
+  /// [configure].
+  static RagModelStatus modelStatus(int kb) {
+    final status = ffi.calloc<UnnuRaglModelStatus_t>();
+    try {
+      unnu_rag_lite_kb_model_status(kb, status);
+      return (
+        stale: status.ref.stale != 0,
+        reindexing: status.ref.reindexing != 0,
+        failed: status.ref.failed != 0,
+        failures: status.ref.failures,
+        reindexed: status.ref.reindexed,
+        fragments: status.ref.fragments,
+      );
+    } finally {
+      ffi.calloc.free(status);
+    }
+  }
+
+  void setReindexBatch(int fragments) {
+    unnu_rag_lite_set_reindex_batch(fragments);
+  }
+
+  /// Knowledge bases up to [fragments] are searched exactly in memory and
+  /// only get the HNSW index once they grow past it; 0 always uses the index.
+  void setExactSearchLimit(int fragments) {
+    unnu_rag_lite_set_exact_search_limit(fragments);
+  }
+
+  static RagMaintenanceStats maintenanceStats(int kb) {
+    final stats = ffi.calloc<UnnuRaglMaintenanceStats_t>();
+    try {
+      unnu_rag_lite_kb_maintenance_stats(kb, stats);
+      return (
+        fragments: stats.ref.fragments,
+        tombstones: stats.ref.tombstones,
+        fragmentation: stats.ref.fragmentation,
+        compactions: stats.ref.compactions,
+        ftsPending: stats.ref.fts_pending != 0,
+        ftsFailures: stats.ref.fts_failures,
+        compactFailures: stats.ref.compact_failures,
+      );
+    } finally {
+      ffi.calloc.free(stats);
+    }
+  }
+
   void _reset() {
     unnu_rag_lite_closeall_kb();
   }
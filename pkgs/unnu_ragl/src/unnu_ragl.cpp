@@ -1,7 +1,19 @@
 #include <map>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <cctype>
 #include <filesystem>
 #include <thread>
-#include <regex>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <future>
+#include <numeric>
+#include <stdexcept>
+#include <string_view>
 
 #include <tokenizers_cpp.h>
 #include <ctranslate2/encoder.h>
@@ -10,7 +22,7 @@
 #include <boost/uuid/uuid.hpp>
 #include <boost/uuid/uuid_io.hpp>
 #include <boost/uuid/uuid_generators.hpp>
-#include <pthreadpool.h>
+#include <boost/uuid/name_generator_sha1.hpp>
 
 #include <duckdb.hpp>
 #include <duckdb/main/db_instance_cache.hpp>
@@ -18,37 +30,209 @@
 #include "unnu_ragl.h"
 
 
-#if defined(__WIN32__) || defined(_WIN32) || defined(WIN32) || defined(__WINDOWS__) || defined(__TOS_WIN__)
-
-#include <windows.h>
-
-inline void delay(unsigned long ms)
-{
-	Sleep(ms);
-}
-
-#else  /* presume POSIX */
-
-#include <unistd.h>
-
-inline void delay(unsigned long ms)
-{
-	usleep(ms * 1000);
-}
-
-#endif
-
 // typedef std::unique_ptr<sentencepiece::SentencePieceProcessor> sentencepiece_processor_ptr;
 typedef std::unique_ptr<tokenizers::Tokenizer> tokenizer_ptr;
 typedef std::unique_ptr<ctranslate2::Encoder> ct2_encoder_ptr;
 
-static std::unique_ptr<duckdb::DuckDB> database = nullptr;
-static std::unique_ptr<duckdb::Connection> connection = nullptr;
-
-static std::unique_ptr<duckdb::PreparedStatement> pstmt = nullptr;
-
-static tokenizer_ptr _tokenizer = nullptr;
-static ct2_encoder_ptr _encoder = nullptr;
+class RaglDocumentWriter;
+
+// Statements prepared once per pooled connection, see _ragl_statement_sql.
+typedef enum ragl_statement : uint8_t {
+	RAGL_STMT_FTS_CANDIDATES,
+	RAGL_STMT_DELETE_EMBEDDINGS,
+	RAGL_STMT_DELETE_DOXMAP,
+	RAGL_STMT_DELETE_DOXINFO,
+	RAGL_STMT_RETRIEVE,
+	RAGL_STMT_INSERT_DOXINFO,
+	RAGL_STMT_LOOKUP_FRAGMENTS,
+	RAGL_STMT_PERSIST_QUERY,
+	RAGL_STMT_LOAD_QUERY_CACHE,
+	RAGL_STMT_CLEAR_QUERY_CACHE,
+	RAGL_STMT_DELETE_INT8_CODES,
+	RAGL_STMT_DELETE_BINARY_CODES,
+	RAGL_STMT_INT8_CANDIDATES,
+	RAGL_STMT_BINARY_CANDIDATES,
+	RAGL_STMT_DELETE_FULL,
+	RAGL_STMT_FULL_RESCORE,
+	RAGL_STMT_FRAGMENT_DOCUMENTS,
+	RAGL_STMT_SET_CORPUS,
+	RAGL_STMT_COUNT
+} ragl_statement_t;
+
+// A fragment an uncommitted transaction inserts, see _unnu_ragl_claim_fragment.
+typedef struct ragl_pending_fragment {
+	const RaglDocumentWriter* owner = nullptr;
+	// documents of other transactions that only mapped the fragment
+	int32_t waiters = 0;
+} ragl_pending_fragment_t;
+
+typedef struct ragl_pooled_connection {
+	std::unique_ptr<duckdb::Connection> conn;
+	std::unique_ptr<duckdb::PreparedStatement> statements[RAGL_STMT_COUNT];
+} ragl_pooled_connection_t;
+
+// Stored vectors of one load or one commit for exact search.
+typedef struct ragl_exact_segment {
+	// normalised vectors, one column per fragment
+	arma::fmat vectors;
+	std::vector<std::string> ids;
+	std::vector<std::string> texts;
+} ragl_exact_segment_t;
+
+// Snapshot of the stored vectors for exact search. Commits add a segment and
+// deletes tombstone fragment ids, each into a new snapshot sharing the
+// unchanged segments, so a query keeps ranking against the one it took.
+typedef struct ragl_exact_index {
+	std::vector<std::shared_ptr<const ragl_exact_segment_t>> segments;
+	// deleted fragments whose columns are still in the segments
+	std::unordered_set<std::string> tombstones;
+	// live fragments, the segment columns less the tombstones
+	int64_t fragments = 0;
+	size_t dims = 0;
+	// more than UNNU_RAGL_EXACT_SEARCH_LIMIT fragments, queries use the index
+	bool oversized = false;
+} ragl_exact_index_t;
+
+// segments kept before a snapshot is merged into one
+static constexpr size_t RAGL_EXACT_MAX_SEGMENTS = 16;
+
+// One open knowledge base: its DuckDB instance with the pooled connections,
+// the bulk writer and the BM25 maintenance state. Every knowledge base shares
+// the encoder, the tokenizer and the query cache.
+typedef struct ragl_kb {
+	int32_t handle = 0;
+	std::unique_ptr<duckdb::DuckDB> database;
+	// UNNU_RAGL_STORAGE_MODE when the knowledge base was opened
+	int32_t storage = 0;
+
+	// idle connections with their prepared statements, see RaglConnectionLease
+	std::mutex pool_mutex;
+	std::condition_variable pool_cv;
+	std::vector<std::unique_ptr<ragl_pooled_connection_t>> pool_idle;
+	size_t pool_open = 0;
+
+	std::mutex fts_rebuild_mutex;
+
+	// bumped on every committed change, invalidates cached query results
+	std::atomic<uint64_t> generation{ 0 };
+
+	std::mutex pending_fragments_mutex;
+	std::unordered_map<std::string, ragl_pending_fragment_t> pending_fragments;
+
+	std::mutex bulk_writer_mutex;
+	std::shared_ptr<RaglDocumentWriter> bulk_writer;
+
+	// documents handed to the shared ingestion pipeline and not yet written;
+	// closing waits for them and refuses new ones
+	std::mutex ingest_mutex;
+	std::condition_variable ingest_cv;
+	size_t ingest_inflight = 0;
+	bool closing = false;
+
+	std::mutex maintenance_mutex;
+	std::condition_variable maintenance_cv;
+	std::thread maintenance_thread;
+	bool maintenance_running = false;
+	uint64_t fts_dirty_generation = 0;
+	uint64_t fts_built_generation = 0;
+	std::chrono::steady_clock::time_point fts_dirty_since;
+	// consecutive failed BM25 rebuilds, the next one waits until fts_retry_at
+	int32_t fts_failures = 0;
+	std::chrono::steady_clock::time_point fts_retry_at;
+	// fragments deleted since the last HNSW compaction and checkpoint
+	int64_t tombstones = 0;
+	int64_t live_fragments = 0;
+	int64_t compactions = 0;
+	bool compact_requested = false;
+	// consecutive failed checkpoints, the next compaction waits until compact_retry_at
+	int32_t compact_failures = 0;
+	std::chrono::steady_clock::time_point compact_retry_at;
+	// last query or committed change, compaction waits for an idle window
+	std::chrono::steady_clock::time_point last_activity;
+	// a query found the knowledge base above UNNU_RAGL_EXACT_SEARCH_LIMIT
+	// without the HNSW index, the maintenance worker builds it
+	bool hnsw_requested = false;
+	std::atomic<bool> hnsw_indexed{ false };
+
+	// small knowledge bases are ranked exactly against this snapshot, see
+	// _unnu_ragl_exact_candidates. Loads and updates hold exact_write_mutex
+	// (commits across their COMMIT), queries only exact_mutex to copy it.
+	std::mutex exact_write_mutex;
+	std::mutex exact_mutex;
+	std::shared_ptr<const ragl_exact_index_t> exact;
+
+	// the stored vectors come from another model than the loaded encoder;
+	// queries use BM25 only and ingestion waits until the re-embedding swapped
+	std::atomic<bool> model_stale{ false };
+	std::mutex reindex_mutex;
+	std::condition_variable reindex_cv;
+	std::thread reindex_thread;
+	std::atomic<bool> reindex_running{ false };
+	int64_t reindexed = 0;
+	int64_t reindex_total = 0;
+	// consecutive failed steps; failed once the worker gave up, which refuses
+	// ingestion until the next model check
+	int32_t reindex_failures = 0;
+	bool reindex_failed = false;
+	// set on close, no worker starts and waiting ingestion is refused
+	bool reindex_closed = false;
+} ragl_kb_t;
+
+typedef std::shared_ptr<ragl_kb_t> ragl_kb_ptr;
+
+static std::mutex _kb_registry_mutex;
+static std::map<int32_t, ragl_kb_ptr> _kb_registry;
+static int32_t _kb_next_handle = 1;
+// knowledge base of the API without handles, see unnu_rag_lite_open_kb
+static int32_t _kb_default = 0;
+
+static std::atomic<uint64_t> _query_settings_version(0);
+
+// Embedding model. Workers hold their own reference for a batch (the pipeline
+// for a whole document), so unnu_rag_lite_init can swap it while the previous
+// one is still tokenizing or encoding.
+typedef struct ragl_model {
+	// directory name of the model, recorded per knowledge base and part of
+	// the fragment address space
+	std::string id;
+	ct2_encoder_ptr encoder;
+	tokenizer_ptr tokenizer;
+	// special tokens the tokenizer wraps every sequence in, split into the ones
+	// before and after the content (e.g. [CLS] / [SEP], <s> / </s>)
+	std::vector<size_t> prefix;
+	std::vector<size_t> suffix;
+} ragl_model_t;
+
+typedef std::shared_ptr<const ragl_model_t> ragl_model_ptr;
+
+static std::mutex _model_mutex;
+static ragl_model_ptr _model = nullptr;
+
+// Optional cross-encoder used to re-rank the fused top candidates. CTranslate2
+// converts the encoder and its pooler but not the classification layer on top,
+// so its weights are read from classifier.txt next to the model; without one
+// the pooler output itself has to be the 1 or 2 relevance logits.
+typedef struct ragl_reranker {
+	ct2_encoder_ptr encoder;
+	tokenizer_ptr tokenizer;
+	// special tokens in front of a tokenized sequence, see _unnu_ragl_special_prefix
+	size_t prefix = 0;
+	// classifier head, logits = weight (labels x hidden, row-major) * pooled + bias
+	size_t labels = 0;
+	size_t hidden = 0;
+	std::vector<float> weight;
+	std::vector<float> bias;
+} ragl_reranker_t;
+
+// queries hold their own reference, so init_reranker can swap it at any time
+static std::mutex _reranker_mutex;
+static std::shared_ptr<const ragl_reranker_t> _reranker = nullptr;
+
+static std::mutex _tokenizer_mutex;
+
+static std::mutex _encoder_slots_mutex;
+static std::condition_variable _encoder_slots_cv;
+static int32_t _encoder_inflight_batches = 0;
 
 static UnnuRaglResponseCallback response_cb = nullptr;
 
@@ -60,12 +244,68 @@ static bool UNNU_RAGL_PARAGRAPH_CHUNKING = true;
 
 static int32_t UNNU_RAGL_CHUNKING_SIZE = 384;
 
+static int32_t UNNU_RAGL_CHUNKING_TOKENS = 0; // 0 - chunk by UNNU_RAGL_CHUNKING_SIZE characters
+
+static int32_t UNNU_RAGL_CHUNKING_OVERLAP_TOKENS = 32;
+
 static int32_t UNNU_RAGL_QUERY_RESULT_LIMIT = 5;
 
+static int32_t UNNU_RAGL_CANDIDATE_LIMIT = 20;
+
+static int32_t UNNU_RAGL_FUSION_STRATEGY = 0; // 0 - weighted sum, 1 - reciprocal rank fusion
+
+static float UNNU_RAGL_FUSION_EMBEDDING_WEIGHT = 0.8f;
+
+static float UNNU_RAGL_FUSION_FTS_WEIGHT = 0.2f;
+
+static int32_t UNNU_RAGL_RRF_K = 60;
+
+static int32_t UNNU_RAGL_RERANK_LIMIT = 10;
+
+static int32_t UNNU_RAGL_RERANK_MAX_TOKENS = 512;
+
 static int32_t UNNU_RAGL_MAX_QUEUED_BATCHES = 512;
 
+static int32_t UNNU_RAGL_MAX_BATCH_TOKENS = 8192;
+
+static int32_t UNNU_RAGL_REINDEX_BATCH = 256; // fragments re-embedded and staged per transaction after a model change
+
 static int32_t UNNU_RAGL_POOLING_TYPE = 0; // 0 - mean, 1 - cls, 2 - max
 
+static int32_t UNNU_RAGL_FTS_DEBOUNCE_MS = 2000;
+
+static float UNNU_RAGL_COMPACT_RATIO = 0.1f; // tombstones per fragment that trigger compaction right away
+
+static int32_t UNNU_RAGL_COMPACT_IDLE_MS = 30000; // any tombstone is compacted after this long without activity
+
+static int32_t UNNU_RAGL_BULK_COMMIT_DOCUMENTS = 1;
+
+static int32_t UNNU_RAGL_QUERY_CACHE_CAPACITY = 256;
+
+static bool UNNU_RAGL_QUERY_CACHE_PERSIST = false;
+
+static int32_t UNNU_RAGL_ENCODER_THREADS = 0; // 0 - half the cores per replica
+
+static int32_t UNNU_RAGL_INGEST_THREADS = 0; // 0 - a quarter of the cores
+
+static int32_t UNNU_RAGL_PIPELINE_DEPTH = 8;
+
+static int32_t UNNU_RAGL_DB_THREADS = 0; // 0 - DuckDB default
+
+static int32_t UNNU_RAGL_INGEST_THROTTLE = -1; // -1 - unthrottled, 0 - paused, N - at most N batches in flight
+
+static int32_t UNNU_RAGL_CONNECTION_POOL_SIZE = 4; // connections per knowledge base
+
+static int32_t UNNU_RAGL_STORAGE_MODE = 0; // 0 - float with HNSW, 1 - int8 codes, 2 - binary codes
+
+static int32_t UNNU_RAGL_RESCORE_FACTOR = 4; // quantized shortlist per candidate rescored with the float vectors
+
+static int32_t UNNU_RAGL_FILTER_EXACT_LIMIT = 50000; // filtered queries scan up to this many fragments exactly instead of the index
+
+static int32_t UNNU_RAGL_EXACT_SEARCH_LIMIT = 20000; // up to this many fragments are ranked exactly in memory and the HNSW index is deferred, 0 - always HNSW
+
+static bool UNNU_RAGL_KEEP_FULL_VECTORS = false; // keep untruncated vectors for rescoring when dims < hidden
+
 std::string _loadBytesFromFile(const std::string& path) {
 	std::ifstream fs(path, std::ios::in | std::ios::binary);
 	if (fs.fail()) {
@@ -81,7 +321,7 @@ std::string _loadBytesFromFile(const std::string& path) {
 	return data;
 }
 
-void unnu_rag_lite_init(const char* path) {
+static ct2_encoder_ptr _unnu_ragl_load_encoder(const char* path) {
 	const ctranslate2::Device device = ctranslate2::str_to_device("auto");
 
 	std::vector<int> device_indices = { 0 };
@@ -99,9 +339,23 @@ void unnu_rag_lite_init(const char* path) {
 			_config.max_queued_batches = UNNU_RAGL_MAX_QUEUED_BATCHES;
 		}
 	}
+	if (UNNU_RAGL_ENCODER_THREADS > 0) {
+		_config.num_threads_per_replica = UNNU_RAGL_ENCODER_THREADS;
+	}
+
+	return std::make_unique<ctranslate2::Encoder>(path, device, ctranslate2::ComputeType::INT8, device_indices, false, _config);
+}
 
-	_encoder = std::make_unique<ctranslate2::Encoder>(path, device, ctranslate2::ComputeType::INT8, device_indices, false, _config);
+static void _unnu_ragl_cache_clear();
 
+static std::vector<ragl_kb_ptr> _unnu_ragl_all_kbs();
+static void _unnu_ragl_check_model(ragl_kb_t& kb);
+static void _unnu_ragl_stop_reindex(ragl_kb_t& kb);
+
+static size_t _unnu_ragl_special_prefix(tokenizers::Tokenizer* tokenizer);
+static void _unnu_ragl_special_tokens(tokenizers::Tokenizer* tokenizer, std::vector<size_t>& prefix, std::vector<size_t>& suffix);
+
+static tokenizer_ptr _unnu_ragl_load_tokenizer(const char* path) {
 	std::filesystem::path _spm_path(path);
 	_spm_path /= "tokenizer.json";
 
@@ -110,649 +364,4690 @@ void unnu_rag_lite_init(const char* path) {
 
 	// Note: all the current factory APIs takes in-memory blob as input.
 	// This gives some flexibility on how these blobs can be read.
-	_tokenizer = tokenizers::Tokenizer::FromBlobJSON(blob);
+	return tokenizers::Tokenizer::FromBlobJSON(blob);
 }
 
-void _unnu_overwrite_fts_index(int* errorCode) {
+void unnu_rag_lite_init(const char* path) {
+	// staged vectors must all come from one encoder
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		_unnu_ragl_stop_reindex(*kb);
+	}
+	std::shared_ptr<ragl_model_t> model = std::make_shared<ragl_model_t>();
+	std::filesystem::path _model_path = std::filesystem::path(path).lexically_normal();
+	model->id = _model_path.has_filename() ? _model_path.filename().string() : _model_path.parent_path().filename().string();
+	model->encoder = _unnu_ragl_load_encoder(path);
+	model->tokenizer = _unnu_ragl_load_tokenizer(path);
+	_unnu_ragl_special_tokens(model->tokenizer.get(), model->prefix, model->suffix);
+	{
+		std::lock_guard<std::mutex> lock(_model_mutex);
+		_model = std::move(model);
+	}
+	_unnu_ragl_cache_clear();
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		_unnu_ragl_check_model(*kb);
+	}
+}
 
-	duckdb::Connection conn(*database);
+static ragl_model_ptr _unnu_ragl_model() {
+	std::lock_guard<std::mutex> lock(_model_mutex);
+	return _model;
+}
 
-	std::string query = "pragma create_fts_index(embeddings, frag_id,'text',stemmer = 'porter',stopwords = 'english', strip_accents = 1,lower = 1,overwrite = 1);";
-	auto result = conn.Query(query);
-	if (result->HasError()) {
+// Reads the sequence-classification layer exported next to a cross-encoder:
+// "labels hidden", then labels x hidden weights row by row, then labels
+// biases, all whitespace separated. Only 1 (relevance) or 2 (irrelevant,
+// relevant) labels are accepted.
+static bool _unnu_ragl_load_classifier(const char* path, ragl_reranker_t& reranker) {
+	std::filesystem::path _classifier_path(path);
+	_classifier_path /= "classifier.txt";
+	std::ifstream fs(_classifier_path);
+	if (fs.fail()) {
+		return false;
+	}
+	size_t labels = 0;
+	size_t hidden = 0;
+	fs >> labels >> hidden;
+	if (fs.fail() || labels < 1 || labels > 2 || hidden == 0) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: %s has %zu labels, a relevance head has 1 or 2\n", _classifier_path.generic_string().c_str(), labels);
+#endif
+		return false;
+	}
+	std::vector<float> weight(labels * hidden);
+	std::vector<float> bias(labels);
+	for (float& w : weight) {
+		fs >> w;
+	}
+	for (float& b : bias) {
+		fs >> b;
+	}
+	if (fs.fail()) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: %s is truncated\n", _classifier_path.generic_string().c_str());
+#endif
+		return false;
+	}
+	reranker.labels = labels;
+	reranker.hidden = hidden;
+	reranker.weight = std::move(weight);
+	reranker.bias = std::move(bias);
+	return true;
+}
 
+void unnu_rag_lite_init_reranker(const char* path, int* errorCode) {
+	std::shared_ptr<ragl_reranker_t> reranker;
+	if (path != nullptr) {
+		// _loadBytesFromFile exits on a missing file; a failed load keeps the
+		// previous reranker
+		std::filesystem::path _tokenizer_path(path);
+		_tokenizer_path /= "tokenizer.json";
+		std::error_code ec;
+		if (!std::filesystem::is_regular_file(_tokenizer_path, ec)) {
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: _unnu_create_fts_index creating fts_index embedding %s\n", result->GetError().c_str());
+			fprintf(stderr, "error: reranker has no %s\n", _tokenizer_path.generic_string().c_str());
 #endif
-		* errorCode = 5642;
+			*errorCode = 5642;
+			return;
+		}
+		try {
+			reranker = std::make_shared<ragl_reranker_t>();
+			reranker->encoder = _unnu_ragl_load_encoder(path);
+			reranker->tokenizer = _unnu_ragl_load_tokenizer(path);
+			reranker->prefix = _unnu_ragl_special_prefix(reranker->tokenizer.get());
+			_unnu_ragl_load_classifier(path, *reranker);
+		}
+		catch (const std::exception& e) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: loading reranker %s %s\n", path, e.what());
+#endif
+			*errorCode = 5642;
+			return;
+		}
 	}
+	{
+		// a query still re-ranking keeps the previous model alive
+		std::lock_guard<std::mutex> lock(_reranker_mutex);
+		_reranker = std::move(reranker);
+	}
+	_query_settings_version++;
 }
 
-void _unnu_ragl_db_setup(int embedsize, int* errorCode) {
-	duckdb::Connection conn(*database);
+static std::shared_ptr<const ragl_reranker_t> _unnu_ragl_reranker() {
+	std::lock_guard<std::mutex> lock(_reranker_mutex);
+	return _reranker;
+}
 
-	std::string query = "CREATE TABLE IF NOT EXISTS embeddings (frag_id VARCHAR(64) UNIQUE NOT NULL, text VARCHAR, embedding FLOAT[";
-	query = query.append(std::to_string(embedsize)).append("]);");
-	auto result = conn.Query(query);
-	if (result->HasError()) {
+static std::vector<size_t> _unnu_ragl_tokenize(tokenizers::Tokenizer* tokenizer, const std::string& input) {
+	std::vector<int32_t> ids;
+	{
+		// the tokenizer handle keeps per-call state, so calls are serialised
+		std::lock_guard<std::mutex> lock(_tokenizer_mutex);
+		ids = tokenizer->Encode(input);
+	}
+	std::vector<size_t> _encoder_ids;
+	_encoder_ids.reserve(ids.size());
+	std::transform(ids.begin(), ids.end(), std::back_inserter(_encoder_ids),
+		[](int32_t value) { return static_cast<size_t>(value); });
+	return _encoder_ids;
+}
 
-#if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: creating table embeddings %s\n", result->GetError().c_str());
-#endif
-		* errorCode = 5642;
-		return;
+static std::vector<std::vector<size_t>> _unnu_ragl_tokenize_batch(const ragl_model_t& model, const std::vector<std::string>& inputs) {
+	std::vector<std::vector<int32_t>> ids;
+	{
+		std::lock_guard<std::mutex> lock(_tokenizer_mutex);
+		ids = model.tokenizer->EncodeBatch(inputs);
+	}
+	std::vector<std::vector<size_t>> _encoder_ids(ids.size());
+	for (size_t i = 0; i < ids.size(); i++) {
+		_encoder_ids[i].reserve(ids[i].size());
+		std::transform(ids[i].begin(), ids[i].end(), std::back_inserter(_encoder_ids[i]),
+			[](int32_t value) { return static_cast<size_t>(value); });
 	}
+	return _encoder_ids;
+}
 
-	query = "CREATE TABLE IF NOT EXISTS doxinfo (document_id VARCHAR(64) NOT NULL, uri VARCHAR, embedding_size INTEGER, PRIMARY KEY (document_id, uri));";
-	result = conn.Query(query);
-	if (result->HasError()) {
+static ragl_kb_ptr _unnu_ragl_kb(int32_t handle) {
+	std::lock_guard<std::mutex> lock(_kb_registry_mutex);
+	auto found = _kb_registry.find(handle);
+	return found != _kb_registry.end() ? found->second : nullptr;
+}
 
-#if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: creating table doxinfo: %s\n", result->GetError().c_str());
-#endif
-		* errorCode = 5642;
-		return;
+static const char* _ragl_statement_sql[RAGL_STMT_COUNT] = {
+	// BM25 candidates for the hybrid query; the vector candidates are planned
+	// per query, see _unnu_ragl_vector_candidates
+	"SELECT frag_id, text, score FROM (SELECT frag_id, text, fts_main_embeddings.match_bm25(frag_id, $1) AS score FROM embeddings) sq "
+	"WHERE score IS NOT NULL ORDER BY score DESC LIMIT $2;",
+	// fragments are shared between documents with the same text, only drop
+	// the ones no other document maps to
+	"WITH fragments AS (SELECT frag_id FROM doxmap INNER JOIN doxinfo ON doxmap.document_id = doxinfo.document_id WHERE doxinfo.document_id = $1 AND doxinfo.uri = $2), "
+	"shared AS (SELECT DISTINCT frag_id FROM doxmap WHERE document_id <> $1) "
+	"DELETE FROM embeddings USING fragments WHERE embeddings.frag_id = fragments.frag_id AND embeddings.frag_id NOT IN (SELECT frag_id FROM shared) RETURNING frag_id;",
+	"WITH documents AS (SELECT document_id FROM doxinfo WHERE document_id = $1 AND uri = $2) "
+	"DELETE FROM doxmap USING documents WHERE doxmap.document_id = documents.document_id;",
+	"DELETE FROM doxinfo WHERE document_id = $1 AND uri = $2;",
+	"SELECT embeddings.frag_id, embeddings.text, embeddings.embedding FROM embeddings INNER JOIN doxmap ON embeddings.frag_id = doxmap.frag_id WHERE doxmap.document_id = $1;",
+	"INSERT INTO doxinfo VALUES ($1, $2, $3);",
+	"SELECT frag_id, text, embedding FROM embeddings WHERE frag_id IN (SELECT unnest($1));",
+	"INSERT OR REPLACE INTO query_cache VALUES ($1, $2, $3, current_timestamp);",
+	"SELECT query, embedding FROM (SELECT query, embedding, used_at FROM query_cache WHERE pooling = $1 ORDER BY used_at DESC LIMIT $2) ORDER BY used_at ASC;",
+	"DELETE FROM query_cache;",
+	"WITH fragments AS (SELECT frag_id FROM doxmap INNER JOIN doxinfo ON doxmap.document_id = doxinfo.document_id WHERE doxinfo.document_id = $1 AND doxinfo.uri = $2), "
+	"shared AS (SELECT DISTINCT frag_id FROM doxmap WHERE document_id <> $1) "
+	"DELETE FROM codes_int8 USING fragments WHERE codes_int8.frag_id = fragments.frag_id AND codes_int8.frag_id NOT IN (SELECT frag_id FROM shared);",
+	"WITH fragments AS (SELECT frag_id FROM doxmap INNER JOIN doxinfo ON doxmap.document_id = doxinfo.document_id WHERE doxinfo.document_id = $1 AND doxinfo.uri = $2), "
+	"shared AS (SELECT DISTINCT frag_id FROM doxmap WHERE document_id <> $1) "
+	"DELETE FROM codes_binary USING fragments WHERE codes_binary.frag_id = fragments.frag_id AND codes_binary.frag_id NOT IN (SELECT frag_id FROM shared);",
+	// shortlist by the codes, rescored with the float vectors kept on disk
+	"WITH shortlist AS (SELECT frag_id FROM codes_int8 ORDER BY list_dot_product(code::FLOAT[], $1::FLOAT[]) * scale DESC LIMIT $2) "
+	"SELECT embeddings.frag_id, embeddings.text, 1.0 - list_cosine_similarity(embeddings.embedding::FLOAT[], $1::FLOAT[]) AS distance "
+	"FROM embeddings INNER JOIN shortlist ON embeddings.frag_id = shortlist.frag_id ORDER BY distance LIMIT $3;",
+	"WITH shortlist AS (SELECT frag_id FROM codes_binary ORDER BY bit_count(xor(code, $2::BIT)) LIMIT $3) "
+	"SELECT embeddings.frag_id, embeddings.text, 1.0 - list_cosine_similarity(embeddings.embedding::FLOAT[], $1::FLOAT[]) AS distance "
+	"FROM embeddings INNER JOIN shortlist ON embeddings.frag_id = shortlist.frag_id ORDER BY distance LIMIT $4;",
+	"WITH fragments AS (SELECT frag_id FROM doxmap INNER JOIN doxinfo ON doxmap.document_id = doxinfo.document_id WHERE doxinfo.document_id = $1 AND doxinfo.uri = $2), "
+	"shared AS (SELECT DISTINCT frag_id FROM doxmap WHERE document_id <> $1) "
+	"DELETE FROM embeddings_full USING fragments WHERE embeddings_full.frag_id = fragments.frag_id AND embeddings_full.frag_id NOT IN (SELECT frag_id FROM shared);",
+	"SELECT frag_id, 1.0 - list_cosine_similarity(embedding, $1::FLOAT[]) AS distance FROM embeddings_full WHERE frag_id IN (SELECT unnest($2));",
+	"SELECT frag_id, string_agg(document_id, ',' ORDER BY document_id) FROM doxmap WHERE frag_id IN (SELECT unnest($1)) GROUP BY frag_id;",
+	"UPDATE doxmap SET corpus = $2 WHERE document_id = $1;"
+};
+
+// Borrows a connection of the knowledge base for one operation. Up to
+// UNNU_RAGL_CONNECTION_POOL_SIZE connections are opened, further borrowers
+// wait; a returned connection keeps its prepared statements for the next one.
+class RaglConnectionLease {
+public:
+	explicit RaglConnectionLease(ragl_kb_t& kb) : kb(kb) {
+		std::unique_lock<std::mutex> lock(kb.pool_mutex);
+		const size_t limit = std::max(UNNU_RAGL_CONNECTION_POOL_SIZE, 1);
+		kb.pool_cv.wait(lock, [&kb, limit]() { return !kb.pool_idle.empty() || kb.pool_open < limit; });
+		if (!kb.pool_idle.empty()) {
+			pooled = std::move(kb.pool_idle.back());
+			kb.pool_idle.pop_back();
+			return;
+		}
+		pooled = std::make_unique<ragl_pooled_connection_t>();
+		pooled->conn = std::make_unique<duckdb::Connection>(*kb.database);
+		kb.pool_open++;
 	}
 
-	query = "CREATE TABLE IF NOT EXISTS doxmap (document_id VARCHAR(64) NOT NULL, frag_id VARCHAR(64) NOT NULL, PRIMARY KEY (document_id, frag_id));";
-	result = conn.Query(query);
-	if (result->HasError()) {
+	~RaglConnectionLease() {
+		{
+			std::lock_guard<std::mutex> lock(kb.pool_mutex);
+			kb.pool_idle.push_back(std::move(pooled));
+		}
+		kb.pool_cv.notify_one();
+	}
+
+	RaglConnectionLease(const RaglConnectionLease&) = delete;
+	RaglConnectionLease& operator=(const RaglConnectionLease&) = delete;
+
+	duckdb::Connection& Conn() {
+		return *pooled->conn;
+	}
 
+	// nullptr while the statement cannot be prepared, e.g. before the FTS
+	// index exists; preparing is retried on the next call
+	duckdb::PreparedStatement* Statement(ragl_statement_t id) {
+		std::unique_ptr<duckdb::PreparedStatement>& statement = pooled->statements[id];
+		if (statement == nullptr) {
+			auto prepared = pooled->conn->Prepare(_ragl_statement_sql[id]);
+			if (prepared->HasError()) {
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: creating table doxmap %s\n", result->GetError().c_str());
+				fprintf(stderr, "error: preparing statement %d %s\n", static_cast<int>(id), prepared->GetError().c_str());
 #endif
-		* errorCode = 5642;
-		return;
+				return nullptr;
+			}
+			statement = std::move(prepared);
+		}
+		return statement.get();
 	}
 
-	result = conn.Query("Load VSS;");
-	if (result->HasError()) {
+private:
+	ragl_kb_t& kb;
+	std::unique_ptr<ragl_pooled_connection_t> pooled;
+};
 
-#if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: loading vss extension %s\n", result->GetError().c_str());
-#endif
-		* errorCode = 5642;
-		return;
+static int32_t _unnu_ragl_default_handle() {
+	std::lock_guard<std::mutex> lock(_kb_registry_mutex);
+	return _kb_default;
+}
+
+static ragl_kb_ptr _unnu_ragl_default_kb() {
+	return _unnu_ragl_kb(_unnu_ragl_default_handle());
+}
+
+static std::vector<ragl_kb_ptr> _unnu_ragl_all_kbs() {
+	std::lock_guard<std::mutex> lock(_kb_registry_mutex);
+	std::vector<ragl_kb_ptr> kbs;
+	kbs.reserve(_kb_registry.size());
+	for (auto& it : _kb_registry) {
+		kbs.push_back(it.second);
 	}
+	return kbs;
+}
 
-	result = conn.Query("SET GLOBAL hnsw_enable_experimental_persistence = true;");
+// Rebuilds the BM25 index inside one transaction, so concurrent queries keep
+// reading the previous index until the new one is committed.
+void _unnu_overwrite_fts_index(ragl_kb_t& kb, int* errorCode) {
+	std::lock_guard<std::mutex> rebuild(kb.fts_rebuild_mutex);
+
+	RaglConnectionLease lease(kb);
+	duckdb::Connection& conn = lease.Conn();
+
+	auto result = conn.Query("BEGIN TRANSACTION;");
 	if (result->HasError()) {
 
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: enabling hnsw persistence %s\n", result->GetError().c_str());
+		fprintf(stderr, "error: _unnu_create_fts_index starting transaction %s\n", result->GetError().c_str());
 #endif
 		* errorCode = 5642;
 		return;
 	}
 
-	query = "CREATE INDEX IF NOT EXISTS embeddings_hnsw_index ON embeddings USING HNSW(embedding) WITH (metric = 'cosine');";
+	std::string query = "pragma create_fts_index(embeddings, frag_id,'text',stemmer = 'porter',stopwords = 'english', strip_accents = 1,lower = 1,overwrite = 1);";
 	result = conn.Query(query);
 	if (result->HasError()) {
 
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: creating index embedding_hsnw %s\n", result->GetError().c_str());
+		fprintf(stderr, "error: _unnu_create_fts_index creating fts_index embedding %s\n", result->GetError().c_str());
 #endif
+		conn.Query("ROLLBACK;");
 		* errorCode = 5642;
 		return;
 	}
 
-	result = conn.Query("pragma create_fts_index(embeddings, frag_id,'text',stemmer = 'porter',stopwords = 'english', strip_accents = 1,lower = 1,overwrite = 0);");
+	result = conn.Query("COMMIT;");
 	if (result->HasError()) {
 
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: creating ftx_index embeddings %s\n", result->GetError().c_str());
-#endif
-		result = conn.Query("pragma create_fts_index(embeddings, frag_id,'text',stemmer = 'porter',stopwords = 'english', strip_accents = 1,lower = 1,overwrite = 1);");
-		if (result->HasError()) {
-
-#if defined(_DEBUG) || defined(DEBUG)
-			fprintf(stderr, "error: overwriting fts_index embedding %s\n", result->GetError().c_str());
+		fprintf(stderr, "error: _unnu_create_fts_index committing fts_index %s\n", result->GetError().c_str());
 #endif
-			* errorCode = 5642;
-		}
+		* errorCode = 5642;
 	}
+}
 
-	std::string select = "with fts as (select text, fts_main_embeddings.match_bm25(frag_id,$1) as score from embeddings), ";
-	select.append("embd as (select text, array_cosine_distance(embedding, $2 ) as score from embeddings), ");
-	select.append("normalized_scores as (select fts.text, fts.score as raw_fts_score, embd.score as raw_embd_score, ");
-	select.append("(fts.score / (select max(score) from fts)) as norm_fts_score, ((embd.score + 1) / (select max(score) + 1 from embd)) as norm_embd_score ");
-	select.append("from	fts	inner join embd on fts.frag_id = embd.frag_id) ");
-	select.append("select text, (0.8 * norm_embd_score + 0.2 * norm_fts_score) as score_cc from normalized_scores order by score_cc desc limit $3;");
+// Marks the BM25 index stale. Ingest and delete only record the change; the
+// maintenance worker rebuilds once no new change arrived for the debounce window.
+static void _unnu_ragl_mark_fts_dirty(ragl_kb_t& kb) {
+	{
+		std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+		kb.fts_dirty_generation++;
+		kb.fts_dirty_since = std::chrono::steady_clock::now();
+		kb.last_activity = kb.fts_dirty_since;
+	}
+	kb.maintenance_cv.notify_all();
+}
 
-	pstmt = std::unique_ptr<duckdb::PreparedStatement>((*connection).Prepare(select));
+// Marks a committed change to the knowledge base: invalidates cached query
+// results and schedules the BM25 rebuild.
+static void _unnu_ragl_kb_changed(ragl_kb_t& kb) {
+	kb.generation++;
+	_unnu_ragl_mark_fts_dirty(kb);
+}
 
-	*errorCode = 0;
+// Delay before retrying failed maintenance: 1s doubling up to a minute.
+static std::chrono::milliseconds _unnu_ragl_retry_delay(int32_t failures) {
+	const int32_t doublings = std::min(std::max(failures - 1, 0), 6);
+	return std::chrono::milliseconds(std::min<int64_t>(1000LL << doublings, 60000));
 }
 
-void unnu_rag_lite_delete(const char* document_id, const char* uri) {
-	// see https://www.sqlite.org/fts5.html#the_delete_command
-	// https://duckdb.org/docs/stable/core_extensions/full_text_search
+static void _unnu_ragl_flush_fts(ragl_kb_t& kb) {
+	uint64_t generation;
+	{
+		std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+		generation = kb.fts_dirty_generation;
+		if (generation == kb.fts_built_generation) {
+			return;
+		}
+	}
+
+	int errorCode = 0;
+	_unnu_overwrite_fts_index(kb, &errorCode);
+	std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+	if (errorCode == 0) {
+		kb.fts_built_generation = std::max(kb.fts_built_generation, generation);
+		kb.fts_failures = 0;
+	}
+	else {
+		// the worker would otherwise retry at once for as long as the error lasts
+		kb.fts_failures++;
+		kb.fts_retry_at = std::chrono::steady_clock::now() + _unnu_ragl_retry_delay(kb.fts_failures);
+	}
+}
 
-	duckdb::Connection conn(*database);
+static void _unnu_ragl_touch(ragl_kb_t& kb) {
+	std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+	kb.last_activity = std::chrono::steady_clock::now();
+}
 
-	std::string deleteEmbeddingsSQL = "WITH fragments AS (SELECT frag_id FROM doxmap INNER JOIN doxinfo on doxmap.document_id = doxinfo.document_id WHERE doxinfo.document_id = '";  
-	deleteEmbeddingsSQL.append(document_id).append("' AND doxinfo.uri = '").append(uri).append("') DELETE FROM embeddings USING fragments WHERE embeddings.frag_id = fragments.frag_id;");
+// Records fragments a delete dropped; compaction is requested right away once
+// the tombstones reach UNNU_RAGL_COMPACT_RATIO of the fragments, otherwise it
+// waits for an idle window.
+static void _unnu_ragl_add_tombstones(ragl_kb_t& kb, int64_t deleted, int64_t live) {
+	{
+		std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+		kb.tombstones += deleted;
+		kb.live_fragments = live;
+		if (kb.tombstones > 0 && kb.tombstones >= UNNU_RAGL_COMPACT_RATIO * std::max<int64_t>(live + kb.tombstones, 1)) {
+			kb.compact_requested = true;
+		}
+	}
+	kb.maintenance_cv.notify_all();
+}
 
-	auto result = conn.Query(deleteEmbeddingsSQL);
+// Creates the HNSW index once the knowledge base holds more than
+// UNNU_RAGL_EXACT_SEARCH_LIMIT fragments. Below that exact search answers the
+// queries, and the graph would only cost build time, memory and slower inserts.
+// An index built while the knowledge base was larger is kept.
+static bool _unnu_ragl_ensure_hnsw(ragl_kb_t& kb, duckdb::Connection& conn) {
+	if (kb.storage != 0) {
+		kb.hnsw_indexed = false;
+		return true;
+	}
+	auto result = conn.Query("SELECT (SELECT count(*) FROM embeddings), (SELECT count(*) FROM duckdb_indexes() WHERE index_name = 'embeddings_hnsw_index');");
 	if (result->HasError()) {
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: deleting embedding for %s:  %s\n", uri, result->GetError().c_str());
+		fprintf(stderr, "error: checking embedding_hsnw_index %s\n", result->GetError().c_str());
 #endif
-		return;
+		return false;
+	}
+	const int64_t fragments = result->GetValue(0, 0).GetValue<int64_t>();
+	kb.hnsw_indexed = result->GetValue(1, 0).GetValue<int64_t>() > 0;
+	if (kb.hnsw_indexed || (UNNU_RAGL_EXACT_SEARCH_LIMIT > 0 && fragments <= UNNU_RAGL_EXACT_SEARCH_LIMIT)) {
+		return true;
 	}
 
-	std::string deleteDoxmapSQL = "WITH documents AS (SELECT document_id FROM doxinfo WHERE document_id = '";
-	deleteDoxmapSQL.append(document_id).append("' AND uri = '").append(uri).append("') DELETE FROM doxmap USING documents WHERE doxmap.document_id = documents.document_id;");
-
-
-	result = conn.Query(deleteDoxmapSQL);
+	result = conn.Query("CREATE INDEX IF NOT EXISTS embeddings_hnsw_index ON embeddings USING HNSW(embedding) WITH (metric = 'cosine');");
 	if (result->HasError()) {
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: deleting doxmap for %s:  %s\n", uri, result->GetError().c_str());
+		fprintf(stderr, "error: creating index embedding_hsnw %s\n", result->GetError().c_str());
 #endif
+		return false;
+	}
+	kb.hnsw_indexed = true;
+	return true;
+}
+
+static void _unnu_ragl_update_hnsw(ragl_kb_t& kb) {
+	if (kb.storage != 0 || kb.hnsw_indexed) {
 		return;
 	}
+	RaglConnectionLease lease(kb);
+	_unnu_ragl_ensure_hnsw(kb, lease.Conn());
+}
+
+static void _unnu_ragl_request_hnsw(ragl_kb_t& kb) {
+	{
+		std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+		kb.hnsw_requested = true;
+	}
+	kb.maintenance_cv.notify_all();
+}
+
+// Snapshot segment of the given rows (dims floats each, row after row);
+// imported vectors need not be unit length, zero columns stay zero.
+static std::shared_ptr<const ragl_exact_segment_t> _unnu_ragl_exact_segment(std::vector<std::string> ids, std::vector<std::string> texts, const float* vectors, size_t dims) {
+	auto segment = std::make_shared<ragl_exact_segment_t>();
+	segment->vectors = arma::normalise(arma::fmat(vectors, dims, ids.size()), 2, 0);
+	segment->ids = std::move(ids);
+	segment->texts = std::move(texts);
+	return segment;
+}
+
+// Folds the segments into one and drops the tombstoned columns.
+static void _unnu_ragl_exact_merge(ragl_exact_index_t& index) {
+	size_t live = 0;
+	for (const auto& segment : index.segments) {
+		for (const std::string& id : segment->ids) {
+			live += index.tombstones.count(id) == 0 ? 1 : 0;
+		}
+	}
+	auto merged = std::make_shared<ragl_exact_segment_t>();
+	merged->vectors.set_size(index.dims, live);
+	merged->ids.reserve(live);
+	merged->texts.reserve(live);
+	for (const auto& segment : index.segments) {
+		for (size_t col = 0; col < segment->ids.size(); col++) {
+			if (index.tombstones.count(segment->ids[col]) > 0) {
+				continue;
+			}
+			merged->vectors.col(merged->ids.size()) = segment->vectors.col(col);
+			merged->ids.push_back(segment->ids[col]);
+			merged->texts.push_back(segment->texts[col]);
+		}
+	}
+	index.segments.assign(1, merged);
+	index.tombstones.clear();
+	index.fragments = static_cast<int64_t>(live);
+}
 
-	std::string deleteDoxInfoSQL = "DELETE FROM doxinfo WHERE document_id = '";
-	deleteDoxInfoSQL.append(document_id).append("' AND uri = '").append(uri).append("';");
+// Installs the next snapshot, nullptr to have the next query load it again.
+// Callers hold exact_write_mutex; the merge runs here, off the query path.
+static void _unnu_ragl_exact_publish(ragl_kb_t& kb, std::shared_ptr<ragl_exact_index_t> next) {
+	if (next != nullptr && !next->oversized && (next->segments.size() > RAGL_EXACT_MAX_SEGMENTS || next->tombstones.size() * 4 > static_cast<size_t>(std::max<int64_t>(next->fragments, 0)))) {
+		_unnu_ragl_exact_merge(*next);
+	}
+	std::lock_guard<std::mutex> lock(kb.exact_mutex);
+	kb.exact = std::move(next);
+}
 
+static std::shared_ptr<const ragl_exact_index_t> _unnu_ragl_exact_current(ragl_kb_t& kb) {
+	std::lock_guard<std::mutex> lock(kb.exact_mutex);
+	return kb.exact;
+}
 
-	result = conn.Query(deleteDoxInfoSQL);
-	if (result->HasError()) {
-#if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: deleting doxinfo for %s:  %s\n", uri, result->GetError().c_str());
-#endif
+// Adds the rows a writer committed to the exact snapshot. Called with
+// exact_write_mutex held across the COMMIT, so no query can load the rows in
+// between and see them twice. Past UNNU_RAGL_EXACT_SEARCH_LIMIT the snapshot
+// only counts and the HNSW index is requested; without a snapshot the
+// maintenance worker does the counting.
+static void _unnu_ragl_exact_append(ragl_kb_t& kb, const std::vector<std::string>& ids, const std::vector<std::string>& texts, const std::vector<float>& vectors, size_t dims) {
+	if (ids.empty()) {
 		return;
 	}
+	std::shared_ptr<const ragl_exact_index_t> base = _unnu_ragl_exact_current(kb);
+	bool oversized = true;
+	if (base != nullptr) {
+		auto next = std::make_shared<ragl_exact_index_t>(*base);
+		next->fragments += static_cast<int64_t>(ids.size());
+		if (!next->oversized && UNNU_RAGL_EXACT_SEARCH_LIMIT > 0 && next->fragments > UNNU_RAGL_EXACT_SEARCH_LIMIT) {
+			next->oversized = true;
+			next->segments.clear();
+			next->tombstones.clear();
+		}
+		if (!next->oversized) {
+			if (next->dims != 0 && next->dims != dims) {
+				_unnu_ragl_exact_publish(kb, nullptr);
+				return;
+			}
+			next->dims = dims;
+			// a fragment deleted and written again must not stay hidden, nor show twice
+			if (std::any_of(ids.cbegin(), ids.cend(), [&next](const std::string& id) { return next->tombstones.count(id) > 0; })) {
+				_unnu_ragl_exact_merge(*next);
+			}
+			next->segments.push_back(_unnu_ragl_exact_segment(ids, texts, vectors.data(), dims));
+		}
+		oversized = next->oversized;
+		_unnu_ragl_exact_publish(kb, std::move(next));
+	}
+	if (oversized && kb.storage == 0 && !kb.hnsw_indexed) {
+		_unnu_ragl_request_hnsw(kb);
+	}
+}
 
-	result = conn.Query("PRAGMA hnsw_compact_index('embeddings_hnsw_index');");
-	if (result->HasError()) {
-#if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: compacting embedding_hsnw_index for %s:  %s\n", uri, result->GetError().c_str());
-#endif
+// Removes deleted fragments from the exact snapshot; with exact_write_mutex
+// held across the COMMIT, as for _unnu_ragl_exact_append.
+static void _unnu_ragl_exact_tombstone(ragl_kb_t& kb, const std::vector<std::string>& ids) {
+	std::shared_ptr<const ragl_exact_index_t> base = _unnu_ragl_exact_current(kb);
+	if (base == nullptr || ids.empty()) {
 		return;
 	}
-	
-	result = conn.Query("CHECKPOINT;");
-	if (result->HasError()) {
-#if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: reclaiming space after deleting %s:  %s\n", uri, result->GetError().c_str());
-#endif
+	auto next = std::make_shared<ragl_exact_index_t>(*base);
+	next->fragments = std::max<int64_t>(next->fragments - static_cast<int64_t>(ids.size()), 0);
+	if (next->oversized) {
+		// small enough again, the next query loads the vectors
+		_unnu_ragl_exact_publish(kb, next->fragments > UNNU_RAGL_EXACT_SEARCH_LIMIT ? std::move(next) : nullptr);
 		return;
 	}
-
-	int errorCode = 0;
-	std::thread thr(_unnu_overwrite_fts_index, &errorCode);
-	thr.detach();
+	next->tombstones.insert(ids.cbegin(), ids.cend());
+	_unnu_ragl_exact_publish(kb, std::move(next));
 }
 
-void _unnu_ragl_query(const char* text, std::vector<float> embeddings, int limit, int* errorCode) {
-
+// Drops the exact snapshot after the stored vectors were replaced wholesale
+// (import, reindex swap) or the limit changed.
+static void _unnu_ragl_exact_reset(ragl_kb_t& kb) {
+	std::lock_guard<std::mutex> lock(kb.exact_write_mutex);
+	_unnu_ragl_exact_publish(kb, nullptr);
+}
 
-	duckdb::vector<duckdb::Value> _array(embeddings.size());
-	std::transform(embeddings.cbegin(), embeddings.cend(), _array.begin(), [](float d) -> duckdb::Value { return duckdb::Value(d); });
+// Compacts the HNSW graph and checkpoints, which reclaims the space of
+// deleted rows in every storage mode.
+static void _unnu_ragl_compact(ragl_kb_t& kb) {
+	int64_t tombstones;
+	{
+		std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+		tombstones = kb.tombstones;
+		if (tombstones == 0) {
+			kb.compact_requested = false;
+			return;
+		}
+	}
 
-	auto embd = duckdb::Value::ARRAY(duckdb::LogicalType::FLOAT, _array);
+	RaglConnectionLease lease(kb);
+	duckdb::Connection& conn = lease.Conn();
+	if (kb.storage == 0 && kb.hnsw_indexed) {
+		auto result = conn.Query("PRAGMA hnsw_compact_index('embeddings_hnsw_index');");
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: compacting embedding_hsnw_index %s\n", result->GetError().c_str());
+#endif
+		}
+	}
 
-	auto result = pstmt->Execute(text, embd, limit);
+	auto result = conn.Query("CHECKPOINT;");
 	if (result->HasError()) {
-
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: executing pstmt %s\n", result->GetError().c_str());
+		fprintf(stderr, "error: reclaiming space of deleted fragments %s\n", result->GetError().c_str());
 #endif
+		std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+		kb.compact_requested = false;
+		kb.compact_failures++;
+		kb.compact_retry_at = std::chrono::steady_clock::now() + _unnu_ragl_retry_delay(kb.compact_failures);
 		return;
 	}
 
-	std::vector< UnnuRaglFragment_t*> fragments;
-	auto output = result.get();
-	while (true) {
-		auto chunk = output->Fetch();
-		if (chunk) {
-			for (idx_t i = 0; i < chunk->size(); i++) {
-				auto line = chunk->GetValue(0, i).GetValue<std::string>();
-				if (!line.empty()) {
-					UnnuRaglFragment_t* frag = (UnnuRaglFragment_t*)malloc(sizeof(UnnuRaglFragment_t));
-					auto len = line.length();
-					frag->length = len;
-					frag->text = (char*)std::calloc(len + 1, sizeof(char));
-					std::memcpy(frag->text, line.c_str(), len);
-					frag->text[len] = '\0';
-					fragments.push_back(frag);
-				}
-			}
+	std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+	kb.tombstones -= tombstones;
+	kb.compact_requested = false;
+	kb.compact_failures = 0;
+	kb.compactions++;
+}
+
+static void _unnu_ragl_maintenance_worker(ragl_kb_t* kb) {
+	std::unique_lock<std::mutex> lock(kb->maintenance_mutex);
+	while (kb->maintenance_running) {
+		const bool fts_pending = kb->fts_dirty_generation != kb->fts_built_generation;
+		const bool compact_pending = kb->tombstones > 0;
+		if (kb->hnsw_requested) {
+			kb->hnsw_requested = false;
+			lock.unlock();
+			_unnu_ragl_update_hnsw(*kb);
+			lock.lock();
+			continue;
 		}
-		else {
-			break;
+		if (!fts_pending && !compact_pending) {
+			kb->maintenance_cv.wait(lock);
+			continue;
 		}
-	}
 
-	if (response_cb != nullptr) {
-		int frag_sz = fragments.size();
-		if (frag_sz > 0) {
-			UnnuRaglResult_t* response = (UnnuRaglResult_t*)malloc(sizeof(UnnuRaglResult_t));
-			response->count = frag_sz;
-			response->type = UnnuRaglResultType::UNNU_RAGL_QUERY;
-			response->fragments = (UnnuRaglFragment_t**)std::calloc(frag_sz, sizeof(UnnuRaglFragment_t*));
-			std::memcpy(response->fragments, fragments.data(), frag_sz * sizeof(UnnuRaglFragment_t*));
-			response_cb(response);
+		const auto now = std::chrono::steady_clock::now();
+		const auto fts_due = std::max(kb->fts_dirty_since + std::chrono::milliseconds(std::max(UNNU_RAGL_FTS_DEBOUNCE_MS, 0)), kb->fts_retry_at);
+		const auto compact_due = std::max(kb->compact_requested ? now : kb->last_activity + std::chrono::milliseconds(std::max(UNNU_RAGL_COMPACT_IDLE_MS, 0)), kb->compact_retry_at);
+		if (fts_pending && now >= fts_due) {
+			lock.unlock();
+			_unnu_ragl_flush_fts(*kb);
+			lock.lock();
+			continue;
+		}
+		if (compact_pending && now >= compact_due) {
+			lock.unlock();
+			_unnu_ragl_compact(*kb);
+			lock.lock();
+			continue;
 		}
-	}
-}
-
-void unnu_rag_lite_open_kb(char* db_path, int* errorCode) {
-	std::string key = db_path != nullptr ? db_path : ":memory:";
-	duckdb::DBConfigOptions options;
-	options.autoload_known_extensions = true;
-	options.autoinstall_known_extensions = true;
-	options.force_checkpoint = true;
-	options.checkpoint_on_shutdown = true;
-	duckdb::DBConfig config;
-	config.options = options;
-
-	database = std::make_unique<duckdb::DuckDB>(db_path, &config);
-
-	connection = std::make_unique<duckdb::Connection>(*database);
 
-	_unnu_ragl_db_setup(UNNU_RAGL_EMBEDDING_SIZE, errorCode);
+		auto due = fts_pending ? fts_due : compact_due;
+		if (fts_pending && compact_pending) {
+			due = std::min(fts_due, compact_due);
+		}
+		kb->maintenance_cv.wait_until(lock, due);
+	}
 }
 
-
-std::string _unnu_string_trim(const std::string& str) {
-	std::regex pattern("^\\s+|\\s+$",std::regex_constants::ECMAScript);
-	return std::regex_replace(str, pattern, "");
+static void _unnu_ragl_start_maintenance(ragl_kb_t& kb) {
+	std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+	if (kb.maintenance_running) {
+		return;
+	}
+	kb.maintenance_running = true;
+	kb.maintenance_thread = std::thread(_unnu_ragl_maintenance_worker, &kb);
 }
 
-std::vector<std::string> _unnu_split_text_into_sentences(std::string& text) {
-	std::vector<std::string> sentences;
-	std::regex split_sentences("([!.?]+)\\s+",
-		std::regex_constants::ECMAScript);
-	std::sregex_token_iterator it(text.begin(), text.end(), split_sentences, -1);
-	std::sregex_token_iterator sep(text.begin(), text.end(), split_sentences);
-	std::sregex_token_iterator end;
-	for(;it != end && sep != end; it++,sep++){
-		std::string val(*it);
-		if (!val.empty()) {
-			std::string delim(*sep);
-			val.append(1, delim.c_str()[0]);
-			sentences.push_back(val);
+static void _unnu_ragl_stop_maintenance(ragl_kb_t& kb) {
+	{
+		std::lock_guard<std::mutex> lock(kb.maintenance_mutex);
+		if (!kb.maintenance_running) {
+			return;
 		}
+		kb.maintenance_running = false;
 	}
-	
-	for(;it != end; it++){
-		sentences.push_back(*it);
+	kb.maintenance_cv.notify_all();
+	if (kb.maintenance_thread.joinable()) {
+		kb.maintenance_thread.join();
 	}
-	return sentences;
+	// leave a complete and compacted index behind for the next open
+	_unnu_ragl_flush_fts(kb);
+	_unnu_ragl_compact(kb);
 }
 
-std::vector<std::string> _unnu_split_text_into_paragraphs(std::string& text) {
-	std::regex regexPattern("(\\s*\\n){2,}",std::regex_constants::ECMAScript);
-    std::sregex_token_iterator it(text.begin(), text.end(), regexPattern, -1);
-	std::sregex_token_iterator end;
-    std::vector<std::string> paragraphs(it, end);
-    return paragraphs;
+// Fills the codes table of a quantized storage mode from the stored float
+// vectors, so ingestion and the backfill on open quantize alike. int8 keeps
+// round(127 x / max|x|) per dimension with the scale that turns the code dot
+// product back into cosine similarity; binary keeps the sign bits.
+static std::string _unnu_ragl_codes_insert(int32_t storage, const std::string& where) {
+	if (storage == 1) {
+		std::string query = "INSERT OR IGNORE INTO codes_int8 SELECT frag_id, absmax / 127.0 / norm, [CAST(round(x * 127.0 / absmax) AS TINYINT) FOR x IN vals] FROM ";
+		query.append("(SELECT frag_id, embedding::FLOAT[] AS vals, list_max([abs(x) FOR x IN embedding::FLOAT[]]) AS absmax, sqrt(list_sum([x * x FOR x IN embedding::FLOAT[]])) AS norm ");
+		query.append("FROM embeddings WHERE ").append(where).append(") WHERE absmax > 0 AND norm > 0;");
+		return query;
+	}
+	std::string query = "INSERT OR IGNORE INTO codes_binary SELECT frag_id, array_to_string([CASE WHEN x > 0 THEN '1' ELSE '0' END FOR x IN embedding::FLOAT[]], '')::BIT ";
+	query.append("FROM embeddings WHERE ").append(where).append(";");
+	return query;
 }
 
-std::vector<std::string> _unnu_ragl_split_text_into_chunks(std::string& text, int chunksize, bool overlap) {
-	std::vector<std::string> chunks;
-	std::vector<std::string> paragraphs = _unnu_split_text_into_paragraphs(text);
-	for (std::string text : paragraphs) {
-		bool first_chunk = true;
-		std::vector<std::string> sentences  = _unnu_split_text_into_sentences(text);
-		std::string currentChunk = "";
-		std::string overlapping = "";
-		for (std::string sentence : sentences) {
-			// change to unix style eol
-			// sentence.erase(std::remove(sentence.begin(), sentence.end(), '\r'), sentence.end());
-			if (!sentence.empty()) {
-				if (overlap) {
-					overlapping.append(first_chunk ? "" : " ").append(sentence);
-				}
-				if ((currentChunk.length() + sentence.length()) > chunksize) {
-					if (overlap && !overlapping.empty()) {
-						chunks.push_back(overlapping);
-					}
-					else if (!currentChunk.empty()) {
-						chunks.push_back(currentChunk);
-					}
-					if (overlap) {
-						overlapping = sentence;
-					}
-					currentChunk = sentence;
-					first_chunk = false;
+static const char* _unnu_ragl_codes_table(int32_t storage) {
+	return storage == 1 ? "codes_int8" : "codes_binary";
+}
+
+// Quantized modes drop the HNSW graph, which DuckDB keeps entirely in memory,
+// and bring the codes table up to date with fragments written in other modes.
+static bool _unnu_ragl_codes_setup(duckdb::Connection& conn, int32_t storage, int embedsize) {
+	std::vector<std::string> queries;
+	queries.push_back("DROP INDEX IF EXISTS embeddings_hnsw_index;");
+	if (storage == 1) {
+		queries.push_back("CREATE TABLE IF NOT EXISTS codes_int8 (frag_id VARCHAR(64) UNIQUE NOT NULL, scale FLOAT, code TINYINT[" + std::to_string(embedsize) + "]);");
+	}
+	else {
+		queries.push_back("CREATE TABLE IF NOT EXISTS codes_binary (frag_id VARCHAR(64) UNIQUE NOT NULL, code BIT);");
+	}
+	const std::string table = _unnu_ragl_codes_table(storage);
+	queries.push_back("DELETE FROM " + table + " WHERE frag_id NOT IN (SELECT frag_id FROM embeddings);");
+	queries.push_back(_unnu_ragl_codes_insert(storage, "frag_id NOT IN (SELECT frag_id FROM " + table + ")"));
+
+	for (const std::string& query : queries) {
+		auto result = conn.Query(query);
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: setting up %s %s\n", table.c_str(), result->GetError().c_str());
+#endif
+			return false;
+		}
+	}
+	return true;
+}
+
+void _unnu_ragl_db_setup(ragl_kb_t& kb, int embedsize, int* errorCode) {
+	RaglConnectionLease lease(kb);
+	duckdb::Connection& conn = lease.Conn();
+
+	// model the stored vectors were embedded with, see _unnu_ragl_check_model
+	auto result = conn.Query("CREATE TABLE IF NOT EXISTS model_info (role VARCHAR PRIMARY KEY, model_id VARCHAR, dims INTEGER, pooling INTEGER, recorded_at TIMESTAMP);");
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: creating table model_info %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	// the tables keep the recorded width until a re-embedding swaps them
+	result = conn.Query("SELECT dims FROM model_info WHERE role = 'active';");
+	if (!result->HasError() && result->RowCount() > 0) {
+		embedsize = result->GetValue(0, 0).GetValue<int32_t>();
+	}
+
+	std::string query = "CREATE TABLE IF NOT EXISTS embeddings (frag_id VARCHAR(64) UNIQUE NOT NULL, text VARCHAR, embedding FLOAT[";
+	query = query.append(std::to_string(embedsize)).append("]);");
+	result = conn.Query(query);
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: creating table embeddings %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	query = "CREATE TABLE IF NOT EXISTS doxinfo (document_id VARCHAR(64) NOT NULL, uri VARCHAR, embedding_size INTEGER, PRIMARY KEY (document_id, uri));";
+	result = conn.Query(query);
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: creating table doxinfo: %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	// corpus is denormalised onto every mapping, so filtered queries scope fragments without joining doxinfo
+	query = "CREATE TABLE IF NOT EXISTS doxmap (document_id VARCHAR(64) NOT NULL, frag_id VARCHAR(64) NOT NULL, corpus VARCHAR, PRIMARY KEY (document_id, frag_id));";
+	result = conn.Query(query);
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: creating table doxmap %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	result = conn.Query("ALTER TABLE doxmap ADD COLUMN IF NOT EXISTS corpus VARCHAR;");
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: adding corpus to doxmap %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	// untruncated vectors of Matryoshka models, see UNNU_RAGL_KEEP_FULL_VECTORS
+	query = "CREATE TABLE IF NOT EXISTS embeddings_full (frag_id VARCHAR(64) UNIQUE NOT NULL, embedding FLOAT[]);";
+	result = conn.Query(query);
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: creating table embeddings_full %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	query = "CREATE TABLE IF NOT EXISTS query_cache (query VARCHAR PRIMARY KEY, pooling INTEGER, embedding FLOAT[";
+	query = query.append(std::to_string(embedsize)).append("], used_at TIMESTAMP);");
+	result = conn.Query(query);
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: creating table query_cache %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	result = conn.Query("Load VSS;");
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: loading vss extension %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	result = conn.Query("SET GLOBAL hnsw_enable_experimental_persistence = true;");
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: enabling hnsw persistence %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5642;
+		return;
+	}
+
+	if (kb.storage != 0) {
+		if (!_unnu_ragl_codes_setup(conn, kb.storage, embedsize)) {
+			*errorCode = 5642;
+			return;
+		}
+	}
+	else if (!_unnu_ragl_ensure_hnsw(kb, conn)) {
+		*errorCode = 5642;
+		return;
+	}
+
+	result = conn.Query("pragma create_fts_index(embeddings, frag_id,'text',stemmer = 'porter',stopwords = 'english', strip_accents = 1,lower = 1,overwrite = 0);");
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: creating ftx_index embeddings %s\n", result->GetError().c_str());
+#endif
+		result = conn.Query("pragma create_fts_index(embeddings, frag_id,'text',stemmer = 'porter',stopwords = 'english', strip_accents = 1,lower = 1,overwrite = 1);");
+		if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: overwriting fts_index embedding %s\n", result->GetError().c_str());
+#endif
+			* errorCode = 5642;
+		}
+	}
+
+	*errorCode = 0;
+}
+
+static void _unnu_ragl_delete(ragl_kb_t& kb, const char* document_id, const char* uri) {
+	// see https://www.sqlite.org/fts5.html#the_delete_command
+	// https://duckdb.org/docs/stable/core_extensions/full_text_search
+
+	RaglConnectionLease lease(kb);
+	duckdb::Connection& conn = lease.Conn();
+	const std::string _document_id(document_id);
+	const std::string _uri(uri);
+
+	auto result = conn.Query("BEGIN TRANSACTION;");
+	if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: deleting %s starting transaction %s\n", uri, result->GetError().c_str());
+#endif
+		return;
+	}
+
+	// codes and embeddings first, their lookup goes through doxmap and doxinfo
+	std::vector<ragl_statement_t> steps;
+	if (kb.storage != 0) {
+		steps.push_back(kb.storage == 1 ? RAGL_STMT_DELETE_INT8_CODES : RAGL_STMT_DELETE_BINARY_CODES);
+	}
+	steps.insert(steps.end(), { RAGL_STMT_DELETE_FULL, RAGL_STMT_DELETE_EMBEDDINGS, RAGL_STMT_DELETE_DOXMAP, RAGL_STMT_DELETE_DOXINFO });
+	std::vector<std::string> deleted_ids;
+	for (ragl_statement_t step : steps) {
+		duckdb::PreparedStatement* statement = lease.Statement(step);
+		if (statement == nullptr) {
+			conn.Query("ROLLBACK;");
+			return;
+		}
+		auto deleted_rows = statement->Execute(_document_id, _uri);
+		if (deleted_rows->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: deleting %s:  %s\n", uri, deleted_rows->GetError().c_str());
+#endif
+			conn.Query("ROLLBACK;");
+			return;
+		}
+		if (step == RAGL_STMT_DELETE_EMBEDDINGS) {
+			while (auto chunk = deleted_rows->Fetch()) {
+				if (chunk->size() == 0) {
+					break;
+				}
+				for (idx_t i = 0; i < chunk->size(); i++) {
+					deleted_ids.push_back(chunk->GetValue(0, i).GetValue<std::string>());
+				}
+			}
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> exact_lock(kb.exact_write_mutex);
+		result = conn.Query("COMMIT;");
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: deleting %s committing %s\n", uri, result->GetError().c_str());
+#endif
+			return;
+		}
+		_unnu_ragl_exact_tombstone(kb, deleted_ids);
+	}
+	const int64_t deleted = static_cast<int64_t>(deleted_ids.size());
+
+	// only tombstones here, compaction and checkpoint run in the maintenance worker
+	int64_t live = 0;
+	result = conn.Query("SELECT count(*) FROM embeddings;");
+	if (!result->HasError() && result->RowCount() > 0) {
+		live = result->GetValue(0, 0).GetValue<int64_t>();
+	}
+	_unnu_ragl_add_tombstones(kb, deleted, live);
+	_unnu_ragl_kb_changed(kb);
+}
+
+void unnu_rag_lite_delete(const char* document_id, const char* uri) {
+	ragl_kb_ptr kb = _unnu_ragl_default_kb();
+	if (kb != nullptr) {
+		_unnu_ragl_delete(*kb, document_id, uri);
+	}
+}
+
+void unnu_rag_lite_kb_delete(int32_t handle, const char* document_id, const char* uri) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (kb != nullptr) {
+		_unnu_ragl_delete(*kb, document_id, uri);
+	}
+}
+
+typedef struct ragl_candidate {
+	std::string frag_id;
+	std::string text;
+	float embd_score = 0.0f;
+	float fts_score = 0.0f;
+	int embd_rank = 0;
+	int fts_rank = 0;
+	bool has_embd = false;
+	bool has_fts = false;
+	float score = 0.0f;
+	int32_t kb = 0;
+} ragl_candidate_t;
+
+// Scope of a filtered query: the fragments mapped by a document that matches
+// every non-empty list.
+typedef struct ragl_filter {
+	std::vector<std::string> documents;
+	std::vector<std::string> uris;
+	std::vector<std::string> corpora;
+
+	bool empty() const {
+		return documents.empty() && uris.empty() && corpora.empty();
+	}
+} ragl_filter_t;
+
+// Renders the scope as a frag_id subquery over doxmap, its lists bound as
+// parameters appended to params.
+static std::string _unnu_ragl_filter_scope(const ragl_filter_t& filter, duckdb::vector<duckdb::Value>& params) {
+	auto bind = [&params](const std::vector<std::string>& values) {
+		duckdb::vector<duckdb::Value> _values;
+		std::transform(values.cbegin(), values.cend(), std::back_inserter(_values), [](const std::string& value) { return duckdb::Value(value); });
+		params.push_back(duckdb::Value::LIST(duckdb::LogicalType::VARCHAR, _values));
+		return "$" + std::to_string(params.size());
+	};
+	std::string scope = "SELECT frag_id FROM doxmap WHERE true";
+	if (!filter.documents.empty()) {
+		scope.append(" AND document_id IN (SELECT unnest(").append(bind(filter.documents)).append("))");
+	}
+	if (!filter.uris.empty()) {
+		scope.append(" AND document_id IN (SELECT document_id FROM doxinfo WHERE uri IN (SELECT unnest(").append(bind(filter.uris)).append(")))");
+	}
+	if (!filter.corpora.empty()) {
+		scope.append(" AND corpus IN (SELECT unnest(").append(bind(filter.corpora)).append("))");
+	}
+	return scope;
+}
+
+// Renders the query vector as a constant FLOAT[N] literal. The HNSW index is
+// only used for ORDER BY array_cosine_distance(embedding, <constant>) LIMIT n,
+// which a bound parameter does not satisfy.
+static std::string _unnu_ragl_vector_literal(const std::vector<float>& embeddings) {
+	std::string literal;
+	literal.reserve(embeddings.size() * 16 + 32);
+	literal.append("[");
+	char buf[32];
+	for (size_t i = 0; i < embeddings.size(); i++) {
+		int n = snprintf(buf, sizeof(buf), i == 0 ? "%.9g" : ",%.9g", embeddings[i]);
+		literal.append(buf, n);
+	}
+	literal.append("]::FLOAT[").append(std::to_string(embeddings.size())).append("]");
+	return literal;
+}
+
+static void _unnu_ragl_vector_candidates(duckdb::Connection& conn, const std::vector<float>& embeddings, int limit, std::map<std::string, ragl_candidate_t>& candidates, int* errorCode) {
+	std::string vec = _unnu_ragl_vector_literal(embeddings);
+	std::string select = "SELECT frag_id, text, array_cosine_distance(embedding, ";
+	select.append(vec).append(") AS distance FROM embeddings ORDER BY array_cosine_distance(embedding, ");
+	select.append(vec).append(") LIMIT ").append(std::to_string(limit)).append(";");
+
+	auto result = conn.Query(select);
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: vector candidates %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5643;
+		return;
+	}
+
+	for (idx_t i = 0, n = result->RowCount(); i < n; i++) {
+		auto frag_id = result->GetValue(0, i).GetValue<std::string>();
+		ragl_candidate_t& candidate = candidates[frag_id];
+		candidate.frag_id = frag_id;
+		candidate.text = result->GetValue(1, i).GetValue<std::string>();
+		// cosine distance is in [0, 2], similarity in [-1, 1]
+		candidate.embd_score = 1.0f - result->GetValue(2, i).GetValue<float>();
+		candidate.embd_rank = i + 1;
+		candidate.has_embd = true;
+	}
+}
+
+// Reads every stored vector of a knowledge base at or below
+// UNNU_RAGL_EXACT_SEARCH_LIMIT fragments; larger ones only get counted.
+static std::shared_ptr<ragl_exact_index_t> _unnu_ragl_exact_load(duckdb::Connection& conn, int* errorCode) {
+	auto index = std::make_shared<ragl_exact_index_t>();
+	auto count = conn.Query("SELECT count(*) FROM embeddings;");
+	if (count->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: exact search counting %s\n", count->GetError().c_str());
+#endif
+		*errorCode = 5643;
+		return nullptr;
+	}
+	const int64_t fragments = count->GetValue(0, 0).GetValue<int64_t>();
+	index->fragments = fragments;
+	if (fragments > UNNU_RAGL_EXACT_SEARCH_LIMIT) {
+		index->oversized = true;
+		return index;
+	}
+
+	auto result = conn.Query("SELECT frag_id, text, embedding FROM embeddings;");
+	if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: exact search loading %s\n", result->GetError().c_str());
+#endif
+		*errorCode = 5643;
+		return nullptr;
+	}
+	std::vector<float> values;
+	std::vector<std::string> ids;
+	std::vector<std::string> texts;
+	size_t dims = 0;
+	ids.reserve(fragments);
+	texts.reserve(fragments);
+	while (true) {
+		auto chunk = result->Fetch();
+		if (!chunk || chunk->size() == 0) {
+			break;
+		}
+		chunk->Flatten();
+		auto chunk_ids = duckdb::FlatVector::GetData<duckdb::string_t>(chunk->data[0]);
+		auto chunk_texts = duckdb::FlatVector::GetData<duckdb::string_t>(chunk->data[1]);
+		dims = duckdb::ArrayType::GetSize(chunk->data[2].GetType());
+		auto data = duckdb::FlatVector::GetData<float>(duckdb::ArrayVector::GetEntry(chunk->data[2]));
+		// text and embedding are nullable, such rows cannot be ranked
+		const duckdb::ValidityMask& text_valid = duckdb::FlatVector::Validity(chunk->data[1]);
+		const duckdb::ValidityMask& embedding_valid = duckdb::FlatVector::Validity(chunk->data[2]);
+		for (idx_t i = 0; i < chunk->size(); i++) {
+			if (!text_valid.RowIsValid(i) || !embedding_valid.RowIsValid(i)) {
+				continue;
+			}
+			ids.push_back(chunk_ids[i].GetString());
+			texts.push_back(chunk_texts[i].GetString());
+			values.insert(values.end(), data + i * dims, data + (i + 1) * dims);
+		}
+	}
+	index->fragments = static_cast<int64_t>(ids.size());
+	if (!ids.empty()) {
+		index->dims = dims;
+		index->segments.push_back(_unnu_ragl_exact_segment(std::move(ids), std::move(texts), values.data(), dims));
+	}
+	return index;
+}
+
+// Ranks every fragment of a small knowledge base with a matrix-vector
+// product (BLAS gemv) per segment of the in-memory snapshot: exact, and below a
+// millisecond for per-conversation sized stores. Returns false when the
+// knowledge base has outgrown UNNU_RAGL_EXACT_SEARCH_LIMIT, the caller then
+// queries the HNSW index, which is requested here if it does not exist yet.
+static bool _unnu_ragl_exact_candidates(ragl_kb_t& kb, duckdb::Connection& conn, const std::vector<float>& embeddings, int limit, std::map<std::string, ragl_candidate_t>& candidates, int* errorCode) {
+	if (UNNU_RAGL_EXACT_SEARCH_LIMIT <= 0 || kb.storage != 0) {
+		return false;
+	}
+	std::shared_ptr<const ragl_exact_index_t> index = _unnu_ragl_exact_current(kb);
+	if (index == nullptr) {
+		// loaded once, later commits and deletes update it; while a commit or
+		// another load holds the snapshot this query takes the SQL path
+		std::unique_lock<std::mutex> write_lock(kb.exact_write_mutex, std::try_to_lock);
+		if (!write_lock.owns_lock()) {
+			return false;
+		}
+		index = _unnu_ragl_exact_current(kb);
+		if (index == nullptr) {
+			std::shared_ptr<ragl_exact_index_t> loaded = _unnu_ragl_exact_load(conn, errorCode);
+			if (loaded == nullptr) {
+				return false;
+			}
+			index = loaded;
+			_unnu_ragl_exact_publish(kb, std::move(loaded));
+		}
+	}
+	if (index->oversized) {
+		if (!kb.hnsw_indexed) {
+			_unnu_ragl_request_hnsw(kb);
+		}
+		return false;
+	}
+	if (index->segments.empty()) {
+		return true;
+	}
+	if (embeddings.size() != index->dims) {
+		return false;
+	}
+
+	arma::fvec query(embeddings);
+	const float norm = arma::norm(query, 2);
+	if (norm > 0.0f) {
+		query /= norm;
+	}
+
+	// one gemv per segment, tombstoned columns are skipped
+	std::vector<std::pair<float, std::pair<const ragl_exact_segment_t*, size_t>>> scored;
+	scored.reserve(static_cast<size_t>(index->fragments));
+	for (const auto& segment : index->segments) {
+		const arma::fvec scores = segment->vectors.t() * query;
+		for (size_t col = 0; col < segment->ids.size(); col++) {
+			if (!index->tombstones.empty() && index->tombstones.count(segment->ids[col]) > 0) {
+				continue;
+			}
+			scored.push_back({ scores[col], { segment.get(), col } });
+		}
+	}
+
+	const size_t count = std::min<size_t>(std::max(limit, 0), scored.size());
+	std::partial_sort(scored.begin(), scored.begin() + count, scored.end(),
+		[](const auto& a, const auto& b) { return a.first > b.first; });
+	for (size_t i = 0; i < count; i++) {
+		const ragl_exact_segment_t* segment = scored[i].second.first;
+		const size_t col = scored[i].second.second;
+		ragl_candidate_t& candidate = candidates[segment->ids[col]];
+		candidate.frag_id = segment->ids[col];
+		candidate.text = segment->texts[col];
+		candidate.embd_score = scored[i].first;
+		candidate.embd_rank = i + 1;
+		candidate.has_embd = true;
+	}
+	return true;
+}
+
+static void _unnu_ragl_quantized_candidates(RaglConnectionLease& lease, int32_t storage, const std::vector<float>& embeddings, int limit, std::map<std::string, ragl_candidate_t>& candidates, int* errorCode);
+
+// Vector candidates restricted to the filter scope. A scope of up to
+// UNNU_RAGL_FILTER_EXACT_LIMIT fragments is ranked exactly: the semi join keeps
+// the planner off the HNSW index, so no row outside the scope uses up the
+// limit. Broader scopes over-fetch from the index (or the codes) by the inverse
+// selectivity and widen until limit fragments in scope are found.
+static void _unnu_ragl_filtered_candidates(ragl_kb_t& kb, RaglConnectionLease& lease, const ragl_filter_t& filter, const std::vector<float>& embeddings, int limit, std::map<std::string, ragl_candidate_t>& candidates, int* errorCode) {
+	duckdb::Connection& conn = lease.Conn();
+	const int32_t storage = kb.storage;
+	duckdb::vector<duckdb::Value> params;
+	const std::string scope = _unnu_ragl_filter_scope(filter, params);
+
+	auto sizes = conn.Prepare("SELECT (SELECT count(DISTINCT frag_id) FROM (" + scope + ")), (SELECT count(*) FROM embeddings);");
+	auto counted = sizes->HasError() ? nullptr : sizes->Execute(params, false);
+	if (counted == nullptr || counted->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: filter scope %s\n", counted != nullptr ? counted->GetError().c_str() : sizes->GetError().c_str());
+#endif
+		* errorCode = 5643;
+		return;
+	}
+	auto chunk = counted->Fetch();
+	if (!chunk || chunk->size() == 0) {
+		return;
+	}
+	const int64_t in_scope = chunk->GetValue(0, 0).GetValue<int64_t>();
+	const int64_t total = chunk->GetValue(1, 0).GetValue<int64_t>();
+	if (in_scope == 0 || limit <= 0) {
+		return;
+	}
+
+	if (in_scope <= UNNU_RAGL_FILTER_EXACT_LIMIT) {
+		std::string select = "SELECT frag_id, text, array_cosine_distance(embedding, ";
+		select.append(_unnu_ragl_vector_literal(embeddings)).append(") AS distance FROM embeddings WHERE frag_id IN (");
+		select.append(scope).append(") ORDER BY distance LIMIT ").append(std::to_string(limit)).append(";");
+		auto exact = conn.Prepare(select);
+		auto result = exact->HasError() ? nullptr : exact->Execute(params, false);
+		if (result == nullptr || result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: filtered vector candidates %s\n", result != nullptr ? result->GetError().c_str() : exact->GetError().c_str());
+#endif
+			* errorCode = 5643;
+			return;
+		}
+		int rank = 0;
+		while (auto rows = result->Fetch()) {
+			if (rows->size() == 0) {
+				break;
+			}
+			for (idx_t i = 0; i < rows->size(); i++) {
+				auto frag_id = rows->GetValue(0, i).GetValue<std::string>();
+				ragl_candidate_t& candidate = candidates[frag_id];
+				candidate.frag_id = frag_id;
+				candidate.text = rows->GetValue(1, i).GetValue<std::string>();
+				candidate.embd_score = 1.0f - rows->GetValue(2, i).GetValue<float>();
+				candidate.embd_rank = ++rank;
+				candidate.has_embd = true;
+			}
+		}
+		return;
+	}
+
+	auto members = conn.Prepare("SELECT DISTINCT frag_id FROM (" + scope + ") WHERE frag_id IN (SELECT unnest($" + std::to_string(params.size() + 1) + "));");
+	if (members->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: filter scope %s\n", members->GetError().c_str());
+#endif
+		* errorCode = 5643;
+		return;
+	}
+	// without the index every widening pass below is a full scan
+	if (storage == 0 && !kb.hnsw_indexed) {
+		_unnu_ragl_request_hnsw(kb);
+	}
+	int64_t fetch = static_cast<int64_t>(limit) * 2 * ((total + in_scope - 1) / in_scope);
+	while (true) {
+		fetch = std::min<int64_t>(fetch, std::max<int64_t>(total, limit));
+		std::map<std::string, ragl_candidate_t> unfiltered;
+		if (storage != 0) {
+			_unnu_ragl_quantized_candidates(lease, storage, embeddings, static_cast<int>(fetch), unfiltered, errorCode);
+		}
+		else {
+			_unnu_ragl_vector_candidates(conn, embeddings, static_cast<int>(fetch), unfiltered, errorCode);
+		}
+		if (*errorCode != 0) {
+			return;
+		}
+
+		duckdb::vector<duckdb::Value> _ids;
+		for (auto& it : unfiltered) {
+			_ids.push_back(duckdb::Value(it.first));
+		}
+		std::vector<ragl_candidate_t*> kept;
+		if (!_ids.empty()) {
+			duckdb::vector<duckdb::Value> _params(params);
+			_params.push_back(duckdb::Value::LIST(duckdb::LogicalType::VARCHAR, _ids));
+			auto result = members->Execute(_params, false);
+			if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+				fprintf(stderr, "error: filter scope %s\n", result->GetError().c_str());
+#endif
+				* errorCode = 5643;
+				return;
+			}
+			while (auto rows = result->Fetch()) {
+				if (rows->size() == 0) {
+					break;
+				}
+				for (idx_t i = 0; i < rows->size(); i++) {
+					kept.push_back(&unfiltered[rows->GetValue(0, i).GetValue<std::string>()]);
+				}
+			}
+		}
+
+		if (kept.size() >= static_cast<size_t>(limit) || unfiltered.size() < static_cast<size_t>(fetch) || fetch >= total) {
+			std::sort(kept.begin(), kept.end(),
+				[](const ragl_candidate_t* a, const ragl_candidate_t* b) { return a->embd_rank < b->embd_rank; });
+			for (size_t k = 0; k < kept.size() && k < static_cast<size_t>(limit); k++) {
+				ragl_candidate_t& candidate = candidates[kept[k]->frag_id];
+				candidate = *kept[k];
+				candidate.embd_rank = k + 1;
+			}
+			return;
+		}
+		fetch *= 2;
+	}
+}
+
+// Matryoshka models front-load the signal, so the first dims values of a
+// pooled vector, renormalised, are an embedding of their own. src and dest may
+// overlap as long as dest does not start after src.
+static void _unnu_ragl_truncate_into(const float* src, float* dest, size_t dims) {
+	std::memmove(dest, src, dims * sizeof(float));
+	arma::fvec _truncated(dest, dims, false, true);
+	float _norm = arma::norm(_truncated, 2);
+	if (_norm > 0.0f) {
+		_truncated /= _norm;
+	}
+}
+
+static std::vector<float> _unnu_ragl_truncate_embedding(const std::vector<float>& embedding, size_t dims) {
+	if (embedding.size() <= dims) {
+		return embedding;
+	}
+	std::vector<float> truncated(dims);
+	_unnu_ragl_truncate_into(embedding.data(), truncated.data(), dims);
+	return truncated;
+}
+
+// Second stage for truncated embeddings: the vector candidates that have a
+// full vector stored get its cosine similarity and are re-ranked by it.
+static void _unnu_ragl_full_rescore(RaglConnectionLease& lease, const std::vector<float>& embeddings, std::map<std::string, ragl_candidate_t>& candidates, int* errorCode) {
+	duckdb::vector<duckdb::Value> _ids;
+	for (auto& it : candidates) {
+		if (it.second.has_embd) {
+			_ids.push_back(duckdb::Value(it.first));
+		}
+	}
+	duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_FULL_RESCORE);
+	if (_ids.empty() || statement == nullptr) {
+		return;
+	}
+
+	duckdb::vector<duckdb::Value> _query;
+	std::transform(embeddings.cbegin(), embeddings.cend(), std::back_inserter(_query), [](float d) { return duckdb::Value(d); });
+	auto result = statement->Execute(duckdb::Value::LIST(duckdb::LogicalType::FLOAT, _query), duckdb::Value::LIST(duckdb::LogicalType::VARCHAR, _ids));
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: full vector rescore %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5643;
+		return;
+	}
+
+	while (true) {
+		auto chunk = result->Fetch();
+		if (!chunk || chunk->size() == 0) {
+			break;
+		}
+		for (idx_t i = 0; i < chunk->size(); i++) {
+			auto found = candidates.find(chunk->GetValue(0, i).GetValue<std::string>());
+			if (found != candidates.end() && !chunk->GetValue(1, i).IsNull()) {
+				found->second.embd_score = 1.0f - chunk->GetValue(1, i).GetValue<float>();
+			}
+		}
+	}
+
+	std::vector<ragl_candidate_t*> ranked;
+	for (auto& it : candidates) {
+		if (it.second.has_embd) {
+			ranked.push_back(&it.second);
+		}
+	}
+	std::stable_sort(ranked.begin(), ranked.end(),
+		[](const ragl_candidate_t* a, const ragl_candidate_t* b) { return a->embd_score > b->embd_score; });
+	for (size_t k = 0; k < ranked.size(); k++) {
+		ranked[k]->embd_rank = k + 1;
+	}
+}
+
+// Vector candidates of the quantized storage modes: a shortlist of
+// UNNU_RAGL_RESCORE_FACTOR times the limit by the codes, rescored and cut by
+// the cosine distance of the float vectors.
+static void _unnu_ragl_quantized_candidates(RaglConnectionLease& lease, int32_t storage, const std::vector<float>& embeddings, int limit, std::map<std::string, ragl_candidate_t>& candidates, int* errorCode) {
+	duckdb::PreparedStatement* statement = lease.Statement(storage == 1 ? RAGL_STMT_INT8_CANDIDATES : RAGL_STMT_BINARY_CANDIDATES);
+	if (statement == nullptr) {
+		*errorCode = 5643;
+		return;
+	}
+
+	duckdb::vector<duckdb::Value> _query;
+	std::transform(embeddings.cbegin(), embeddings.cend(), std::back_inserter(_query), [](float d) { return duckdb::Value(d); });
+	const duckdb::Value query = duckdb::Value::LIST(duckdb::LogicalType::FLOAT, _query);
+	const int64_t shortlist = static_cast<int64_t>(limit) * std::max(UNNU_RAGL_RESCORE_FACTOR, 1);
+
+	duckdb::unique_ptr<duckdb::QueryResult> result;
+	if (storage == 1) {
+		result = statement->Execute(query, duckdb::Value::BIGINT(shortlist), duckdb::Value::BIGINT(limit));
+	}
+	else {
+		std::string bits(embeddings.size(), '0');
+		for (size_t i = 0; i < embeddings.size(); i++) {
+			if (embeddings[i] > 0.0f) {
+				bits[i] = '1';
+			}
+		}
+		result = statement->Execute(query, bits, duckdb::Value::BIGINT(shortlist), duckdb::Value::BIGINT(limit));
+	}
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: quantized candidates %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5643;
+		return;
+	}
+
+	int rank = 0;
+	while (true) {
+		auto chunk = result->Fetch();
+		if (!chunk || chunk->size() == 0) {
+			break;
+		}
+		for (idx_t i = 0; i < chunk->size(); i++) {
+			auto frag_id = chunk->GetValue(0, i).GetValue<std::string>();
+			ragl_candidate_t& candidate = candidates[frag_id];
+			candidate.frag_id = frag_id;
+			candidate.text = chunk->GetValue(1, i).GetValue<std::string>();
+			candidate.embd_score = 1.0f - chunk->GetValue(2, i).GetValue<float>();
+			candidate.embd_rank = ++rank;
+			candidate.has_embd = true;
+		}
+	}
+}
+
+// BM25 scores every row, so the filter scope is applied before the limit.
+static void _unnu_ragl_fts_candidates(RaglConnectionLease& lease, const std::string& text, const ragl_filter_t& filter, int limit, std::map<std::string, ragl_candidate_t>& candidates, int* errorCode) {
+	duckdb::unique_ptr<duckdb::QueryResult> result;
+	if (filter.empty()) {
+		duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_FTS_CANDIDATES);
+		if (statement == nullptr) {
+			return;
+		}
+		result = statement->Execute(text, limit);
+	}
+	else {
+		duckdb::vector<duckdb::Value> params;
+		const std::string scope = _unnu_ragl_filter_scope(filter, params);
+		std::string select = "SELECT frag_id, text, score FROM (SELECT frag_id, text, fts_main_embeddings.match_bm25(frag_id, $";
+		select.append(std::to_string(params.size() + 1)).append(") AS score FROM embeddings WHERE frag_id IN (").append(scope);
+		select.append(")) sq WHERE score IS NOT NULL ORDER BY score DESC LIMIT $").append(std::to_string(params.size() + 2)).append(";");
+		auto statement = lease.Conn().Prepare(select);
+		if (statement->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: filtered fts candidates %s\n", statement->GetError().c_str());
+#endif
+			* errorCode = 5644;
+			return;
+		}
+		params.push_back(duckdb::Value(text));
+		params.push_back(duckdb::Value::INTEGER(limit));
+		result = statement->Execute(params, false);
+	}
+	if (result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: fts candidates %s\n", result->GetError().c_str());
+#endif
+		* errorCode = 5644;
+		return;
+	}
+
+	int rank = 0;
+	auto output = result.get();
+	while (true) {
+		auto chunk = output->Fetch();
+		if (chunk) {
+			for (idx_t i = 0; i < chunk->size(); i++) {
+				auto frag_id = chunk->GetValue(0, i).GetValue<std::string>();
+				ragl_candidate_t& candidate = candidates[frag_id];
+				candidate.fts_rank = ++rank;
+				if (!candidate.has_embd) {
+					candidate.frag_id = frag_id;
+					candidate.text = chunk->GetValue(1, i).GetValue<std::string>();
+				}
+				candidate.fts_score = chunk->GetValue(2, i).GetValue<float>();
+				candidate.has_fts = true;
+			}
+		}
+		else {
+			break;
+		}
+	}
+}
+
+// Fuses the union of both candidate sets. The weighted sum normalises each
+// score by its maximum within the candidates; reciprocal rank fusion scores
+// sum(weight / (k + rank)) and ignores the raw score scales altogether.
+static std::vector<ragl_candidate_t> _unnu_ragl_fuse(std::map<std::string, ragl_candidate_t>& candidates) {
+	float max_embd = 0.0f;
+	float max_fts = 0.0f;
+	for (auto& it : candidates) {
+		if (it.second.has_embd) max_embd = std::max(max_embd, it.second.embd_score + 1.0f);
+		if (it.second.has_fts) max_fts = std::max(max_fts, it.second.fts_score);
+	}
+
+	std::vector<ragl_candidate_t> fused;
+	fused.reserve(candidates.size());
+	for (auto& it : candidates) {
+		ragl_candidate_t& candidate = it.second;
+		if (UNNU_RAGL_FUSION_STRATEGY == 1) {
+			const float k = static_cast<float>(std::max(UNNU_RAGL_RRF_K, 1));
+			float rrf_embd = candidate.has_embd ? 1.0f / (k + candidate.embd_rank) : 0.0f;
+			float rrf_fts = candidate.has_fts ? 1.0f / (k + candidate.fts_rank) : 0.0f;
+			candidate.score = UNNU_RAGL_FUSION_EMBEDDING_WEIGHT * rrf_embd + UNNU_RAGL_FUSION_FTS_WEIGHT * rrf_fts;
+		}
+		else {
+			float norm_embd = candidate.has_embd && max_embd > 0.0f ? (candidate.embd_score + 1.0f) / max_embd : 0.0f;
+			float norm_fts = candidate.has_fts && max_fts > 0.0f ? candidate.fts_score / max_fts : 0.0f;
+			candidate.score = UNNU_RAGL_FUSION_EMBEDDING_WEIGHT * norm_embd + UNNU_RAGL_FUSION_FTS_WEIGHT * norm_fts;
+		}
+		fused.push_back(std::move(candidate));
+	}
+
+	std::sort(fused.begin(), fused.end(),
+		[](const ragl_candidate_t& a, const ragl_candidate_t& b) { return a.score > b.score; });
+	return fused;
+}
+
+// Number of special tokens the tokenizer puts in front of a sequence, found by
+// comparing the encodings of "" and "a" (1 for [CLS]/<s>, 0 without specials).
+static size_t _unnu_ragl_special_prefix(tokenizers::Tokenizer* tokenizer) {
+	std::vector<size_t> empty = _unnu_ragl_tokenize(tokenizer, "");
+	std::vector<size_t> single = _unnu_ragl_tokenize(tokenizer, "a");
+	size_t prefix = 0;
+	while (prefix < empty.size() && prefix < single.size() && empty[prefix] == single[prefix]) {
+		prefix++;
+	}
+	return prefix;
+}
+
+// Relevance logits of a batch: the classifier head applied to the pooler
+// output, or the pooler output itself when it is 1 or 2 wide. Returns the
+// number of labels (0 for an output that is not a relevance head).
+static size_t _unnu_ragl_rerank_logits(const ragl_reranker_t& reranker, const ctranslate2::StorageView& pooled, std::vector<float>& logits) {
+	ctranslate2::StorageView host = pooled.device() != ctranslate2::Device::CPU ? pooled.to(ctranslate2::Device::CPU) : pooled;
+	if (host.dtype() != ctranslate2::DataType::FLOAT32) {
+		host = host.to_float32();
+	}
+	const size_t rows = host.dim(0);
+	const size_t width = host.rank() > 1 ? host.dim(1) : 1;
+	const float* data = host.data<float>();
+	if (reranker.labels > 0) {
+		if (width != reranker.hidden) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: _unnu_ragl_rerank pooler output is %zu wide, classifier expects %zu\n", width, reranker.hidden);
+#endif
+			return 0;
+		}
+		const arma::fmat _weight(const_cast<float*>(reranker.weight.data()), reranker.hidden, reranker.labels, false, true);
+		const arma::fmat _pooled(const_cast<float*>(data), width, rows, false, true);
+		arma::fmat _logits = _weight.t() * _pooled;
+		_logits.each_col() += arma::fvec(reranker.bias);
+		logits.assign(_logits.memptr(), _logits.memptr() + _logits.n_elem);
+		return reranker.labels;
+	}
+	if (width != 1 && width != 2) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: _unnu_ragl_rerank pooler output is %zu wide and no classifier.txt was found\n", width);
+#endif
+		return 0;
+	}
+	logits.assign(data, data + rows * width);
+	return width;
+}
+
+// Re-scores the first UNNU_RAGL_RERANK_LIMIT candidates with the cross-encoder
+// on (query, fragment) pairs; the remaining candidates keep their fused order,
+// as do all of them when the model yields no relevance logits.
+static void _unnu_ragl_rerank(const std::string& text, std::vector<ragl_candidate_t>& fused) {
+	size_t count = std::min<size_t>(fused.size(), std::max(UNNU_RAGL_RERANK_LIMIT, 0));
+	std::shared_ptr<const ragl_reranker_t> reranker = _unnu_ragl_reranker();
+	if (reranker == nullptr || count < 2) {
+		return;
+	}
+
+	try {
+		const size_t prefix = reranker->prefix;
+		const size_t max_tokens = std::max(UNNU_RAGL_RERANK_MAX_TOKENS, 8);
+		std::vector<size_t> query_ids = _unnu_ragl_tokenize(reranker->tokenizer.get(), text);
+		if (query_ids.size() > max_tokens / 2) {
+			size_t closing = query_ids.back();
+			query_ids.resize(max_tokens / 2);
+			query_ids.back() = closing;
+		}
+
+		std::vector<std::vector<size_t>> pairs(count);
+		std::vector<std::vector<size_t>> token_types(count);
+		for (size_t k = 0; k < count; k++) {
+			std::vector<size_t> doc_ids = _unnu_ragl_tokenize(reranker->tokenizer.get(), fused[k].text);
+			std::vector<size_t>& ids = pairs[k];
+			// [CLS] query [SEP] fragment [SEP], keeping the closing special when truncating
+			ids = query_ids;
+			size_t start = std::min(prefix, doc_ids.size());
+			size_t room = max_tokens - ids.size();
+			if (doc_ids.size() - start <= room) {
+				ids.insert(ids.end(), doc_ids.begin() + start, doc_ids.end());
+			}
+			else if (room > 0) {
+				ids.insert(ids.end(), doc_ids.begin() + start, doc_ids.begin() + start + room);
+				ids.back() = doc_ids.back();
+			}
+			token_types[k].assign(ids.size(), 1);
+			std::fill(token_types[k].begin(), token_types[k].begin() + query_ids.size(), 0);
+		}
+
+		ctranslate2::EncoderForwardOutput output = reranker->encoder->forward_batch_async(pairs, token_types).get();
+		if (!output.pooler_output) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: _unnu_ragl_rerank model has no pooler output\n");
+#endif
+			return;
+		}
+
+		std::vector<float> logits;
+		const size_t labels = _unnu_ragl_rerank_logits(*reranker, *output.pooler_output, logits);
+		if (labels == 0) {
+			return;
+		}
+		for (size_t k = 0; k < count; k++) {
+			// a single logit is the relevance, two labels score by the log-odds of relevant
+			fused[k].score = labels == 1 ? logits[k] : logits[k * 2 + 1] - logits[k * 2];
+		}
+		std::stable_sort(fused.begin(), fused.begin() + count,
+			[](const ragl_candidate_t& a, const ragl_candidate_t& b) { return a.score > b.score; });
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: _unnu_ragl_rerank\n");
+#endif
+	}
+}
+
+// Fused candidates of one knowledge base. With rerank false the list is only
+// cut to the rerank window, so fan-out queries can rerank the merged list.
+// A non-empty filter restricts both candidate sets to its scope.
+static std::vector<ragl_candidate_t> _unnu_ragl_search(ragl_kb_t& kb, const std::string& text, const std::vector<float>& embeddings, int limit, bool rerank, const ragl_filter_t& filter, int* errorCode) {
+	const int candidate_limit = std::max(UNNU_RAGL_CANDIDATE_LIMIT, limit);
+	std::map<std::string, ragl_candidate_t> candidates;
+	_unnu_ragl_touch(kb);
+	{
+		// the vector query is planned per call, see _unnu_ragl_vector_literal
+		// the index holds the truncated vectors, see UNNU_RAGL_EMBEDDING_SIZE
+		const std::vector<float> query = _unnu_ragl_truncate_embedding(embeddings, UNNU_RAGL_EMBEDDING_SIZE);
+		RaglConnectionLease lease(kb);
+		if (kb.model_stale) {
+			// the stored vectors belong to another embedding space until the swap
+		}
+		else if (!filter.empty()) {
+			_unnu_ragl_filtered_candidates(kb, lease, filter, query, candidate_limit, candidates, errorCode);
+		}
+		else if (kb.storage != 0) {
+			_unnu_ragl_quantized_candidates(lease, kb.storage, query, candidate_limit, candidates, errorCode);
+		}
+		else if (!_unnu_ragl_exact_candidates(kb, lease.Conn(), query, candidate_limit, candidates, errorCode)) {
+			_unnu_ragl_vector_candidates(lease.Conn(), query, candidate_limit, candidates, errorCode);
+		}
+		if (UNNU_RAGL_KEEP_FULL_VECTORS && embeddings.size() > query.size()) {
+			_unnu_ragl_full_rescore(lease, embeddings, candidates, errorCode);
+		}
+		_unnu_ragl_fts_candidates(lease, text, filter, candidate_limit, candidates, errorCode);
+	}
+
+	std::vector<ragl_candidate_t> fused = _unnu_ragl_fuse(candidates);
+	for (ragl_candidate_t& candidate : fused) {
+		candidate.kb = kb.handle;
+	}
+	size_t keep = std::max(limit, 0);
+	if (rerank) {
+		_unnu_ragl_rerank(text, fused);
+	}
+	else {
+		keep = std::max<size_t>(keep, std::max(UNNU_RAGL_RERANK_LIMIT, 0));
+	}
+	if (fused.size() > keep) {
+		fused.resize(keep);
+	}
+	return fused;
+}
+
+// Searches every knowledge base in parallel and merges the candidates by
+// fused score before the shared rerank and the final cut.
+static std::vector<ragl_candidate_t> _unnu_ragl_search_many(const std::vector<ragl_kb_ptr>& kbs, const std::string& text, const std::vector<float>& embeddings, int limit, const ragl_filter_t& filter, int* errorCode) {
+	std::vector<std::future<std::vector<ragl_candidate_t>>> searches;
+	std::vector<int> errors(kbs.size(), 0);
+	searches.reserve(kbs.size());
+	for (size_t k = 0; k < kbs.size(); k++) {
+		searches.push_back(std::async(std::launch::async, [&, k]() {
+			return _unnu_ragl_search(*kbs[k], text, embeddings, limit, false, filter, &errors[k]);
+		}));
+	}
+
+	std::vector<ragl_candidate_t> merged;
+	for (size_t k = 0; k < searches.size(); k++) {
+		std::vector<ragl_candidate_t> fused = searches[k].get();
+		if (errors[k] != 0) {
+			*errorCode = errors[k];
+		}
+		std::move(fused.begin(), fused.end(), std::back_inserter(merged));
+	}
+	std::stable_sort(merged.begin(), merged.end(),
+		[](const ragl_candidate_t& a, const ragl_candidate_t& b) { return a.score > b.score; });
+	_unnu_ragl_rerank(text, merged);
+	if (merged.size() > static_cast<size_t>(std::max(limit, 0))) {
+		merged.resize(std::max(limit, 0));
+	}
+	return merged;
+}
+
+// Document ids every fragment is mapped to, comma separated and aligned with
+// fused; one lookup per knowledge base the fragments come from.
+static std::vector<std::string> _unnu_ragl_fragment_documents(const std::vector<ragl_candidate_t>& fused) {
+	std::vector<std::string> documents(fused.size());
+	std::map<int32_t, std::unordered_map<std::string, size_t>> by_kb;
+	for (size_t k = 0; k < fused.size(); k++) {
+		by_kb[fused[k].kb][fused[k].frag_id] = k;
+	}
+	for (auto& it : by_kb) {
+		ragl_kb_ptr kb = _unnu_ragl_kb(it.first);
+		if (kb == nullptr) {
+			continue;
+		}
+		try {
+			RaglConnectionLease lease(*kb);
+			duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_FRAGMENT_DOCUMENTS);
+			if (statement == nullptr) {
+				continue;
+			}
+			duckdb::vector<duckdb::Value> _ids;
+			for (auto& frag : it.second) {
+				_ids.push_back(duckdb::Value(frag.first));
+			}
+			auto result = statement->Execute(duckdb::Value::LIST(duckdb::LogicalType::VARCHAR, _ids));
+			if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+				fprintf(stderr, "error: fragment documents %s\n", result->GetError().c_str());
+#endif
+				continue;
+			}
+			while (true) {
+				auto chunk = result->Fetch();
+				if (!chunk || chunk->size() == 0) {
+					break;
+				}
+				for (idx_t i = 0; i < chunk->size(); i++) {
+					auto found = it.second.find(chunk->GetValue(0, i).GetValue<std::string>());
+					if (found != it.second.end()) {
+						documents[found->second] = chunk->GetValue(1, i).GetValue<std::string>();
+					}
+				}
+			}
+		}
+		catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: _unnu_ragl_fragment_documents\n");
+#endif
+		}
+	}
+	return documents;
+}
+
+// Bump allocator over one calloc'd block: every callback payload, with its
+// strings, fragments and values, is a single allocation that
+// unnu_ragl_free_result / unnu_ragl_free_embedvector release with one free.
+// Every piece starts on an 8-byte boundary.
+class RaglArena {
+public:
+	static size_t Aligned(size_t bytes) {
+		return (bytes + 7) & ~static_cast<size_t>(7);
+	}
+
+	static size_t StringSize(const std::string& value) {
+		return Aligned(value.length() + 1);
+	}
+
+	explicit RaglArena(size_t size) : base(static_cast<char*>(std::calloc(Aligned(size), 1))), size(Aligned(size)) {}
+
+	template <typename T>
+	T* Take(size_t count = 1) {
+		const size_t bytes = Aligned(sizeof(T) * count);
+		if (base == nullptr || used + bytes > size) {
+			return nullptr;
+		}
+		T* item = reinterpret_cast<T*>(base + used);
+		used += bytes;
+		return item;
+	}
+
+	char* Copy(const std::string& value) {
+		char* copy = Take<char>(value.length() + 1);
+		if (copy != nullptr) {
+			std::memcpy(copy, value.c_str(), value.length());
+		}
+		return copy;
+	}
+
+private:
+	char* base;
+	size_t size;
+	size_t used = 0;
+};
+
+// One block: the result, its fragment pointers, the fragments, their strings.
+static UnnuRaglResult_t* _unnu_ragl_new_result(UnnuRaglResultType_t type, const ragl_candidate_t* fused, size_t count, const std::string* documents) {
+	size_t size = RaglArena::Aligned(sizeof(UnnuRaglResult_t)) + RaglArena::Aligned(count * sizeof(UnnuRaglFragment_t*));
+	for (size_t k = 0; k < count; k++) {
+		size += RaglArena::Aligned(sizeof(UnnuRaglFragment_t)) + RaglArena::StringSize(fused[k].text)
+			+ RaglArena::StringSize(fused[k].frag_id) + RaglArena::StringSize(documents[k]);
+	}
+
+	RaglArena arena(size);
+	UnnuRaglResult_t* response = arena.Take<UnnuRaglResult_t>();
+	if (response == nullptr) {
+		return nullptr;
+	}
+	response->type = type;
+	response->ref_id = nullptr;
+	response->reflen = 0;
+	response->text = nullptr;
+	response->length = 0;
+	response->count = count;
+	response->fragments = count > 0 ? arena.Take<UnnuRaglFragment_t*>(count) : nullptr;
+	for (size_t k = 0; k < count; k++) {
+		const ragl_candidate_t& candidate = fused[k];
+		UnnuRaglFragment_t* frag = arena.Take<UnnuRaglFragment_t>();
+		frag->length = candidate.text.length();
+		frag->text = arena.Copy(candidate.text);
+		frag->reflen = candidate.frag_id.length();
+		frag->ref_id = arena.Copy(candidate.frag_id);
+		frag->doclen = documents[k].length();
+		frag->document_id = arena.Copy(documents[k]);
+		frag->score = candidate.score;
+		frag->kb = candidate.kb;
+		response->fragments[k] = frag;
+	}
+	return response;
+}
+
+// One block: the vector header, its values, the text and the ref_id.
+static UnnuRagEmbdVec_t* _unnu_ragl_new_embdvec(UnnuRaglResultType_t type, const std::string& ref_id, const std::string& text, const float* values, size_t count) {
+	RaglArena arena(RaglArena::Aligned(sizeof(UnnuRagEmbdVec_t)) + RaglArena::Aligned(count * sizeof(float))
+		+ RaglArena::StringSize(text) + RaglArena::StringSize(ref_id));
+	UnnuRagEmbdVec_t* vec = arena.Take<UnnuRagEmbdVec_t>();
+	if (vec == nullptr) {
+		return nullptr;
+	}
+	vec->type = type;
+	vec->count = count;
+	vec->values = count > 0 ? arena.Take<float>(count) : nullptr;
+	if (count > 0) {
+		std::memcpy(vec->values, values, count * sizeof(float));
+	}
+	vec->length = text.length();
+	vec->text = arena.Copy(text);
+	vec->reflen = ref_id.length();
+	vec->ref_id = arena.Copy(ref_id);
+	return vec;
+}
+
+static void _unnu_ragl_emit_results(const std::vector<ragl_candidate_t>& fused) {
+	if (response_cb != nullptr) {
+		const std::vector<std::string> documents = _unnu_ragl_fragment_documents(fused);
+		UnnuRaglResult_t* response = _unnu_ragl_new_result(UnnuRaglResultType::UNNU_RAGL_QUERY, fused.data(), fused.size(), documents.data());
+		if (response != nullptr) {
+			response_cb(response);
+		}
+	}
+}
+
+// Streaming protocol: one UNNU_RAGL_QUERY result per fragment in score order,
+// then an UNNU_RAGL_FINISH result without fragments closes the stream.
+static void _unnu_ragl_stream_results(const std::vector<ragl_candidate_t>& fused) {
+	if (response_cb == nullptr) {
+		return;
+	}
+	const std::vector<std::string> documents = _unnu_ragl_fragment_documents(fused);
+	for (size_t k = 0; k < fused.size(); k++) {
+		UnnuRaglResult_t* response = _unnu_ragl_new_result(UnnuRaglResultType::UNNU_RAGL_QUERY, &fused[k], 1, &documents[k]);
+		if (response != nullptr) {
+			response_cb(response);
+		}
+	}
+	UnnuRaglResult_t* finish = _unnu_ragl_new_result(UnnuRaglResultType::UNNU_RAGL_FINISH, nullptr, 0, nullptr);
+	if (finish != nullptr) {
+		response_cb(finish);
+	}
+}
+
+// top-k of the last search in one knowledge base, valid while its generation
+// and the query settings match
+typedef struct query_cache_results {
+	std::vector<ragl_candidate_t> results;
+	uint64_t generation = 0;
+	uint64_t settings = 0;
+} query_cache_results_t;
+
+typedef struct query_cache_entry {
+	std::string key;
+	std::vector<float> embedding;
+	std::unordered_map<int32_t, query_cache_results_t> results;
+} query_cache_entry_t;
+
+static std::mutex _query_cache_mutex;
+static std::list<query_cache_entry_t> _query_cache;
+static std::unordered_map<std::string, std::list<query_cache_entry_t>::iterator> _query_cache_index;
+static UnnuRaglCacheStats_t _query_cache_stats = {};
+static double _query_embed_ms = 0.0;
+static double _query_search_ms = 0.0;
+
+// Lower-cases ASCII, collapses whitespace runs and trims, so repeated voice
+// queries that differ only in case or spacing share one cache entry.
+static std::string _unnu_ragl_normalize_query(const std::string& text) {
+	std::string key;
+	key.reserve(text.size());
+	bool space = false;
+	for (unsigned char c : text) {
+		if (std::isspace(c)) {
+			space = !key.empty();
+			continue;
+		}
+		if (space) {
+			key.push_back(' ');
+			space = false;
+		}
+		key.push_back(c < 0x80 ? static_cast<char>(std::tolower(c)) : static_cast<char>(c));
+	}
+	return key;
+}
+
+static void _unnu_ragl_query_settings_changed() {
+	_query_settings_version++;
+}
+
+static void _unnu_ragl_cache_touch(std::list<query_cache_entry_t>::iterator it) {
+	_query_cache.splice(_query_cache.begin(), _query_cache, it);
+}
+
+static void _unnu_ragl_cache_put(const std::string& key, const std::vector<float>& embedding) {
+	std::lock_guard<std::mutex> lock(_query_cache_mutex);
+	if (UNNU_RAGL_QUERY_CACHE_CAPACITY <= 0) {
+		return;
+	}
+	auto found = _query_cache_index.find(key);
+	if (found != _query_cache_index.end()) {
+		found->second->embedding = embedding;
+		_unnu_ragl_cache_touch(found->second);
+		return;
+	}
+	query_cache_entry_t entry;
+	entry.key = key;
+	entry.embedding = embedding;
+	_query_cache.push_front(std::move(entry));
+	_query_cache_index[key] = _query_cache.begin();
+	while (_query_cache.size() > static_cast<size_t>(UNNU_RAGL_QUERY_CACHE_CAPACITY)) {
+		_query_cache_index.erase(_query_cache.back().key);
+		_query_cache.pop_back();
+	}
+}
+
+static bool _unnu_ragl_cache_get(const std::string& key, std::vector<float>& embedding, const ragl_kb_t* kb, std::vector<ragl_candidate_t>* results, bool* results_hit) {
+	std::lock_guard<std::mutex> lock(_query_cache_mutex);
+	_query_cache_stats.lookups++;
+	auto found = _query_cache_index.find(key);
+	if (found == _query_cache_index.end()) {
+		_query_cache_stats.misses++;
+		return false;
+	}
+	_unnu_ragl_cache_touch(found->second);
+	const query_cache_entry_t& entry = *found->second;
+	embedding = entry.embedding;
+	_query_cache_stats.embedding_hits++;
+	_query_cache_stats.saved_ms += _query_embed_ms;
+	*results_hit = false;
+	auto cached = kb != nullptr ? entry.results.find(kb->handle) : entry.results.end();
+	if (results != nullptr && cached != entry.results.end() && cached->second.generation == kb->generation && cached->second.settings == _query_settings_version) {
+		*results = cached->second.results;
+		*results_hit = true;
+		_query_cache_stats.result_hits++;
+		_query_cache_stats.saved_ms += _query_search_ms;
+	}
+	return true;
+}
+
+static void _unnu_ragl_cache_put_results(const std::string& key, int32_t kb, const std::vector<ragl_candidate_t>& results, uint64_t generation, uint64_t settings) {
+	std::lock_guard<std::mutex> lock(_query_cache_mutex);
+	auto found = _query_cache_index.find(key);
+	if (found != _query_cache_index.end()) {
+		query_cache_results_t& cached = found->second->results[kb];
+		cached.results = results;
+		cached.generation = generation;
+		cached.settings = settings;
+	}
+}
+
+static void _unnu_ragl_cache_clear() {
+	std::lock_guard<std::mutex> lock(_query_cache_mutex);
+	_query_cache.clear();
+	_query_cache_index.clear();
+}
+
+static void _unnu_ragl_record_latency(double& average, double ms) {
+	std::lock_guard<std::mutex> lock(_query_cache_mutex);
+	average = average <= 0.0 ? ms : 0.9 * average + 0.1 * ms;
+}
+
+static void _unnu_ragl_persist_query_embedding(ragl_kb_t& kb, const std::string& key, const std::vector<float>& embedding) {
+	if (!UNNU_RAGL_QUERY_CACHE_PERSIST || embedding.size() != static_cast<size_t>(UNNU_RAGL_EMBEDDING_SIZE)) {
+		return;
+	}
+	try {
+		RaglConnectionLease lease(kb);
+		duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_PERSIST_QUERY);
+		if (statement == nullptr) {
+			return;
+		}
+		duckdb::vector<duckdb::Value> _array;
+		std::transform(embedding.cbegin(), embedding.cend(), std::back_inserter(_array), [](float d) { return duckdb::Value(d); });
+		auto result = statement->Execute(key, duckdb::Value::INTEGER(UNNU_RAGL_POOLING_TYPE), duckdb::Value::ARRAY(duckdb::LogicalType::FLOAT, _array));
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: persisting query cache %s\n", result->GetError().c_str());
+#endif
+		}
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: _unnu_ragl_persist_query_embedding\n");
+#endif
+	}
+}
+
+// Warms the LRU with the most recently used persisted query embeddings.
+static void _unnu_ragl_load_query_cache(ragl_kb_t& kb) {
+	if (!UNNU_RAGL_QUERY_CACHE_PERSIST || UNNU_RAGL_QUERY_CACHE_CAPACITY <= 0) {
+		return;
+	}
+	RaglConnectionLease lease(kb);
+	duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_LOAD_QUERY_CACHE);
+	if (statement == nullptr) {
+		return;
+	}
+	auto result = statement->Execute(duckdb::Value::INTEGER(UNNU_RAGL_POOLING_TYPE), duckdb::Value::BIGINT(UNNU_RAGL_QUERY_CACHE_CAPACITY));
+	if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: loading query cache %s\n", result->GetError().c_str());
+#endif
+		return;
+	}
+	while (true) {
+		auto chunk = result->Fetch();
+		if (!chunk || chunk->size() == 0) {
+			break;
+		}
+		chunk->Flatten();
+		auto keys = duckdb::FlatVector::GetData<duckdb::string_t>(chunk->data[0]);
+		auto values = duckdb::FlatVector::GetData<float>(duckdb::ArrayVector::GetEntry(chunk->data[1]));
+		// embeddings persisted before unnu_rag_lite_update_dims keep their width
+		const size_t dims = duckdb::ArrayType::GetSize(chunk->data[1].GetType());
+		if (dims != static_cast<size_t>(UNNU_RAGL_EMBEDDING_SIZE)) {
+			break;
+		}
+		for (idx_t i = 0; i < chunk->size(); i++) {
+			std::vector<float> embedding(values + i * dims, values + (i + 1) * dims);
+			_unnu_ragl_cache_put(keys[i].GetString(), embedding);
+		}
+	}
+}
+
+static ragl_kb_ptr _unnu_ragl_open_kb(const char* db_path, int* errorCode) {
+	duckdb::DBConfigOptions options;
+	options.autoload_known_extensions = true;
+	options.autoinstall_known_extensions = true;
+	options.force_checkpoint = true;
+	options.checkpoint_on_shutdown = true;
+	if (UNNU_RAGL_DB_THREADS > 0) {
+		options.maximum_threads = UNNU_RAGL_DB_THREADS;
+	}
+	duckdb::DBConfig config;
+	config.options = options;
+
+	ragl_kb_ptr kb = std::make_shared<ragl_kb_t>();
+	kb->storage = UNNU_RAGL_STORAGE_MODE;
+	try {
+		kb->database = std::make_unique<duckdb::DuckDB>(db_path, &config);
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: opening knowledge base %s\n", db_path != nullptr ? db_path : ":memory:");
+#endif
+		*errorCode = 5642;
+		return nullptr;
+	}
+
+	_unnu_ragl_db_setup(*kb, UNNU_RAGL_EMBEDDING_SIZE, errorCode);
+
+	{
+		std::lock_guard<std::mutex> lock(_kb_registry_mutex);
+		kb->handle = _kb_next_handle++;
+		_kb_registry[kb->handle] = kb;
+	}
+	_unnu_ragl_start_maintenance(*kb);
+	_unnu_ragl_load_query_cache(*kb);
+	_unnu_ragl_check_model(*kb);
+	return kb;
+}
+
+static void _unnu_ragl_drain_ingest(ragl_kb_t& kb);
+static void _unnu_ragl_release_bulk_writer(ragl_kb_t& kb);
+
+// Unregisters the knowledge base after draining queued ingestion into it. The
+// database closes once the last in-flight query drops its reference.
+static void _unnu_ragl_close_kb(int32_t handle) {
+	ragl_kb_ptr kb;
+	{
+		std::lock_guard<std::mutex> lock(_kb_registry_mutex);
+		auto found = _kb_registry.find(handle);
+		if (found == _kb_registry.end()) {
+			return;
+		}
+		kb = found->second;
+	}
+	// documents waiting for a re-embedding are refused before the drain
+	{
+		std::lock_guard<std::mutex> lock(kb->reindex_mutex);
+		kb->reindex_closed = true;
+	}
+	_unnu_ragl_stop_reindex(*kb);
+	_unnu_ragl_drain_ingest(*kb);
+	_unnu_ragl_release_bulk_writer(*kb);
+	_unnu_ragl_stop_maintenance(*kb);
+	{
+		std::lock_guard<std::mutex> lock(_kb_registry_mutex);
+		_kb_registry.erase(handle);
+		if (_kb_default == handle) {
+			_kb_default = 0;
+		}
+	}
+	// connections still lent out close with the last in-flight operation
+	std::lock_guard<std::mutex> lock(kb->pool_mutex);
+	kb->pool_open -= kb->pool_idle.size();
+	kb->pool_idle.clear();
+}
+
+void unnu_rag_lite_open_kb(char* db_path, int* errorCode) {
+	_unnu_ragl_close_kb(_unnu_ragl_default_handle());
+	ragl_kb_ptr kb = _unnu_ragl_open_kb(db_path, errorCode);
+	if (kb != nullptr) {
+		std::lock_guard<std::mutex> lock(_kb_registry_mutex);
+		_kb_default = kb->handle;
+	}
+}
+
+int32_t unnu_rag_lite_kb_open(const char* db_path, int* errorCode) {
+	ragl_kb_ptr kb = _unnu_ragl_open_kb(db_path, errorCode);
+	return kb != nullptr ? kb->handle : 0;
+}
+
+void unnu_rag_lite_kb_close(int32_t handle) {
+	_unnu_ragl_close_kb(handle);
+}
+
+
+// Byte range [begin, end) of a sentence or chunk in the source text. All
+// boundaries fall on ASCII whitespace or punctuation, which never occur inside
+// a UTF-8 multi-byte sequence, so spans are always valid UTF-8 substrings.
+typedef struct ragl_span {
+	size_t begin;
+	size_t end;
+} ragl_span_t;
+
+static inline bool _unnu_ragl_is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline bool _unnu_ragl_is_terminator(char c) {
+	return c == '.' || c == '!' || c == '?';
+}
+
+// Narrows [begin, end) so it neither starts nor ends with whitespace.
+static inline ragl_span_t _unnu_ragl_trim_span(std::string_view text, size_t begin, size_t end) {
+	while (begin < end && _unnu_ragl_is_space(text[begin])) {
+		begin++;
+	}
+	while (end > begin && _unnu_ragl_is_space(text[end - 1])) {
+		end--;
+	}
+	return { begin, end };
+}
+
+// Finds the end of the paragraph starting at pos: a whitespace run holding two
+// or more line breaks. Returns the paragraph end and moves pos past the break.
+static size_t _unnu_ragl_next_paragraph(std::string_view text, size_t& pos) {
+	const size_t size = text.size();
+	size_t i = pos;
+	while (i < size) {
+		if (!_unnu_ragl_is_space(text[i])) {
+			i++;
+			continue;
+		}
+		size_t run = i;
+		int breaks = 0;
+		while (run < size && _unnu_ragl_is_space(text[run])) {
+			breaks += (text[run] == '\n');
+			run++;
+		}
+		if (breaks >= 2 && UNNU_RAGL_PARAGRAPH_CHUNKING) {
+			pos = run;
+			return i;
+		}
+		i = run;
+	}
+	pos = size;
+	return size;
+}
+
+// Appends the sentences of [begin, end). A sentence ends at a run of '.', '!'
+// or '?' followed by whitespace; trailing text without a terminator forms the
+// last sentence.
+static void _unnu_ragl_segment_sentences(std::string_view text, size_t begin, size_t end, std::vector<ragl_span_t>& sentences) {
+	size_t start = begin;
+	size_t i = begin;
+	while (i < end) {
+		if (!_unnu_ragl_is_terminator(text[i])) {
+			i++;
+			continue;
+		}
+		while (i < end && _unnu_ragl_is_terminator(text[i])) {
+			i++;
+		}
+		if (i < end && _unnu_ragl_is_space(text[i])) {
+			ragl_span_t sentence = _unnu_ragl_trim_span(text, start, i);
+			if (sentence.end > sentence.begin) {
+				sentences.push_back(sentence);
+			}
+			while (i < end && _unnu_ragl_is_space(text[i])) {
+				i++;
+			}
+			start = i;
+		}
+	}
+	ragl_span_t sentence = _unnu_ragl_trim_span(text, start, end);
+	if (sentence.end > sentence.begin) {
+		sentences.push_back(sentence);
+	}
+}
+
+// Single pass over the text emitting chunk boundaries as byte offsets.
+// Sentences are packed while the chunk (sentences joined by one space) stays
+// within chunksize. With overlap, a chunk also carries the sentence that
+// overflowed it, which then starts the next chunk. Chunks never cross
+// paragraphs unless paragraph chunking is disabled; a sentence longer than
+// chunksize forms a chunk by itself.
+static std::vector<ragl_span_t> _unnu_ragl_chunk_spans(std::string_view text, size_t chunksize, bool overlap) {
+	std::vector<ragl_span_t> chunks;
+	std::vector<ragl_span_t> sentences;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		const size_t begin = pos;
+		const size_t end = _unnu_ragl_next_paragraph(text, pos);
+		sentences.clear();
+		_unnu_ragl_segment_sentences(text, begin, end, sentences);
+		if (sentences.empty()) {
+			continue;
+		}
+
+		size_t first = 0;
+		size_t length = 0;
+		for (size_t j = 0; j < sentences.size(); j++) {
+			const size_t sentence_length = sentences[j].end - sentences[j].begin;
+			if (j > first && (length + sentence_length) > chunksize) {
+				chunks.push_back({ sentences[first].begin, overlap ? sentences[j].end : sentences[j - 1].end });
+				first = j;
+				length = sentence_length;
+			}
+			else {
+				length += (j > first ? 1 : 0) + sentence_length;
+			}
+		}
+		chunks.push_back({ sentences[first].begin, sentences.back().end });
+	}
+	return chunks;
+}
+
+std::vector<std::string> _unnu_ragl_split_text_into_chunks(const std::string& text, int chunksize, bool overlap) {
+	std::string_view view(text);
+	std::vector<ragl_span_t> spans = _unnu_ragl_chunk_spans(view, static_cast<size_t>(std::max(chunksize, 1)), overlap);
+	std::vector<std::string> chunks;
+	chunks.reserve(spans.size());
+	for (const ragl_span_t& span : spans) {
+		chunks.emplace_back(view.substr(span.begin, span.end - span.begin));
+	}
+	return chunks;
+}
+
+
+
+// Special tokens a tokenizer wraps every sequence in, split into the ones
+// before and after the content (e.g. [CLS] / [SEP], <s> / </s>).
+static void _unnu_ragl_special_tokens(tokenizers::Tokenizer* tokenizer, std::vector<size_t>& prefix, std::vector<size_t>& suffix) {
+	std::vector<size_t> empty = _unnu_ragl_tokenize(tokenizer, "");
+	size_t count = std::min(_unnu_ragl_special_prefix(tokenizer), empty.size());
+	prefix.assign(empty.begin(), empty.begin() + count);
+	suffix.assign(empty.begin() + count, empty.end());
+}
+
+// Chunks text against a token budget using the loaded tokenizer. Sentences are
+// tokenized once in a single batch, packed until the chunk reaches
+// max_tokens (special tokens included) and the trailing sentences covering up
+// to overlap tokens are carried into the next chunk. A sentence longer than
+// the budget is cut into token windows whose text is decoded from the ids.
+// The packed ids are returned in ids, so the chunks are not tokenized again.
+static std::vector<std::string> _unnu_ragl_split_text_into_token_chunks(const ragl_model_t& model, const std::string& text, int32_t max_tokens, int32_t overlap, std::vector<std::vector<size_t>>& ids) {
+	std::vector<std::string> chunks;
+	std::string_view view(text);
+
+	std::vector<ragl_span_t> sentences;
+	std::vector<size_t> paragraph_ends;
+	size_t pos = 0;
+	while (pos < view.size()) {
+		const size_t begin = pos;
+		const size_t end = _unnu_ragl_next_paragraph(view, pos);
+		_unnu_ragl_segment_sentences(view, begin, end, sentences);
+		paragraph_ends.push_back(sentences.size());
+	}
+	if (sentences.empty()) {
+		return chunks;
+	}
+
+	std::vector<std::string> texts;
+	texts.reserve(sentences.size());
+	for (const ragl_span_t& sentence : sentences) {
+		texts.emplace_back(view.substr(sentence.begin, sentence.end - sentence.begin));
+	}
+	std::vector<std::vector<size_t>> sentence_ids = _unnu_ragl_tokenize_batch(model, texts);
+
+	const std::vector<size_t>& prefix = model.prefix;
+	const std::vector<size_t>& suffix = model.suffix;
+	const size_t specials = prefix.size() + suffix.size();
+	const size_t budget = static_cast<size_t>(std::max<int32_t>(max_tokens, static_cast<int32_t>(specials) + 1)) - specials;
+	const size_t carry = std::min(static_cast<size_t>(std::max(overlap, 0)), budget / 2);
+
+	// content ids of sentence k, without the specials the tokenizer added
+	auto content = [&](size_t k, size_t& first, size_t& last) {
+		const std::vector<size_t>& s = sentence_ids[k];
+		first = std::min(prefix.size(), s.size());
+		last = std::max(first, s.size() >= suffix.size() ? s.size() - suffix.size() : first);
+	};
+
+	auto emit = [&](size_t from, size_t to) {
+		std::vector<size_t> chunk_ids(prefix);
+		for (size_t k = from; k < to; k++) {
+			size_t first, last;
+			content(k, first, last);
+			chunk_ids.insert(chunk_ids.end(), sentence_ids[k].begin() + first, sentence_ids[k].begin() + last);
+		}
+		chunk_ids.insert(chunk_ids.end(), suffix.begin(), suffix.end());
+		chunks.emplace_back(view.substr(sentences[from].begin, sentences[to - 1].end - sentences[from].begin));
+		ids.push_back(std::move(chunk_ids));
+	};
+
+	size_t k = 0;
+	for (size_t paragraph_end : paragraph_ends) {
+		size_t from = k;
+		size_t used = 0;
+		for (; k < paragraph_end; k++) {
+			size_t first, last;
+			content(k, first, last);
+			const size_t length = last - first;
+
+			if (length > budget) {
+				if (k > from) {
+					emit(from, k);
+				}
+				std::vector<size_t> window;
+				const size_t step = std::max<size_t>(budget - carry, 1);
+				for (size_t w = first; w < last; w += step) {
+					const size_t w_end = std::min(w + budget, last);
+					window.assign(sentence_ids[k].begin() + w, sentence_ids[k].begin() + w_end);
+					std::vector<int32_t> decode_ids(window.begin(), window.end());
+					std::string decoded;
+					{
+						std::lock_guard<std::mutex> lock(_tokenizer_mutex);
+						decoded = model.tokenizer->Decode(decode_ids);
+					}
+					std::vector<size_t> chunk_ids(prefix);
+					chunk_ids.insert(chunk_ids.end(), window.begin(), window.end());
+					chunk_ids.insert(chunk_ids.end(), suffix.begin(), suffix.end());
+					chunks.push_back(std::move(decoded));
+					ids.push_back(std::move(chunk_ids));
+					if (w_end == last) {
+						break;
+					}
+				}
+				from = k + 1;
+				used = 0;
+				continue;
+			}
+
+			if (k > from && used + length > budget) {
+				emit(from, k);
+				// carry whole trailing sentences worth at most carry tokens
+				size_t next = k;
+				size_t carried = 0;
+				while (next > from + 1) {
+					size_t f, l;
+					content(next - 1, f, l);
+					if (carried + (l - f) > carry || carried + (l - f) + length > budget) {
+						break;
+					}
+					carried += l - f;
+					next--;
+				}
+				from = next;
+				used = carried;
+			}
+			used += length;
+		}
+		if (k > from) {
+			emit(from, k);
+		}
+	}
+	return chunks;
+}
+
+
+
+static void _unnu_ragl_notify_embedding(const std::string& frag_id, const std::string& text, const float* embeddings, size_t count);
+
+// Streams the fragments of a document: one UNNU_RAGL_EMBEDDING per row as
+// DuckDB produces each chunk, read straight from the flat vectors, then a
+// FINISH marker.
+static void _unnu_rag_lite_retrieve(ragl_kb_ptr kb, std::string id) {
+	try {
+		RaglConnectionLease lease(*kb);
+		duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_RETRIEVE);
+		auto result = statement != nullptr ? statement->Execute(id) : nullptr;
+		if (result == nullptr || result->HasError()) {
+
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: retrieving %s %s\n", id.c_str(), result != nullptr ? result->GetError().c_str() : "");
+#endif
+		}
+		else {
+			while (true) {
+				auto chunk = result->Fetch();
+				if (!chunk || chunk->size() == 0) {
+					break;
+				}
+				chunk->Flatten();
+				auto ids = duckdb::FlatVector::GetData<duckdb::string_t>(chunk->data[0]);
+				auto texts = duckdb::FlatVector::GetData<duckdb::string_t>(chunk->data[1]);
+				const size_t dims = duckdb::ArrayType::GetSize(chunk->data[2].GetType());
+				auto values = duckdb::FlatVector::GetData<float>(duckdb::ArrayVector::GetEntry(chunk->data[2]));
+				for (idx_t i = 0; i < chunk->size(); i++) {
+					_unnu_ragl_notify_embedding(ids[i].GetString(), texts[i].GetString(), values + i * dims, dims);
+				}
+			}
+		}
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: _unnu_rag_lite_retrieve %s\n", id.c_str());
+#endif
+	}
+
+	if (embedding_cb != nullptr) {
+		UnnuRagEmbdVec_t* vec = _unnu_ragl_new_embdvec(UnnuRaglResultType::UNNU_RAGL_FINISH, id, "", nullptr, 0);
+		if (vec != nullptr) {
+			embedding_cb(vec);
+		}
+	}
+}
+
+void unnu_rag_lite_kb_retrieve(int32_t handle, const char* uri) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (kb == nullptr) {
+		return;
+	}
+	std::string input(uri);
+	std::thread thr(_unnu_rag_lite_retrieve, kb, input);
+	thr.detach();
+}
+
+void unnu_rag_lite_retrieve(const char* uri) {
+	unnu_rag_lite_kb_retrieve(_unnu_ragl_default_handle(), uri);
+}
+
+void unnu_rag_lite_kb_mapping(int32_t handle, const char* uri, const char* document_id) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (kb == nullptr) {
+		return;
+	}
+	try {
+		RaglConnectionLease lease(*kb);
+		duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_INSERT_DOXINFO);
+		if (statement == nullptr) {
+			return;
+		}
+		auto result = statement->Execute(std::string(document_id), std::string(uri), UNNU_RAGL_EMBEDDING_SIZE);
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: doxinfo mapping %s, %s %s\n", document_id, uri, result->GetError().c_str());
+#endif
+		}
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: doxinfo mapping %s, %s\n", document_id, uri);
+#endif
+	}
+}
+
+void unnu_rag_lite_mapping(const char* uri, const char* document_id) {
+	unnu_rag_lite_kb_mapping(_unnu_ragl_default_handle(), uri, document_id);
+}
+
+// Groups sequences into batches by ascending length so that the padded size
+// of a batch (rows * longest row) stays within max_tokens.
+static std::vector<std::vector<size_t>> _unnu_ragl_plan_batches(const std::vector<std::vector<size_t>>& ids, int32_t max_tokens) {
+	std::vector<size_t> order(ids.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(),
+		[&ids](size_t a, size_t b) { return ids[a].size() < ids[b].size(); });
+
+	std::vector<std::vector<size_t>> batches;
+	std::vector<size_t> current;
+	for (size_t idx : order) {
+		size_t longest = std::max<size_t>(ids[idx].size(), 1);
+		if (!current.empty() && (current.size() + 1) * longest > static_cast<size_t>(std::max(max_tokens, 1))) {
+			batches.push_back(std::move(current));
+			current.clear();
+		}
+		current.push_back(idx);
+	}
+	if (!current.empty()) {
+		batches.push_back(std::move(current));
+	}
+	return batches;
+}
+
+// Every submitted batch holds one slot until its result has been collected by
+// _unnu_ragl_await_batch, which bounds the number of batches in flight.
+static void _unnu_ragl_acquire_batch_slot() {
+	std::unique_lock<std::mutex> lock(_encoder_slots_mutex);
+	_encoder_slots_cv.wait(lock, [] { return _encoder_inflight_batches < UNNU_RAGL_MAX_QUEUED_BATCHES; });
+	_encoder_inflight_batches++;
+}
+
+static void _unnu_ragl_release_batch_slot() {
+	{
+		std::lock_guard<std::mutex> lock(_encoder_slots_mutex);
+		_encoder_inflight_batches--;
+	}
+	_encoder_slots_cv.notify_one();
+}
+
+// The caller keeps its reference to model until the batch is awaited.
+static std::future<ctranslate2::EncoderForwardOutput> _unnu_ragl_submit_batch(const ragl_model_t& model, const std::vector<std::vector<size_t>>& inputs) {
+	_unnu_ragl_acquire_batch_slot();
+	try {
+		return model.encoder->forward_batch_async(inputs);
+	}
+	catch (...) {
+		_unnu_ragl_release_batch_slot();
+		throw;
+	}
+}
+
+static ctranslate2::EncoderForwardOutput _unnu_ragl_await_batch(std::future<ctranslate2::EncoderForwardOutput>& result) {
+	try {
+		ctranslate2::EncoderForwardOutput output = result.get();
+		_unnu_ragl_release_batch_slot();
+		return output;
+	}
+	catch (...) {
+		_unnu_ragl_release_batch_slot();
+		throw;
+	}
+}
+
+// Pools every row of a batch straight out of the encoder storage into
+// dest[b] (hidden floats each) and L2-normalises it in place. Rows are padded
+// to the longest sequence, so mean and max only read the first lengths[b] steps.
+static void _unnu_ragl_pool_batch(const ctranslate2::StorageView& hidden_state, const std::vector<size_t>& lengths, float* const* dest) {
+	const ctranslate2::StorageView* view = &hidden_state;
+	ctranslate2::StorageView host;
+	if (hidden_state.device() != ctranslate2::Device::CPU || hidden_state.dtype() != ctranslate2::DataType::FLOAT32) {
+		host = hidden_state.device() != ctranslate2::Device::CPU ? hidden_state.to(ctranslate2::Device::CPU) : hidden_state;
+		if (host.dtype() != ctranslate2::DataType::FLOAT32) {
+			host = host.to_float32();
+		}
+		view = &host;
+	}
+
+	const size_t steps = view->dim(1);
+	const size_t hidden = view->dim(2);
+	const float* data = view->data<float>();
+
+	for (size_t b = 0; b < lengths.size(); b++) {
+		size_t len = std::min(std::max<size_t>(lengths[b], 1), steps);
+		// [hidden x len] column-major view over the row's token states, no copy
+		const arma::fmat _mat(const_cast<float*>(data + b * steps * hidden), hidden, len, false, true);
+		arma::fvec _pooled(dest[b], hidden, false, true);
+		switch (UNNU_RAGL_POOLING_TYPE) {
+		case 1:
+			_pooled = _mat.col(0);
+			break;
+		case 2:
+			_pooled = arma::max(_mat, 1);
+			break;
+		default:
+			_pooled = arma::mean(_mat, 1);
+			break;
+		}
+		float _norm = arma::norm(_pooled, 2);
+		if (_norm > 0.0f) {
+			_pooled /= _norm;
+		}
+	}
+}
+
+static inline std::vector<float> _unnu_ragl_process(std::string input) {
+	const ragl_model_ptr model = _unnu_ragl_model();
+	std::vector<std::vector<size_t>> _inputs_ids;
+	_inputs_ids.push_back(_unnu_ragl_tokenize(model->tokenizer.get(), input));
+
+	auto _val = _unnu_ragl_submit_batch(*model, _inputs_ids);
+	ctranslate2::EncoderForwardOutput output = _unnu_ragl_await_batch(_val);
+
+	std::vector<float> _vals(output.last_hidden_state.dim(2));
+	float* dest = _vals.data();
+	_unnu_ragl_pool_batch(output.last_hidden_state, { _inputs_ids[0].size() }, &dest);
+	return _vals;
+}
+
+// Collapses whitespace runs and trims, so re-flowed but otherwise unchanged
+// paragraphs hash to the same fragment.
+static std::string _unnu_ragl_normalize_chunk(const std::string& text) {
+	std::string normalized;
+	normalized.reserve(text.size());
+	bool space = false;
+	for (unsigned char c : text) {
+		if (std::isspace(c)) {
+			space = !normalized.empty();
+			continue;
+		}
+		if (space) {
+			normalized.push_back(' ');
+			space = false;
+		}
+		normalized.push_back(static_cast<char>(c));
+	}
+	return normalized;
+}
+
+// Namespace of the content addresses, derived from model id, pooling type and
+// dimensions, so the same text embedded under another model or pooling gets a
+// new fragment. Computed once per document (or reindex batch) with the model
+// that encodes it.
+static boost::uuids::uuid _unnu_ragl_fragment_space(const ragl_model_t& model) {
+	std::string space_name(model.id);
+	space_name.append("/").append(std::to_string(UNNU_RAGL_POOLING_TYPE)).append("/").append(std::to_string(UNNU_RAGL_EMBEDDING_SIZE));
+	boost::uuids::name_generator_sha1 space_gen(boost::uuids::ns::oid());
+	return space_gen(space_name);
+}
+
+// Content address of a chunk: a name-based (SHA-1) UUID of the normalised
+// text in the namespace of _unnu_ragl_fragment_space.
+static std::string _unnu_ragl_fragment_id(const boost::uuids::uuid& space, const std::string& text) {
+	boost::uuids::name_generator_sha1 gen(space);
+	return boost::uuids::to_string(gen(_unnu_ragl_normalize_chunk(text)));
+}
+
+// Fragments inserted by a transaction that has not committed yet. Another
+// document meeting the same text only maps it instead of inserting it again;
+// mappings from other transactions are counted, so a rolled-back owner knows
+// which fragments it still has to provide.
+static bool _unnu_ragl_claim_fragment(ragl_kb_t& kb, const std::string& frag_id, const RaglDocumentWriter* writer) {
+	std::lock_guard<std::mutex> lock(kb.pending_fragments_mutex);
+	auto claimed = kb.pending_fragments.emplace(frag_id, ragl_pending_fragment_t{ writer, 0 });
+	if (!claimed.second && claimed.first->second.owner != writer) {
+		claimed.first->second.waiters++;
+	}
+	return claimed.second;
+}
+
+// Positions of the fragments in frag_ids that other transactions mapped to.
+static std::vector<size_t> _unnu_ragl_awaited_fragments(ragl_kb_t& kb, const std::vector<std::string>& frag_ids) {
+	std::vector<size_t> awaited;
+	std::lock_guard<std::mutex> lock(kb.pending_fragments_mutex);
+	for (size_t k = 0; k < frag_ids.size(); k++) {
+		auto found = kb.pending_fragments.find(frag_ids[k]);
+		if (found != kb.pending_fragments.end() && found->second.waiters > 0) {
+			awaited.push_back(k);
+		}
+	}
+	return awaited;
+}
+
+static void _unnu_ragl_release_fragments(ragl_kb_t& kb, const std::vector<std::string>& frag_ids) {
+	std::lock_guard<std::mutex> lock(kb.pending_fragments_mutex);
+	for (const std::string& frag_id : frag_ids) {
+		kb.pending_fragments.erase(frag_id);
+	}
+}
+
+// Writes the fragments of one or more documents through a single connection
+// and one appender per table, staging rows in DataChunks so FLOAT[N] columns
+// are filled with memcpy from the pooled buffers instead of boxed Values.
+// Everything appended between Begin and Commit lands in one transaction.
+class RaglDocumentWriter {
+public:
+	RaglDocumentWriter(ragl_kb_t& kb, idx_t dims) : kb(kb), conn(*kb.database), dims(dims) {
+		embd_chunk.Initialize(duckdb::Allocator::DefaultAllocator(),
+			{ duckdb::LogicalType::VARCHAR, duckdb::LogicalType::VARCHAR, duckdb::LogicalType::ARRAY(duckdb::LogicalType::FLOAT, dims) });
+		map_chunk.Initialize(duckdb::Allocator::DefaultAllocator(),
+			{ duckdb::LogicalType::VARCHAR, duckdb::LogicalType::VARCHAR, duckdb::LogicalType::VARCHAR });
+		full_chunk.Initialize(duckdb::Allocator::DefaultAllocator(),
+			{ duckdb::LogicalType::VARCHAR, duckdb::LogicalType::LIST(duckdb::LogicalType::FLOAT) });
+	}
+
+	~RaglDocumentWriter() {
+		Commit();
+	}
+
+	// Appends a new fragment row and maps it to the document of the corpus
+	// (empty for none). full, when set, is the untruncated vector kept for rescoring.
+	bool Append(const std::string& document_id, const std::string& corpus, const std::string& frag_id, const std::string& text, const float* embedding, size_t count, const float* full = nullptr, size_t full_count = 0) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (count != dims) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: RaglDocumentWriter embedding has %zu values, table expects %zu\n", count, (size_t)dims);
+#endif
+			return false;
+		}
+		try {
+			if (!Begin()) {
+				return false;
+			}
+			if (embd_rows == STANDARD_CHUNK_ROWS) {
+				FlushEmbeddings();
+			}
+
+			auto embd_ids = duckdb::FlatVector::GetData<duckdb::string_t>(embd_chunk.data[0]);
+			auto embd_text = duckdb::FlatVector::GetData<duckdb::string_t>(embd_chunk.data[1]);
+			auto embd_values = duckdb::FlatVector::GetData<float>(duckdb::ArrayVector::GetEntry(embd_chunk.data[2]));
+			embd_ids[embd_rows] = duckdb::StringVector::AddString(embd_chunk.data[0], frag_id);
+			embd_text[embd_rows] = duckdb::StringVector::AddString(embd_chunk.data[1], text);
+			std::memcpy(embd_values + embd_rows * dims, embedding, dims * sizeof(float));
+			embd_rows++;
+			claimed.push_back(frag_id);
+			claimed_text.push_back(text);
+			claimed_vectors.insert(claimed_vectors.end(), embedding, embedding + dims);
+			if (full != nullptr && full_count > 0) {
+				AppendFull(frag_id, full, full_count);
+			}
+
+			return AppendMappingLocked(document_id, corpus, frag_id);
+		}
+		catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: RaglDocumentWriter append %s, %s\n", document_id.c_str(), frag_id.c_str());
+#endif
+			failed = true;
+			return false;
+		}
+	}
+
+	// Maps an already stored (or concurrently written) fragment to the document.
+	bool AppendMapping(const std::string& document_id, const std::string& corpus, const std::string& frag_id) {
+		std::lock_guard<std::mutex> lock(mutex);
+		try {
+			if (!Begin()) {
+				return false;
+			}
+			return AppendMappingLocked(document_id, corpus, frag_id);
+		}
+		catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: RaglDocumentWriter mapping %s, %s\n", document_id.c_str(), frag_id.c_str());
+#endif
+			failed = true;
+			return false;
+		}
+	}
+
+	// Called once a document is complete; commits every commit_every documents.
+	void EndDocument(int32_t commit_every) {
+		std::lock_guard<std::mutex> lock(mutex);
+		documents++;
+		if (documents >= std::max(commit_every, 1)) {
+			CommitLocked();
+		}
+	}
+
+	bool Commit() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return CommitLocked();
+	}
+
+private:
+	static constexpr idx_t STANDARD_CHUNK_ROWS = 2048;
+
+	bool Begin() {
+		if (active) {
+			return !failed;
+		}
+		auto result = conn.Query("BEGIN TRANSACTION;");
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: RaglDocumentWriter begin %s\n", result->GetError().c_str());
+#endif
+			return false;
+		}
+		embd_appender = std::make_unique<duckdb::Appender>(conn, "embeddings");
+		map_appender = std::make_unique<duckdb::Appender>(conn, "doxmap");
+		full_appender = std::make_unique<duckdb::Appender>(conn, "embeddings_full");
+		active = true;
+		failed = false;
+		return true;
+	}
+
+	bool AppendMappingLocked(const std::string& document_id, const std::string& corpus, const std::string& frag_id) {
+		if (map_rows == STANDARD_CHUNK_ROWS) {
+			FlushMappings();
+		}
+		auto map_docs = duckdb::FlatVector::GetData<duckdb::string_t>(map_chunk.data[0]);
+		auto map_frags = duckdb::FlatVector::GetData<duckdb::string_t>(map_chunk.data[1]);
+		map_docs[map_rows] = duckdb::StringVector::AddString(map_chunk.data[0], document_id);
+		map_frags[map_rows] = duckdb::StringVector::AddString(map_chunk.data[1], frag_id);
+		if (corpus.empty()) {
+			duckdb::FlatVector::SetNull(map_chunk.data[2], map_rows, true);
+		}
+		else {
+			duckdb::FlatVector::GetData<duckdb::string_t>(map_chunk.data[2])[map_rows] = duckdb::StringVector::AddString(map_chunk.data[2], corpus);
+		}
+		map_rows++;
+		changed = true;
+		return true;
+	}
+
+	void AppendFull(const std::string& frag_id, const float* full, size_t count) {
+		if (full_rows == STANDARD_CHUNK_ROWS) {
+			FlushFull();
+		}
+		duckdb::Vector& values = full_chunk.data[1];
+		const idx_t offset = duckdb::ListVector::GetListSize(values);
+		duckdb::ListVector::Reserve(values, offset + count);
+		std::memcpy(duckdb::FlatVector::GetData<float>(duckdb::ListVector::GetEntry(values)) + offset, full, count * sizeof(float));
+		duckdb::ListVector::SetListSize(values, offset + count);
+
+		auto full_ids = duckdb::FlatVector::GetData<duckdb::string_t>(full_chunk.data[0]);
+		auto entries = duckdb::FlatVector::GetData<duckdb::list_entry_t>(values);
+		full_ids[full_rows] = duckdb::StringVector::AddString(full_chunk.data[0], frag_id);
+		entries[full_rows].offset = offset;
+		entries[full_rows].length = count;
+		full_rows++;
+	}
+
+	void FlushFull() {
+		if (full_rows == 0) {
+			return;
+		}
+		full_chunk.SetCardinality(full_rows);
+		full_appender->AppendDataChunk(full_chunk);
+		full_chunk.Reset();
+		full_rows = 0;
+	}
+
+	void FlushEmbeddings() {
+		if (embd_rows == 0) {
+			return;
+		}
+		embd_chunk.SetCardinality(embd_rows);
+		embd_appender->AppendDataChunk(embd_chunk);
+		embd_chunk.Reset();
+		embd_rows = 0;
+	}
+
+	void FlushMappings() {
+		if (map_rows == 0) {
+			return;
+		}
+		map_chunk.SetCardinality(map_rows);
+		map_appender->AppendDataChunk(map_chunk);
+		map_chunk.Reset();
+		map_rows = 0;
+	}
+
+	// quantizes the given fragments once their rows are appended
+	void AppendCodes(const std::vector<std::string>& frag_ids) {
+		if (kb.storage == 0 || frag_ids.empty()) {
+			return;
+		}
+		if (codes_stmt == nullptr) {
+			codes_stmt = conn.Prepare(_unnu_ragl_codes_insert(kb.storage, "frag_id IN (SELECT unnest($1))"));
+		}
+		duckdb::vector<duckdb::Value> _ids;
+		std::transform(frag_ids.cbegin(), frag_ids.cend(), std::back_inserter(_ids), [](const std::string& id) { return duckdb::Value(id); });
+		auto result = codes_stmt->HasError() ? nullptr : codes_stmt->Execute(duckdb::Value::LIST(duckdb::LogicalType::VARCHAR, _ids));
+		if (result == nullptr || result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: RaglDocumentWriter codes %s\n", result != nullptr ? result->GetError().c_str() : codes_stmt->GetError().c_str());
+#endif
+			failed = true;
+		}
+	}
+
+	bool CommitLocked() {
+		documents = 0;
+		if (!active) {
+			return true;
+		}
+		active = false;
+		try {
+			if (!failed) {
+				FlushEmbeddings();
+				FlushMappings();
+				FlushFull();
+				embd_appender->Close();
+				map_appender->Close();
+				full_appender->Close();
+				AppendCodes(claimed);
+			}
+		}
+		catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: RaglDocumentWriter flushing appenders\n");
+#endif
+			failed = true;
+		}
+		embd_appender = nullptr;
+		map_appender = nullptr;
+		full_appender = nullptr;
+		embd_chunk.Reset();
+		map_chunk.Reset();
+		full_chunk.Reset();
+		embd_rows = 0;
+		map_rows = 0;
+		full_rows = 0;
+
+		duckdb::unique_ptr<duckdb::MaterializedQueryResult> result;
+		{
+			std::lock_guard<std::mutex> exact_lock(kb.exact_write_mutex);
+			result = conn.Query(failed ? "ROLLBACK;" : "COMMIT;");
+			if (!failed && !result->HasError()) {
+				_unnu_ragl_exact_append(kb, claimed, claimed_text, claimed_vectors, dims);
+			}
+		}
+		const bool rolled_back = failed || result->HasError();
+#if defined(_DEBUG) || defined(DEBUG)
+		if (rolled_back) {
+			fprintf(stderr, "error: RaglDocumentWriter commit %s\n", failed ? "rolled back" : result->GetError().c_str());
+		}
+#endif
+		if (rolled_back) {
+			RestoreAwaited();
+		}
+		_unnu_ragl_release_fragments(kb, claimed);
+		claimed.clear();
+		claimed_text.clear();
+		claimed_vectors.clear();
+		const bool committed = changed;
+		changed = false;
+		if (rolled_back) {
+			failed = false;
+			return false;
+		}
+		// only now are the rows visible to queries, the BM25 rebuild and the
+		// query results cached by generation
+		if (committed) {
+			_unnu_ragl_kb_changed(kb);
+		}
+		return true;
+	}
+
+	// Documents of other transactions mapped fragments this rolled-back one
+	// owned; their doxmap rows would dangle, so the bare fragment rows are
+	// inserted again in a transaction of their own. If even that fails, the
+	// committed mappings to them are removed.
+	void RestoreAwaited() {
+		const std::vector<size_t> rows = _unnu_ragl_awaited_fragments(kb, claimed);
+		if (rows.empty()) {
+			return;
+		}
+		std::vector<std::string> frag_ids;
+		frag_ids.reserve(rows.size());
+		for (size_t row : rows) {
+			frag_ids.push_back(claimed[row]);
+		}
+		bool restored = false;
+		try {
+			auto result = conn.Query("BEGIN TRANSACTION;");
+			if (!result->HasError()) {
+				embd_appender = std::make_unique<duckdb::Appender>(conn, "embeddings");
+				for (size_t row : rows) {
+					if (embd_rows == STANDARD_CHUNK_ROWS) {
+						FlushEmbeddings();
+					}
+					auto embd_ids = duckdb::FlatVector::GetData<duckdb::string_t>(embd_chunk.data[0]);
+					auto embd_text = duckdb::FlatVector::GetData<duckdb::string_t>(embd_chunk.data[1]);
+					auto embd_values = duckdb::FlatVector::GetData<float>(duckdb::ArrayVector::GetEntry(embd_chunk.data[2]));
+					embd_ids[embd_rows] = duckdb::StringVector::AddString(embd_chunk.data[0], claimed[row]);
+					embd_text[embd_rows] = duckdb::StringVector::AddString(embd_chunk.data[1], claimed_text[row]);
+					std::memcpy(embd_values + embd_rows * dims, claimed_vectors.data() + row * dims, dims * sizeof(float));
+					embd_rows++;
+				}
+				FlushEmbeddings();
+				embd_appender->Close();
+				embd_appender = nullptr;
+				failed = false;
+				AppendCodes(frag_ids);
+				std::lock_guard<std::mutex> exact_lock(kb.exact_write_mutex);
+				result = conn.Query(failed ? "ROLLBACK;" : "COMMIT;");
+				restored = !failed && !result->HasError();
+				if (restored) {
+					std::vector<std::string> texts;
+					std::vector<float> vectors;
+					texts.reserve(rows.size());
+					vectors.reserve(rows.size() * dims);
+					for (size_t row : rows) {
+						texts.push_back(claimed_text[row]);
+						vectors.insert(vectors.end(), claimed_vectors.cbegin() + row * dims, claimed_vectors.cbegin() + (row + 1) * dims);
+					}
+					_unnu_ragl_exact_append(kb, frag_ids, texts, vectors, dims);
+				}
+			}
+		}
+		catch (...) {
+			conn.Query("ROLLBACK;");
+		}
+		embd_appender = nullptr;
+		embd_chunk.Reset();
+		embd_rows = 0;
+
+		if (!restored) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: RaglDocumentWriter restoring %zu awaited fragments\n", rows.size());
+#endif
+			duckdb::vector<duckdb::Value> _ids;
+			std::transform(frag_ids.cbegin(), frag_ids.cend(), std::back_inserter(_ids), [](const std::string& id) { return duckdb::Value(id); });
+			auto stmt = conn.Prepare("DELETE FROM doxmap WHERE frag_id IN (SELECT unnest($1)) AND frag_id NOT IN (SELECT frag_id FROM embeddings);");
+			if (!stmt->HasError()) {
+				stmt->Execute(duckdb::Value::LIST(duckdb::LogicalType::VARCHAR, _ids));
+			}
+		}
+		_unnu_ragl_kb_changed(kb);
+	}
+
+	std::mutex mutex;
+	ragl_kb_t& kb;
+	duckdb::Connection conn;
+	idx_t dims;
+	std::unique_ptr<duckdb::Appender> embd_appender;
+	std::unique_ptr<duckdb::Appender> map_appender;
+	std::unique_ptr<duckdb::Appender> full_appender;
+	std::unique_ptr<duckdb::PreparedStatement> codes_stmt;
+	duckdb::DataChunk embd_chunk;
+	duckdb::DataChunk map_chunk;
+	duckdb::DataChunk full_chunk;
+	idx_t embd_rows = 0;
+	idx_t map_rows = 0;
+	idx_t full_rows = 0;
+	// fragment ids this transaction inserts, released from the pending set on
+	// commit, with their rows in case a rollback has to restore them
+	std::vector<std::string> claimed;
+	std::vector<std::string> claimed_text;
+	std::vector<float> claimed_vectors;
+	int32_t documents = 0;
+	bool active = false;
+	bool failed = false;
+	// rows were appended in this transaction
+	bool changed = false;
+};
+
+// Writer shared by all documents while bulk import (commit every N > 1
+// documents) is enabled; otherwise every document gets its own writer.
+static std::shared_ptr<RaglDocumentWriter> _unnu_ragl_acquire_writer(ragl_kb_t& kb) {
+	if (UNNU_RAGL_BULK_COMMIT_DOCUMENTS > 1) {
+		std::lock_guard<std::mutex> lock(kb.bulk_writer_mutex);
+		if (kb.bulk_writer == nullptr) {
+			kb.bulk_writer = std::make_shared<RaglDocumentWriter>(kb, UNNU_RAGL_EMBEDDING_SIZE);
+		}
+		return kb.bulk_writer;
+	}
+	return std::make_shared<RaglDocumentWriter>(kb, UNNU_RAGL_EMBEDDING_SIZE);
+}
+
+static void _unnu_ragl_release_bulk_writer(ragl_kb_t& kb) {
+	std::shared_ptr<RaglDocumentWriter> writer;
+	{
+		std::lock_guard<std::mutex> lock(kb.bulk_writer_mutex);
+		writer.swap(kb.bulk_writer);
+	}
+	if (writer != nullptr) {
+		writer->Commit();
+	}
+}
+
+static void _unnu_ragl_notify_embedding(const std::string& frag_id, const std::string& text, const float* embeddings, size_t count) {
+	if (embedding_cb != nullptr) {
+		int len = text.length();
+		if (len > 0) {
+			UnnuRagEmbdVec_t* response = _unnu_ragl_new_embdvec(UnnuRaglResultType::UNNU_RAGL_EMBEDDING, frag_id, text, embeddings, count);
+			if (response != nullptr) {
+				embedding_cb(response);
+			}
+		}
+	}
+}
+
+// Bounded FIFO between two pipeline stages. Push blocks while the queue is
+// full, Pop blocks while it is empty; after Close, Push fails and Pop drains
+// what is left before failing.
+template <typename T>
+class RaglBoundedQueue {
+public:
+	bool Push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed) {
+			return false;
+		}
+		items.push_back(std::move(item));
+		not_empty.notify_one();
+		return true;
+	}
+
+	bool Pop(T& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty()) {
+			return false;
+		}
+		item = std::move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void Open(size_t size) {
+		std::lock_guard<std::mutex> lock(mutex);
+		capacity = std::max<size_t>(size, 1);
+		closed = false;
+	}
+
+	void Close() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		not_full.notify_all();
+		not_empty.notify_all();
+	}
+
+	size_t Size() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return items.size();
+	}
+
+	size_t Capacity() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return capacity;
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable not_full;
+	std::condition_variable not_empty;
+	std::deque<T> items;
+	size_t capacity = 1;
+	bool closed = true;
+};
+
+typedef struct embedding_context {
+	ragl_kb_ptr kb;
+	std::string document_id;
+	std::string corpus;
+	// chunks that still need the encoder, with their content-addressed ids
+	std::vector<std::string> chunks;
+	std::vector<std::string> frag_ids;
+	// fragments another pending transaction inserts; only mapped, never encoded
+	std::vector<std::string> mapped;
+	std::vector<std::vector<size_t>> ids;
+	std::vector<std::vector<size_t>> batches;
+	// tokenizes and encodes every batch of the document
+	ragl_model_ptr model;
+	// address space of its fragments, see _unnu_ragl_fragment_space
+	boost::uuids::uuid space;
+	std::shared_ptr<RaglDocumentWriter> writer;
+	// batches still to pass the encode and write stages
+	std::atomic<size_t> encode_remaining{ 0 };
+	std::atomic<size_t> write_remaining{ 0 };
+} embedding_context_t;
+
+typedef std::shared_ptr<embedding_context_t> embedding_context_ptr;
+
+// Ingestion pipeline: prepare (chunk, dedupe, tokenize, plan batches) ->
+// encode (UNNU_RAGL_INGEST_THREADS workers) -> write (one thread appending to
+// the document writers). Stages overlap across documents and the bounded
+// queues between them apply back pressure up to unnu_rag_lite_embed.
+typedef struct ragl_text_job {
+	ragl_kb_ptr kb;
+	std::string text;
+	std::string corpus;
+} ragl_text_job_t;
+
+typedef struct ragl_encode_job {
+	embedding_context_ptr context;
+	size_t batch = 0;
+} ragl_encode_job_t;
+
+// batch == SIZE_MAX only closes the document (nothing left to encode)
+typedef struct ragl_write_job {
+	embedding_context_ptr context;
+	size_t batch = 0;
+	size_t hidden = 0;
+	std::vector<float> pooled;
+	// untruncated [rows x full_hidden] vectors, empty unless kept for rescoring
+	size_t full_hidden = 0;
+	std::vector<float> full;
+} ragl_write_job_t;
+
+typedef struct ragl_stage_stats {
+	std::atomic<int64_t> processed{ 0 };
+	std::atomic<int64_t> documents{ 0 };
+	std::atomic<int64_t> busy_us{ 0 };
+} ragl_stage_stats_t;
+
+static UnnuRaglPipelineCallback pipeline_cb = nullptr;
+
+static RaglBoundedQueue<ragl_text_job_t> _text_queue;
+static RaglBoundedQueue<ragl_encode_job_t> _encode_queue;
+static RaglBoundedQueue<ragl_write_job_t> _write_queue;
+static ragl_stage_stats_t _stage_stats[3];
+
+static std::mutex _pipeline_mutex;
+static bool _pipeline_running = false;
+static std::thread _prepare_thread;
+static std::vector<std::thread> _encode_threads;
+static std::thread _write_thread;
+
+static std::mutex _ingest_throttle_mutex;
+static std::condition_variable _ingest_throttle_cv;
+static int32_t _ingest_inflight_batches = 0;
+static bool _ingest_draining = false;
+// knowledge bases waiting in _unnu_ragl_drain_ingest
+static int32_t _ingest_closing = 0;
+
+// Blocks an encode worker while ingestion is paused or the throttled number
+// of batches is already in flight. Queries never pass through here.
+static void _unnu_ragl_acquire_ingest_slot() {
+	std::unique_lock<std::mutex> lock(_ingest_throttle_mutex);
+	_ingest_throttle_cv.wait(lock, [] {
+		return _ingest_draining || _ingest_closing > 0 || UNNU_RAGL_INGEST_THROTTLE < 0 || _ingest_inflight_batches < UNNU_RAGL_INGEST_THROTTLE;
+	});
+	_ingest_inflight_batches++;
+}
+
+static void _unnu_ragl_release_ingest_slot() {
+	{
+		std::lock_guard<std::mutex> lock(_ingest_throttle_mutex);
+		_ingest_inflight_batches--;
+	}
+	_ingest_throttle_cv.notify_all();
+}
+
+static void _unnu_ragl_report_stage(UnnuRaglStage_t stage, size_t queued, size_t capacity, int64_t busy_us, int64_t documents) {
+	ragl_stage_stats_t& stats = _stage_stats[stage];
+	stats.processed++;
+	stats.documents += documents;
+	stats.busy_us += busy_us;
+	if (pipeline_cb != nullptr) {
+		UnnuRaglStageMetrics_t* metrics = (UnnuRaglStageMetrics_t*)malloc(sizeof(UnnuRaglStageMetrics_t));
+		metrics->stage = stage;
+		metrics->processed = stats.processed;
+		metrics->documents = stats.documents;
+		metrics->queued = static_cast<int32_t>(queued);
+		metrics->capacity = static_cast<int32_t>(capacity);
+		metrics->busy_ms = stats.busy_us / 1000.0;
+		pipeline_cb(metrics);
+	}
+}
+
+static int64_t _unnu_ragl_elapsed_us(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Counts a document into the ingestion of a knowledge base; false once it is
+// closing.
+static bool _unnu_ragl_begin_ingest(ragl_kb_t& kb) {
+	std::lock_guard<std::mutex> lock(kb.ingest_mutex);
+	if (kb.closing) {
+		return false;
+	}
+	kb.ingest_inflight++;
+	return true;
+}
+
+static void _unnu_ragl_end_ingest(ragl_kb_t& kb) {
+	{
+		std::lock_guard<std::mutex> lock(kb.ingest_mutex);
+		kb.ingest_inflight--;
+	}
+	kb.ingest_cv.notify_all();
+}
+
+// Waits until every document queued for the knowledge base is written. The
+// shared pipeline keeps serving the other knowledge bases; a paused ingestion
+// runs meanwhile, since the documents ahead in the queues have to pass first.
+static void _unnu_ragl_drain_ingest(ragl_kb_t& kb) {
+	std::unique_lock<std::mutex> lock(kb.ingest_mutex);
+	kb.closing = true;
+	if (kb.ingest_inflight == 0) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> throttle(_ingest_throttle_mutex);
+		_ingest_closing++;
+	}
+	_ingest_throttle_cv.notify_all();
+	kb.ingest_cv.wait(lock, [&kb] { return kb.ingest_inflight == 0; });
+	{
+		std::lock_guard<std::mutex> throttle(_ingest_throttle_mutex);
+		_ingest_closing--;
+	}
+}
+
+static void _unnu_ragl_finish_document(const embedding_context_ptr& context) {
+	if (context->writer != nullptr) {
+		context->writer->EndDocument(UNNU_RAGL_BULK_COMMIT_DOCUMENTS);
+		context->writer = nullptr;
+	}
+
+	if (embedding_cb != nullptr) {
+		UnnuRagEmbdVec_t* vec = _unnu_ragl_new_embdvec(UnnuRaglResultType::UNNU_RAGL_FINISH, context->document_id, "", nullptr, 0);
+		if (vec != nullptr) {
+			embedding_cb(vec);
+		}
+	}
+	_unnu_ragl_end_ingest(*context->kb);
+}
+
+// Encode stage: runs one batch through the encoder and pools it. A failed
+// batch is still forwarded (empty) so the document can finish.
+static void _unnu_ragl_encode_stage() {
+	ragl_encode_job_t job;
+	while (_encode_queue.Pop(job)) {
+		auto start = std::chrono::steady_clock::now();
+		embedding_context_t* context = job.context.get();
+		ragl_write_job_t out{ job.context, job.batch, 0, {}, 0, {} };
+		try {
+			const std::vector<size_t>& batch = context->batches[job.batch];
+			std::vector<size_t> lengths(batch.size());
+			std::transform(batch.cbegin(), batch.cend(), lengths.begin(),
+				[context](size_t idx) { return context->ids[idx].size(); });
+
+			std::vector<std::vector<size_t>> inputs;
+			inputs.reserve(batch.size());
+			for (size_t idx : batch) {
+				inputs.push_back(context->ids[idx]);
+			}
+
+			// the slot gate bounds batches queued on the encoder, the ingest
+			// throttle yields it to interactive work
+			ctranslate2::EncoderForwardOutput output;
+			_unnu_ragl_acquire_ingest_slot();
+			try {
+				auto result = _unnu_ragl_submit_batch(*context->model, inputs);
+				output = _unnu_ragl_await_batch(result);
+			}
+			catch (...) {
+				_unnu_ragl_release_ingest_slot();
+				throw;
+			}
+			_unnu_ragl_release_ingest_slot();
+
+			// one contiguous [rows x hidden] buffer for the whole batch
+			out.hidden = output.last_hidden_state.dim(2);
+			out.pooled.resize(batch.size() * out.hidden);
+			std::vector<float*> dest(batch.size());
+			for (size_t b = 0; b < batch.size(); b++) {
+				dest[b] = out.pooled.data() + b * out.hidden;
+			}
+			_unnu_ragl_pool_batch(output.last_hidden_state, lengths, dest.data());
+
+			// Matryoshka truncation to the stored width, in place row by row
+			const size_t dims = UNNU_RAGL_EMBEDDING_SIZE;
+			if (out.hidden > dims) {
+				if (UNNU_RAGL_KEEP_FULL_VECTORS) {
+					out.full = out.pooled;
+					out.full_hidden = out.hidden;
+				}
+				for (size_t b = 0; b < batch.size(); b++) {
+					_unnu_ragl_truncate_into(out.pooled.data() + b * out.hidden, out.pooled.data() + b * dims, dims);
+				}
+				out.pooled.resize(batch.size() * dims);
+				out.hidden = dims;
+			}
+		}
+		catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: _unnu_ragl_encode_stage %s\n", context->document_id.c_str());
+#endif
+			out.pooled.clear();
+			out.full.clear();
+		}
+		const int64_t documents = (--context->encode_remaining == 0) ? 1 : 0;
+		_write_queue.Push(std::move(out));
+		_unnu_ragl_report_stage(UNNU_RAGL_STAGE_ENCODE, _encode_queue.Size(), _encode_queue.Capacity(), _unnu_ragl_elapsed_us(start), documents);
+	}
+}
+
+// Write stage: the only thread appending encoded fragments, so DuckDB I/O
+// runs while the encode workers already work on the next batches.
+static void _unnu_ragl_write_stage() {
+	ragl_write_job_t job;
+	while (_write_queue.Pop(job)) {
+		auto start = std::chrono::steady_clock::now();
+		embedding_context_t* context = job.context.get();
+		int64_t documents = 0;
+		if (job.batch != SIZE_MAX && !job.pooled.empty()) {
+			const std::vector<size_t>& batch = context->batches[job.batch];
+			for (size_t b = 0; b < batch.size(); b++) {
+				const size_t idx = batch[b];
+				const float* embedding = job.pooled.data() + b * job.hidden;
+				const float* full = job.full.empty() ? nullptr : job.full.data() + b * job.full_hidden;
+				const std::string& frag_id = context->frag_ids[idx];
+				const std::string& text = context->chunks[idx];
+				if (context->writer->Append(context->document_id, context->corpus, frag_id, text, embedding, job.hidden, full, job.full_hidden)) {
+					_unnu_ragl_notify_embedding(frag_id, text, embedding, job.hidden);
+				}
+			}
+		}
+		if (job.batch == SIZE_MAX || --context->write_remaining == 0) {
+			_unnu_ragl_finish_document(job.context);
+			documents = 1;
+		}
+		job.context = nullptr;
+		_unnu_ragl_report_stage(UNNU_RAGL_STAGE_WRITE, _write_queue.Size(), _write_queue.Capacity(), _unnu_ragl_elapsed_us(start), documents);
+	}
+}
+
+// Maps chunks whose fragment already exists, or is pending in another
+// transaction, to the document and reports the stored vectors; leaves only
+// novel chunks in the context for the encoder.
+static void _unnu_ragl_reuse_fragments(embedding_context_t& context) {
+	std::vector<std::string> chunks;
+	std::vector<std::string> frag_ids;
+	// token ids are only present when the chunker produced them
+	std::vector<std::vector<size_t>> ids;
+	const bool has_ids = context.ids.size() == context.chunks.size();
+	std::unordered_set<std::string> seen;
+	for (size_t k = 0; k < context.chunks.size(); k++) {
+		std::string frag_id = _unnu_ragl_fragment_id(context.space, context.chunks[k]);
+		// doxmap is keyed by (document_id, frag_id), repeated text maps once
+		if (seen.insert(frag_id).second) {
+			frag_ids.push_back(std::move(frag_id));
+			chunks.push_back(std::move(context.chunks[k]));
+			if (has_ids) {
+				ids.push_back(std::move(context.ids[k]));
+			}
+		}
+	}
+
+	std::unordered_set<std::string> stored;
+	try {
+		RaglConnectionLease lease(*context.kb);
+		duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_LOOKUP_FRAGMENTS);
+		duckdb::unique_ptr<duckdb::QueryResult> result;
+		if (statement != nullptr) {
+			duckdb::vector<duckdb::Value> _ids;
+			std::transform(frag_ids.cbegin(), frag_ids.cend(), std::back_inserter(_ids), [](const std::string& id) { return duckdb::Value(id); });
+			result = statement->Execute(duckdb::Value::LIST(duckdb::LogicalType::VARCHAR, _ids));
+		}
+		if (result == nullptr || result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: looking up fragments %s\n", result != nullptr ? result->GetError().c_str() : "");
+#endif
+		}
+		else {
+			while (true) {
+				auto chunk = result->Fetch();
+				if (!chunk || chunk->size() == 0) {
+					break;
+				}
+				chunk->Flatten();
+				// the width of the stored column, not the current setting
+				const size_t dims = duckdb::ArrayType::GetSize(chunk->data[2].GetType());
+				auto ids = duckdb::FlatVector::GetData<duckdb::string_t>(chunk->data[0]);
+				auto texts = duckdb::FlatVector::GetData<duckdb::string_t>(chunk->data[1]);
+				auto values = duckdb::FlatVector::GetData<float>(duckdb::ArrayVector::GetEntry(chunk->data[2]));
+				const duckdb::ValidityMask& text_valid = duckdb::FlatVector::Validity(chunk->data[1]);
+				const duckdb::ValidityMask& embedding_valid = duckdb::FlatVector::Validity(chunk->data[2]);
+				for (idx_t i = 0; i < chunk->size(); i++) {
+					std::string frag_id = ids[i].GetString();
+					// the row exists either way, only a complete one is reported
+					if (context.writer->AppendMapping(context.document_id, context.corpus, frag_id)
+						&& text_valid.RowIsValid(i) && embedding_valid.RowIsValid(i)) {
+						_unnu_ragl_notify_embedding(frag_id, texts[i].GetString(), values + i * dims, dims);
+					}
+					stored.insert(std::move(frag_id));
+				}
+			}
+		}
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: _unnu_ragl_reuse_fragments %s\n", context.document_id.c_str());
+#endif
+	}
+
+	context.chunks.clear();
+	context.frag_ids.clear();
+	context.mapped.clear();
+	context.ids.clear();
+	for (size_t k = 0; k < frag_ids.size(); k++) {
+		if (stored.count(frag_ids[k]) > 0) {
+			continue;
+		}
+		if (!_unnu_ragl_claim_fragment(*context.kb, frag_ids[k], context.writer.get())) {
+			context.mapped.push_back(std::move(frag_ids[k]));
+			continue;
+		}
+		context.frag_ids.push_back(std::move(frag_ids[k]));
+		context.chunks.push_back(std::move(chunks[k]));
+		if (has_ids) {
+			context.ids.push_back(std::move(ids[k]));
+		}
+	}
+	// the claiming transaction provides the row (restored if it rolls back)
+	for (const std::string& frag_id : context.mapped) {
+		context.writer->AppendMapping(context.document_id, context.corpus, frag_id);
+	}
+}
+
+// Prepare stage: chunking, deduplication and tokenization of one document,
+// then its batches are handed to the encode workers.
+static void _unnu_ragl_prepare_stage() {
+	ragl_text_job_t job;
+	boost::uuids::random_generator gen;
+	while (_text_queue.Pop(job)) {
+		auto start = std::chrono::steady_clock::now();
+		embedding_context_ptr context = std::make_shared<embedding_context_t>();
+		context->kb = std::move(job.kb);
+		context->corpus = std::move(job.corpus);
+		context->document_id = boost::uuids::to_string(gen());
+		try {
+			context->model = _unnu_ragl_model();
+			if (context->model == nullptr) {
+				throw std::runtime_error("no embedding model");
+			}
+			context->space = _unnu_ragl_fragment_space(*context->model);
+			if (UNNU_RAGL_CHUNKING_TOKENS > 0) {
+				context->chunks = _unnu_ragl_split_text_into_token_chunks(*context->model, job.text, UNNU_RAGL_CHUNKING_TOKENS, UNNU_RAGL_CHUNKING_OVERLAP_TOKENS, context->ids);
+			}
+			else {
+				context->chunks = _unnu_ragl_split_text_into_chunks(job.text, UNNU_RAGL_CHUNKING_SIZE, true);
+			}
+
+			if (context->chunks.size() > 0) {
+				context->writer = _unnu_ragl_acquire_writer(*context->kb);
+				_unnu_ragl_reuse_fragments(*context);
+			}
+
+			if (context->chunks.size() > 0) {
+				if (context->ids.empty()) {
+					context->ids = _unnu_ragl_tokenize_batch(*context->model, context->chunks);
 				}
-				else if (first_chunk) {
-					currentChunk = sentence;
-					first_chunk = false;
+				context->batches = _unnu_ragl_plan_batches(context->ids, UNNU_RAGL_MAX_BATCH_TOKENS);
+			}
+		}
+		catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: _unnu_ragl_prepare_stage %s\n", context->document_id.c_str());
+#endif
+			context->batches.clear();
+		}
+		job.text.clear();
+
+		const size_t batches = context->batches.size();
+		context->encode_remaining = batches;
+		context->write_remaining = batches;
+		const int64_t busy_us = _unnu_ragl_elapsed_us(start);
+		if (batches == 0) {
+			_write_queue.Push({ context, SIZE_MAX, 0, {}, 0, {} });
+		}
+		for (size_t i = 0; i < batches; i++) {
+			_encode_queue.Push({ context, i });
+		}
+		_unnu_ragl_report_stage(UNNU_RAGL_STAGE_PREPARE, _text_queue.Size(), _text_queue.Capacity(), busy_us, 1);
+	}
+}
+
+static void _unnu_ragl_start_pipeline() {
+	std::lock_guard<std::mutex> lock(_pipeline_mutex);
+	if (_pipeline_running) {
+		return;
+	}
+	size_t workers = 1;
+	if (UNNU_RAGL_INGEST_THREADS > 0) {
+		workers = UNNU_RAGL_INGEST_THREADS;
+	}
+	else if (cpuinfo_initialize()) {
+		workers = std::max<size_t>(cpuinfo_get_cores_count() / 4, 1);
+	}
+	const size_t depth = std::max(UNNU_RAGL_PIPELINE_DEPTH, 1);
+	{
+		std::lock_guard<std::mutex> throttle(_ingest_throttle_mutex);
+		_ingest_draining = false;
+	}
+	_text_queue.Open(depth);
+	_encode_queue.Open(depth * workers);
+	_write_queue.Open(depth * workers);
+	_prepare_thread = std::thread(_unnu_ragl_prepare_stage);
+	for (size_t w = 0; w < workers; w++) {
+		_encode_threads.emplace_back(_unnu_ragl_encode_stage);
+	}
+	_write_thread = std::thread(_unnu_ragl_write_stage);
+	_pipeline_running = true;
+}
+
+// Drains every queued document stage by stage, then joins the stage threads.
+static void _unnu_ragl_stop_pipeline() {
+	std::lock_guard<std::mutex> lock(_pipeline_mutex);
+	if (!_pipeline_running) {
+		return;
+	}
+	{
+		// a paused ingestion would never drain
+		std::lock_guard<std::mutex> throttle(_ingest_throttle_mutex);
+		_ingest_draining = true;
+	}
+	_ingest_throttle_cv.notify_all();
+
+	_text_queue.Close();
+	_prepare_thread.join();
+	_encode_queue.Close();
+	for (std::thread& worker : _encode_threads) {
+		worker.join();
+	}
+	_encode_threads.clear();
+	_write_queue.Close();
+	_write_thread.join();
+	_pipeline_running = false;
+}
+
+// Re-embedding after a model change: a worker per knowledge base re-encodes
+// the stored fragment texts in batches into the reindex table, one transaction
+// per batch, so a restart under the same model resumes where it stopped. The
+// new vectors and content addresses replace embeddings and doxmap in a single
+// transaction once every fragment is staged; until then queries read the old
+// tables.
+static void _unnu_ragl_record_model(duckdb::Connection& conn, const char* role, const std::string& model_id) {
+	auto statement = conn.Prepare("INSERT OR REPLACE INTO model_info VALUES ($1, $2, $3, $4, current_timestamp);");
+	auto result = statement->HasError() ? nullptr : statement->Execute(std::string(role), model_id, UNNU_RAGL_EMBEDDING_SIZE, UNNU_RAGL_POOLING_TYPE);
+	if (result == nullptr || result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: recording %s model %s\n", role, result != nullptr ? result->GetError().c_str() : statement->GetError().c_str());
+#endif
+	}
+}
+
+static bool _unnu_ragl_model_matches(duckdb::Connection& conn, const char* role, const std::string& model_id, bool* recorded) {
+	auto statement = conn.Prepare("SELECT model_id, dims, pooling FROM model_info WHERE role = $1;");
+	auto result = statement->HasError() ? nullptr : statement->Execute(std::string(role));
+	*recorded = false;
+	if (result == nullptr || result->HasError()) {
+		return false;
+	}
+	auto chunk = result->Fetch();
+	if (!chunk || chunk->size() == 0) {
+		return false;
+	}
+	*recorded = true;
+	return chunk->GetValue(0, 0).ToString() == model_id
+		&& chunk->GetValue(1, 0).GetValue<int32_t>() == UNNU_RAGL_EMBEDDING_SIZE
+		&& chunk->GetValue(2, 0).GetValue<int32_t>() == UNNU_RAGL_POOLING_TYPE;
+}
+
+// Blocks like _unnu_ragl_acquire_ingest_slot, so re-embedding yields to a
+// throttled or paused ingestion; false once the worker is stopped.
+static bool _unnu_ragl_acquire_reindex_slot(ragl_kb_t& kb) {
+	std::unique_lock<std::mutex> lock(_ingest_throttle_mutex);
+	_ingest_throttle_cv.wait(lock, [&kb] {
+		return !kb.reindex_running || _ingest_draining || UNNU_RAGL_INGEST_THROTTLE < 0 || _ingest_inflight_batches < UNNU_RAGL_INGEST_THROTTLE;
+	});
+	if (!kb.reindex_running) {
+		return false;
+	}
+	_ingest_inflight_batches++;
+	return true;
+}
+
+// Stages up to UNNU_RAGL_REINDEX_BATCH fragments; complete when none is left.
+// permanent when a retry cannot succeed with the loaded model.
+static bool _unnu_ragl_reindex_step(ragl_kb_t& kb, bool* complete, bool* permanent) {
+	std::vector<std::string> frag_ids;
+	std::vector<std::string> texts;
+	{
+		RaglConnectionLease lease(kb);
+		duckdb::Connection& conn = lease.Conn();
+		auto progress = conn.Query("SELECT (SELECT count(*) FROM reindex WHERE frag_id IN (SELECT frag_id FROM embeddings)), (SELECT count(*) FROM embeddings);");
+		if (!progress->HasError() && progress->RowCount() > 0) {
+			std::lock_guard<std::mutex> lock(kb.reindex_mutex);
+			kb.reindexed = progress->GetValue(0, 0).GetValue<int64_t>();
+			kb.reindex_total = progress->GetValue(1, 0).GetValue<int64_t>();
+		}
+
+		auto result = conn.Query("SELECT frag_id, text FROM embeddings WHERE frag_id NOT IN (SELECT frag_id FROM reindex) LIMIT " + std::to_string(std::max(UNNU_RAGL_REINDEX_BATCH, 1)) + ";");
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: reindex reading fragments %s\n", result->GetError().c_str());
+#endif
+			return false;
+		}
+		for (idx_t i = 0, n = result->RowCount(); i < n; i++) {
+			frag_ids.push_back(result->GetValue(0, i).GetValue<std::string>());
+			texts.push_back(result->GetValue(1, i).GetValue<std::string>());
+		}
+	}
+	*complete = frag_ids.empty();
+	if (*complete) {
+		return true;
+	}
+
+	const size_t dims = UNNU_RAGL_EMBEDDING_SIZE;
+	std::vector<float> vectors(texts.size() * dims);
+	try {
+		const ragl_model_ptr model = _unnu_ragl_model();
+		if (model == nullptr) {
+			*permanent = true;
+			return false;
+		}
+		const std::vector<std::vector<size_t>> ids = _unnu_ragl_tokenize_batch(*model, texts);
+		const boost::uuids::uuid space = _unnu_ragl_fragment_space(*model);
+		for (const std::vector<size_t>& batch : _unnu_ragl_plan_batches(ids, UNNU_RAGL_MAX_BATCH_TOKENS)) {
+			std::vector<std::vector<size_t>> inputs;
+			std::vector<size_t> lengths;
+			for (size_t idx : batch) {
+				inputs.push_back(ids[idx]);
+				lengths.push_back(ids[idx].size());
+			}
+
+			if (!_unnu_ragl_acquire_reindex_slot(kb)) {
+				return false;
+			}
+			ctranslate2::EncoderForwardOutput output;
+			try {
+				auto result = _unnu_ragl_submit_batch(*model, inputs);
+				output = _unnu_ragl_await_batch(result);
+			}
+			catch (...) {
+				_unnu_ragl_release_ingest_slot();
+				throw;
+			}
+			_unnu_ragl_release_ingest_slot();
+
+			const size_t hidden = output.last_hidden_state.dim(2);
+			if (hidden < dims) {
+#if defined(_DEBUG) || defined(DEBUG)
+				fprintf(stderr, "error: reindex encoder has %zu dimensions, %zu stored\n", hidden, dims);
+#endif
+				*permanent = true;
+				return false;
+			}
+			std::vector<float> pooled(batch.size() * hidden);
+			std::vector<float*> dest(batch.size());
+			for (size_t b = 0; b < batch.size(); b++) {
+				dest[b] = pooled.data() + b * hidden;
+			}
+			_unnu_ragl_pool_batch(output.last_hidden_state, lengths, dest.data());
+			for (size_t b = 0; b < batch.size(); b++) {
+				_unnu_ragl_truncate_into(dest[b], vectors.data() + batch[b] * dims, dims);
+			}
+		}
+
+		// staged in a DataChunk like RaglDocumentWriter, the vectors are copied
+		// into the FLOAT[N] child instead of boxed Values
+		duckdb::DataChunk chunk;
+		chunk.Initialize(duckdb::Allocator::DefaultAllocator(),
+			{ duckdb::LogicalType::VARCHAR, duckdb::LogicalType::VARCHAR, duckdb::LogicalType::ARRAY(duckdb::LogicalType::FLOAT, dims) });
+		RaglConnectionLease lease(kb);
+		duckdb::Appender appender(lease.Conn(), "reindex");
+		for (size_t from = 0; from < frag_ids.size(); from += STANDARD_VECTOR_SIZE) {
+			const size_t rows = std::min<size_t>(frag_ids.size() - from, STANDARD_VECTOR_SIZE);
+			auto old_ids = duckdb::FlatVector::GetData<duckdb::string_t>(chunk.data[0]);
+			auto new_ids = duckdb::FlatVector::GetData<duckdb::string_t>(chunk.data[1]);
+			auto values = duckdb::FlatVector::GetData<float>(duckdb::ArrayVector::GetEntry(chunk.data[2]));
+			for (size_t r = 0; r < rows; r++) {
+				old_ids[r] = duckdb::StringVector::AddString(chunk.data[0], frag_ids[from + r]);
+				new_ids[r] = duckdb::StringVector::AddString(chunk.data[1], _unnu_ragl_fragment_id(space, texts[from + r]));
+			}
+			std::memcpy(values, vectors.data() + from * dims, rows * dims * sizeof(float));
+			chunk.SetCardinality(rows);
+			appender.AppendDataChunk(chunk);
+			chunk.Reset();
+		}
+		appender.Close();
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: reindex encoding %zu fragments\n", frag_ids.size());
+#endif
+		return false;
+	}
+	return true;
+}
+
+// Replaces the tables of the old embedding space in one transaction. Fragment
+// ids are content addresses within the model namespace, so doxmap is rekeyed
+// with the vectors; untruncated vectors, codes and persisted query embeddings
+// of the old model are dropped.
+static bool _unnu_ragl_reindex_swap(ragl_kb_t& kb) {
+	const ragl_model_ptr model = _unnu_ragl_model();
+	if (model == nullptr) {
+		return false;
+	}
+	_unnu_ragl_release_bulk_writer(kb);
+	const std::string dims = std::to_string(UNNU_RAGL_EMBEDDING_SIZE);
+	std::vector<std::string> queries;
+	queries.push_back("BEGIN TRANSACTION;");
+	queries.push_back("CREATE TABLE embeddings_swap (frag_id VARCHAR(64) UNIQUE NOT NULL, text VARCHAR, embedding FLOAT[" + dims + "]);");
+	queries.push_back("INSERT OR IGNORE INTO embeddings_swap SELECT reindex.new_frag_id, embeddings.text, reindex.embedding FROM embeddings INNER JOIN reindex ON embeddings.frag_id = reindex.frag_id;");
+	queries.push_back("CREATE TABLE doxmap_swap (document_id VARCHAR(64) NOT NULL, frag_id VARCHAR(64) NOT NULL, corpus VARCHAR, PRIMARY KEY (document_id, frag_id));");
+	queries.push_back("INSERT OR IGNORE INTO doxmap_swap SELECT doxmap.document_id, reindex.new_frag_id, doxmap.corpus FROM doxmap INNER JOIN reindex ON doxmap.frag_id = reindex.frag_id;");
+	queries.push_back("DROP INDEX IF EXISTS embeddings_hnsw_index;");
+	queries.push_back("DROP TABLE embeddings;");
+	queries.push_back("ALTER TABLE embeddings_swap RENAME TO embeddings;");
+	queries.push_back("DROP TABLE doxmap;");
+	queries.push_back("ALTER TABLE doxmap_swap RENAME TO doxmap;");
+	queries.push_back("DELETE FROM embeddings_full;");
+	queries.push_back("DROP TABLE IF EXISTS codes_int8;");
+	queries.push_back("DROP TABLE IF EXISTS codes_binary;");
+	queries.push_back("DROP TABLE IF EXISTS query_cache;");
+	queries.push_back("CREATE TABLE query_cache (query VARCHAR PRIMARY KEY, pooling INTEGER, embedding FLOAT[" + dims + "], used_at TIMESTAMP);");
+	queries.push_back("UPDATE doxinfo SET embedding_size = " + dims + ";");
+	queries.push_back("DROP TABLE reindex;");
+	queries.push_back("DELETE FROM model_info;");
+
+	RaglConnectionLease lease(kb);
+	duckdb::Connection& conn = lease.Conn();
+	for (const std::string& query : queries) {
+		auto result = conn.Query(query);
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: reindex swap %s\n", result->GetError().c_str());
+#endif
+			conn.Query("ROLLBACK;");
+			return false;
+		}
+	}
+	_unnu_ragl_record_model(conn, "active", model->id);
+	auto result = conn.Query("COMMIT;");
+	if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: reindex swap committing %s\n", result->GetError().c_str());
+#endif
+		return false;
+	}
+
+	_unnu_ragl_exact_reset(kb);
+	if (kb.storage != 0) {
+		_unnu_ragl_codes_setup(conn, kb.storage, UNNU_RAGL_EMBEDDING_SIZE);
+	}
+	else {
+		kb.hnsw_indexed = false;
+		_unnu_ragl_ensure_hnsw(kb, conn);
+	}
+	conn.Query("CHECKPOINT;");
+	return true;
+}
+
+// failed steps in a row before the worker gives up, about two minutes with
+// the backoff of _unnu_ragl_retry_delay
+static constexpr int32_t RAGL_REINDEX_MAX_FAILURES = 8;
+
+static void _unnu_ragl_reindex_worker(ragl_kb_t* kb) {
+	while (kb->reindex_running) {
+		bool complete = false;
+		bool permanent = false;
+		bool staged = _unnu_ragl_reindex_step(*kb, &complete, &permanent);
+		if (staged && complete && _unnu_ragl_reindex_swap(*kb)) {
+			{
+				std::lock_guard<std::mutex> lock(kb->reindex_mutex);
+				kb->model_stale = false;
+				kb->reindexed = kb->reindex_total;
+				kb->reindex_failures = 0;
+			}
+			kb->reindex_cv.notify_all();
+			_unnu_ragl_kb_changed(*kb);
+			_unnu_ragl_flush_fts(*kb);
+			break;
+		}
+		std::unique_lock<std::mutex> lock(kb->reindex_mutex);
+		if (!kb->reindex_running) {
+			break;
+		}
+		if (staged && !complete) {
+			kb->reindex_failures = 0;
+			continue;
+		}
+		// encoder or write conflict, try again later unless the model cannot
+		// produce the stored width
+		kb->reindex_failures++;
+		if (permanent || kb->reindex_failures >= RAGL_REINDEX_MAX_FAILURES) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: reindex gave up after %d failures\n", kb->reindex_failures);
+#endif
+			kb->reindex_failed = true;
+			break;
+		}
+		kb->reindex_cv.wait_for(lock, _unnu_ragl_retry_delay(kb->reindex_failures), [kb] { return !kb->reindex_running; });
+	}
+	kb->reindex_running = false;
+	kb->reindex_cv.notify_all();
+}
+
+static void _unnu_ragl_start_reindex(ragl_kb_t& kb) {
+	std::lock_guard<std::mutex> lock(kb.reindex_mutex);
+	if (kb.reindex_closed) {
+		return;
+	}
+	if (kb.reindex_thread.joinable()) {
+		if (kb.reindex_running) {
+			return;
+		}
+		kb.reindex_thread.join();
+	}
+	kb.reindex_running = true;
+	kb.reindex_thread = std::thread(_unnu_ragl_reindex_worker, &kb);
+}
+
+static void _unnu_ragl_stop_reindex(ragl_kb_t& kb) {
+	std::thread worker;
+	{
+		std::lock_guard<std::mutex> lock(kb.reindex_mutex);
+		kb.reindex_running = false;
+		worker.swap(kb.reindex_thread);
+	}
+	kb.reindex_cv.notify_all();
+	{
+		// wakes a worker waiting on the ingest throttle
+		std::lock_guard<std::mutex> lock(_ingest_throttle_mutex);
+	}
+	_ingest_throttle_cv.notify_all();
+	if (worker.joinable()) {
+		worker.join();
+	}
+}
+
+// Compares the model recorded in the knowledge base with the loaded encoder
+// settings. A database without a record adopts them; on a mismatch the stored
+// vectors are stale and the re-embedding starts, resuming staged vectors of
+// the same target.
+static void _unnu_ragl_check_model(ragl_kb_t& kb) {
+	const ragl_model_ptr model = _unnu_ragl_model();
+	if (model == nullptr) {
+		return;
+	}
+	_unnu_ragl_stop_reindex(kb);
+	bool stale = false;
+	try {
+		RaglConnectionLease lease(kb);
+		duckdb::Connection& conn = lease.Conn();
+		bool recorded = false;
+		bool current = _unnu_ragl_model_matches(conn, "active", model->id, &recorded);
+		if (!recorded) {
+			// databases from before the record: adopt the loaded model unless the
+			// stored width shows another one
+			auto width = conn.Query("SELECT len(embedding::FLOAT[]) FROM embeddings LIMIT 1;");
+			if (!width->HasError() && width->RowCount() > 0 && width->GetValue(0, 0).GetValue<int32_t>() != UNNU_RAGL_EMBEDDING_SIZE) {
+				auto statement = conn.Prepare("INSERT OR REPLACE INTO model_info VALUES ('active', '', $1, $2, current_timestamp);");
+				if (!statement->HasError()) {
+					statement->Execute(width->GetValue(0, 0).GetValue<int32_t>(), UNNU_RAGL_POOLING_TYPE);
 				}
-				else {
-					currentChunk.append(" ").append(sentence);
+			}
+			else {
+				_unnu_ragl_record_model(conn, "active", model->id);
+				current = true;
+			}
+		}
+		if (current) {
+			conn.Query("DROP TABLE IF EXISTS reindex;");
+			conn.Query("DELETE FROM model_info WHERE role = 'target';");
+		}
+		else {
+			stale = true;
+			if (!_unnu_ragl_model_matches(conn, "target", model->id, &recorded)) {
+				conn.Query("DROP TABLE IF EXISTS reindex;");
+				auto result = conn.Query("CREATE TABLE reindex (frag_id VARCHAR(64) UNIQUE NOT NULL, new_frag_id VARCHAR(64) NOT NULL, embedding FLOAT[" + std::to_string(UNNU_RAGL_EMBEDDING_SIZE) + "]);");
+				if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+					fprintf(stderr, "error: creating table reindex %s\n", result->GetError().c_str());
+#endif
 				}
+				_unnu_ragl_record_model(conn, "target", model->id);
+			}
+		}
+	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: _unnu_ragl_check_model\n");
+#endif
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(kb.reindex_mutex);
+		kb.model_stale = stale;
+		kb.reindex_failures = 0;
+		kb.reindex_failed = false;
+	}
+	kb.reindex_cv.notify_all();
+	if (stale) {
+		_unnu_ragl_start_reindex(kb);
+	}
+}
+
+// Ingestion into a knowledge base being re-embedded waits for the swap, its
+// tables still have the old width and address space. false when the
+// re-embedding gave up or the knowledge base is closing, the document is
+// refused then.
+static bool _unnu_ragl_await_model(ragl_kb_t& kb) {
+	std::unique_lock<std::mutex> lock(kb.reindex_mutex);
+	kb.reindex_cv.wait(lock, [&kb] { return !kb.model_stale || kb.reindex_failed || kb.reindex_closed; });
+	return !kb.model_stale && !kb.reindex_closed;
+}
+
+void unnu_rag_lite_kb_embed_corpus(int32_t handle, const char* text, const char* corpus) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (kb == nullptr) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: unnu_rag_lite_embed no knowledge base %d\n", handle);
+#endif
+		return;
+	}
+	if (!_unnu_ragl_begin_ingest(*kb)) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: unnu_rag_lite_embed knowledge base %d is closing\n", handle);
+#endif
+		return;
+	}
+	_unnu_ragl_start_pipeline();
+	std::string input(text);
+	std::string _corpus(corpus != nullptr ? corpus : "");
+	// the caller returns at once, a full text queue only blocks this thread
+	std::thread thr([](ragl_kb_ptr kb, std::string input, std::string corpus) {
+		if (!_unnu_ragl_await_model(*kb)) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: unnu_rag_lite_embed knowledge base has stale vectors\n");
+#endif
+			_unnu_ragl_end_ingest(*kb);
+		}
+		else if (!_text_queue.Push({ kb, std::move(input), std::move(corpus) })) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: unnu_rag_lite_embed ingestion pipeline is closed\n");
+#endif
+			_unnu_ragl_end_ingest(*kb);
+		}
+	}, std::move(kb), std::move(input), std::move(_corpus));
+	thr.detach();
+}
+
+void unnu_rag_lite_kb_embed(int32_t handle, const char* text) {
+	unnu_rag_lite_kb_embed_corpus(handle, text, nullptr);
+}
+
+void unnu_rag_lite_embed_corpus(const char* text, const char* corpus) {
+	unnu_rag_lite_kb_embed_corpus(_unnu_ragl_default_handle(), text, corpus);
+}
+
+void unnu_rag_lite_embed(const char* text) {
+	unnu_rag_lite_kb_embed(_unnu_ragl_default_handle(), text);
+}
+
+// Query embedding from the LRU, or from the encoder on a miss.
+static std::vector<float> _unnu_ragl_query_embedding(const std::string& text, const std::string& key, ragl_kb_t* kb, std::vector<ragl_candidate_t>* fused, bool* have_results) {
+	std::vector<float> _vals;
+	*have_results = false;
+	bool cached = UNNU_RAGL_QUERY_CACHE_CAPACITY > 0 && _unnu_ragl_cache_get(key, _vals, kb, fused, have_results);
+
+	if (!cached) {
+		auto start = std::chrono::steady_clock::now();
+		_vals = _unnu_ragl_process(text);
+		_unnu_ragl_record_latency(_query_embed_ms, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+		if (UNNU_RAGL_QUERY_CACHE_CAPACITY > 0) {
+			_unnu_ragl_cache_put(key, _vals);
+			if (kb != nullptr) {
+				_unnu_ragl_persist_query_embedding(*kb, key, _unnu_ragl_truncate_embedding(_vals, UNNU_RAGL_EMBEDDING_SIZE));
 			}
 		}
-		if (overlap && !overlapping.empty()) {
-			chunks.push_back(overlapping);
+	}
+	return _vals;
+}
+
+static void _unnu_ragl_emit_query_embedding(const std::string& text, const std::vector<float>& _vals) {
+	if (embedding_cb != nullptr) {
+		UnnuRagEmbdVec_t* vec = _unnu_ragl_new_embdvec(UnnuRaglResultType::UNNU_RAGL_QUERY, "", text, _vals.data(), _vals.size());
+		if (vec != nullptr) {
+			embedding_cb(vec);
 		}
-		else if (!currentChunk.empty()) {
-			chunks.push_back(currentChunk);
+		UnnuRagEmbdVec_t* endVec = _unnu_ragl_new_embdvec(UnnuRaglResultType::UNNU_RAGL_FINISH, "", "", nullptr, 0);
+		if (endVec != nullptr) {
+			embedding_cb(endVec);
 		}
 	}
-	return chunks;
 }
 
+// Filtered results are not cached, the filter is not part of the cache key.
+void _unnu_rag_lite_query(ragl_kb_ptr kb, std::string text, bool stream, ragl_filter_t filter) {
+	int errorCode = 0;
+	const std::string key = _unnu_ragl_normalize_query(text);
+	const bool want_results = response_cb != nullptr && kb != nullptr;
+	const uint64_t generation = kb != nullptr ? kb->generation.load() : 0;
+	const uint64_t settings = _query_settings_version;
+
+	std::vector<ragl_candidate_t> fused;
+	bool have_results = false;
+	const bool cache_results = want_results && filter.empty();
+	std::vector<float> _vals = _unnu_ragl_query_embedding(text, key, kb.get(), cache_results ? &fused : nullptr, &have_results);
+
+	if (want_results) {
+		if (!have_results) {
+			auto start = std::chrono::steady_clock::now();
+			fused = _unnu_ragl_search(*kb, text, _vals, UNNU_RAGL_QUERY_RESULT_LIMIT, true, filter, &errorCode);
+			_unnu_ragl_record_latency(_query_search_ms, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+			if (errorCode == 0 && cache_results && UNNU_RAGL_QUERY_CACHE_CAPACITY > 0) {
+				_unnu_ragl_cache_put_results(key, kb->handle, fused, generation, settings);
+			}
+		}
+		if (!stream) {
+			_unnu_ragl_emit_results(fused);
+		}
+	}
+	if (stream) {
+		// a missing knowledge base still closes the stream
+		_unnu_ragl_stream_results(fused);
+	}
+	_unnu_ragl_emit_query_embedding(text, _unnu_ragl_truncate_embedding(_vals, UNNU_RAGL_EMBEDDING_SIZE));
+}
 
+// Fan-out query: one embedding, searched in every knowledge base at once.
+// Merged results are not cached, only the embedding is.
+void _unnu_rag_lite_query_many(std::vector<ragl_kb_ptr> kbs, std::string text, bool stream, ragl_filter_t filter) {
+	int errorCode = 0;
+	const std::string key = _unnu_ragl_normalize_query(text);
+	bool have_results = false;
+	std::vector<float> _vals = _unnu_ragl_query_embedding(text, key, kbs.empty() ? nullptr : kbs.front().get(), nullptr, &have_results);
 
-static void _unnu_rag_lite_retrieve(std::string id) {
-
-	std::string select = "WITH fragments AS (SELECT frag_id FROM doxmap WHERE document_id = '";
-	select.append(id).append("') SELECT embeddings.text, embeddings.embedding FROM embeddings INNER JOIN fragments ON embeddings.frag_id = fragments.frag_id;");
+	if (response_cb != nullptr) {
+		std::vector<ragl_candidate_t> fused = _unnu_ragl_search_many(kbs, text, _vals, UNNU_RAGL_QUERY_RESULT_LIMIT, filter, &errorCode);
+		if (stream) {
+			_unnu_ragl_stream_results(fused);
+		}
+		else {
+			_unnu_ragl_emit_results(fused);
+		}
+	}
+	_unnu_ragl_emit_query_embedding(text, _unnu_ragl_truncate_embedding(_vals, UNNU_RAGL_EMBEDDING_SIZE));
+}
 
-	duckdb::Connection conn(*database);
+void unnu_rag_lite_kb_query(int32_t handle, const char* text) {
+	std::string input(text);
+	std::thread thr(_unnu_rag_lite_query, _unnu_ragl_kb(handle), input, false, ragl_filter_t());
+	thr.detach();
+}
 
-	auto result = conn.Query(select);
+void unnu_rag_lite_query(const char* text) {
+	unnu_rag_lite_kb_query(_unnu_ragl_default_handle(), text);
+}
 
-	if (result->HasError()) {
+void unnu_rag_lite_query_stream(const char* text) {
+	std::string input(text);
+	std::thread thr(_unnu_rag_lite_query, _unnu_ragl_default_kb(), input, true, ragl_filter_t());
+	thr.detach();
+}
 
-#if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: executing pcache_stmt %s\n", result->GetError().c_str());
-#endif
+void unnu_rag_lite_kb_query_stream(const int32_t* handles, int32_t count, const char* text) {
+	std::string input(text);
+	if (count == 1) {
+		// a single knowledge base keeps the result cache
+		std::thread thr(_unnu_rag_lite_query, _unnu_ragl_kb(handles[0]), input, true, ragl_filter_t());
+		thr.detach();
 		return;
 	}
-
-	std::vector< UnnuRaglFragment_t*> fragments;
-	auto output = result.get();
-	while (true) {
-		auto chunk = output->Fetch();
-		if (chunk) {
-			for (idx_t i = 0; i < chunk->size(); i++) {
-				auto line = chunk->GetValue(0, i).GetValue<std::string>();
-				auto vec = chunk->GetValue(1, i).GetValue<duckdb::Value>();
-				auto values = duckdb::ArrayValue::GetChildren(vec);
-				if (!line.empty() && values.size() > 0) {
-					UnnuRagEmbdVec_t* frag = (UnnuRagEmbdVec_t*)malloc(sizeof(UnnuRagEmbdVec_t));
-					frag->type = UNNU_RAGL_EMBEDDING;
-
-					auto len = line.length();
-					frag->length = len;
-					frag->text = (char*)std::calloc(len + 1, sizeof(char));
-					std::memcpy(frag->text, line.c_str(), len);
-					frag->text[len] = '\0';
-
-					auto cnt = values.size();
-					frag->count = cnt;
-					std::vector<float> vdata(cnt);
-					std::transform(values.cbegin(), values.cend(), vdata.begin(),
-						[](duckdb::Value d) -> float { return d.GetValue<float>(); });
-					frag->values = (float*)calloc(cnt, sizeof(float));
-					std::memcpy(frag->values, vdata.data(), cnt * sizeof(float));
-
-					frag->reflen = 0;
-					if (embedding_cb != nullptr) {
-						embedding_cb(frag);
-					}
-				}
-			}
+	std::vector<ragl_kb_ptr> kbs;
+	for (int32_t k = 0; k < count; k++) {
+		ragl_kb_ptr kb = _unnu_ragl_kb(handles[k]);
+		if (kb != nullptr) {
+			kbs.push_back(std::move(kb));
 		}
-		else {
-			break;
+	}
+	std::thread thr(_unnu_rag_lite_query_many, std::move(kbs), input, true, ragl_filter_t());
+	thr.detach();
+}
+
+void unnu_rag_lite_kb_query_many(const int32_t* handles, int32_t count, const char* text) {
+	std::vector<ragl_kb_ptr> kbs;
+	for (int32_t k = 0; k < count; k++) {
+		ragl_kb_ptr kb = _unnu_ragl_kb(handles[k]);
+		if (kb != nullptr) {
+			kbs.push_back(std::move(kb));
 		}
 	}
+	std::string input(text);
+	std::thread thr(_unnu_rag_lite_query_many, std::move(kbs), input, false, ragl_filter_t());
+	thr.detach();
+}
 
-	if (embedding_cb != nullptr) {
-		UnnuRagEmbdVec_t* vec = (UnnuRagEmbdVec_t*)malloc(sizeof(UnnuRagEmbdVec_t));
-		vec->type = UnnuRaglResultType::UNNU_RAGL_FINISH;
-		vec->reflen = 0;
-		vec->length = 0;
-		vec->count = 0;
-		embedding_cb(vec);
+static std::vector<std::string> _unnu_ragl_strings(const char** values, int32_t count) {
+	std::vector<std::string> strings;
+	for (int32_t k = 0; values != nullptr && k < count; k++) {
+		if (values[k] != nullptr) {
+			strings.emplace_back(values[k]);
+		}
 	}
+	return strings;
 }
 
-void unnu_rag_lite_retrieve(const char* uri) {
-	std::string input(uri);
-	std::thread thr(_unnu_rag_lite_retrieve, input);
+void unnu_rag_lite_kb_query_filtered(const int32_t* handles, int32_t count, const char* text, const UnnuRaglFilter_t* filter, int8_t stream) {
+	ragl_filter_t _filter;
+	if (filter != nullptr) {
+		_filter.documents = _unnu_ragl_strings(filter->document_ids, filter->document_count);
+		_filter.uris = _unnu_ragl_strings(filter->uris, filter->uri_count);
+		_filter.corpora = _unnu_ragl_strings(filter->corpora, filter->corpus_count);
+	}
+	std::string input(text);
+	if (count == 1) {
+		std::thread thr(_unnu_rag_lite_query, _unnu_ragl_kb(handles[0]), input, stream != 0, std::move(_filter));
+		thr.detach();
+		return;
+	}
+	std::vector<ragl_kb_ptr> kbs;
+	for (int32_t k = 0; k < count; k++) {
+		ragl_kb_ptr kb = _unnu_ragl_kb(handles[k]);
+		if (kb != nullptr) {
+			kbs.push_back(std::move(kb));
+		}
+	}
+	std::thread thr(_unnu_rag_lite_query_many, std::move(kbs), input, stream != 0, std::move(_filter));
 	thr.detach();
 }
 
-void unnu_rag_lite_mapping(const char* uri, const char* document_id) {
-	duckdb::Connection conn(*database);
+void unnu_rag_lite_query_filtered(const char* text, const UnnuRaglFilter_t* filter, int8_t stream) {
+	const int32_t handle = _unnu_ragl_default_handle();
+	unnu_rag_lite_kb_query_filtered(&handle, 1, text, filter, stream);
+}
+
+void unnu_rag_lite_kb_set_corpus(int32_t handle, const char* document_id, const char* corpus) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (kb == nullptr) {
+		return;
+	}
 	try {
-		duckdb::Appender doxinfo_appender(conn, "doxinfo");
-		doxinfo_appender.AppendRow(document_id, uri, UNNU_RAGL_EMBEDDING_SIZE);
+		RaglConnectionLease lease(*kb);
+		duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_SET_CORPUS);
+		if (statement == nullptr) {
+			return;
+		}
+		auto result = statement->Execute(std::string(document_id), corpus != nullptr ? duckdb::Value(corpus) : duckdb::Value(duckdb::LogicalType::VARCHAR));
+		if (result->HasError()) {
+#if defined(_DEBUG) || defined(DEBUG)
+			fprintf(stderr, "error: setting corpus of %s %s\n", document_id, result->GetError().c_str());
+#endif
+			return;
+		}
 	}
 	catch (...) {
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: doxinfo appender %s, %s\n", document_id, uri);
+		fprintf(stderr, "error: setting corpus of %s\n", document_id);
 #endif
+		return;
 	}
+	// cached results of this knowledge base may no longer match their scope
+	kb->generation++;
 }
 
-static inline std::vector<float> _unnu_ragl_process(std::string input) {
-	constexpr std::chrono::seconds zero_sec(0);
-	auto ids = _tokenizer->Encode(input);
-	std::vector<size_t> _encoder_ids;
 
-	std::transform(ids.begin(), ids.end(), std::back_inserter(_encoder_ids),
-		[](int32_t value) { return static_cast<size_t>(value); });
+void unnu_rag_lite_closeall_kb() {
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		_unnu_ragl_close_kb(kb->handle);
+	}
+}
 
-	std::vector<std::vector<size_t>> _inputs_ids;
-	_inputs_ids.push_back(_encoder_ids);
-	while (_encoder->num_queued_batches() == UNNU_RAGL_MAX_QUEUED_BATCHES) {
+// The open knowledge bases store the old width: their bulk writers and staged
+// vectors are dropped, and the model check marks them stale so they are
+// re-embedded at the new width while ingestion waits.
+void unnu_rag_lite_update_dims(int32_t sz) {
+	if (UNNU_RAGL_EMBEDDING_SIZE == sz) {
+		return;
+	}
+	const std::vector<ragl_kb_ptr> kbs = _unnu_ragl_all_kbs();
+	for (const ragl_kb_ptr& kb : kbs) {
+		_unnu_ragl_stop_reindex(*kb);
+		_unnu_ragl_release_bulk_writer(*kb);
+	}
+	UNNU_RAGL_EMBEDDING_SIZE = sz;
+	_unnu_ragl_cache_clear();
+	_unnu_ragl_query_settings_changed();
+	for (const ragl_kb_ptr& kb : kbs) {
+		_unnu_ragl_check_model(*kb);
+	}
+}
+
+void unnu_rag_lite_keep_full_vectors(int8_t val) {
+	UNNU_RAGL_KEEP_FULL_VECTORS = (val != 0);
+	_unnu_ragl_query_settings_changed();
+}
+
+void unnu_rag_lite_enable_paragraph_chunking(int8_t val) {
+	UNNU_RAGL_PARAGRAPH_CHUNKING = (val == 0);
+}
+
+void unnu_rag_lite_set_chunk_size(int32_t val) {
+	UNNU_RAGL_CHUNKING_SIZE = val;
+}
+
+void unnu_rag_lite_set_token_chunking(int32_t tokens, int32_t overlap) {
+	UNNU_RAGL_CHUNKING_TOKENS = std::max(tokens, 0);
+	UNNU_RAGL_CHUNKING_OVERLAP_TOKENS = std::max(overlap, 0);
+}
+
+void unnu_rag_lite_set_max_batch_tokens(int32_t val) {
+	UNNU_RAGL_MAX_BATCH_TOKENS = val;
+}
+
+void unnu_rag_lite_set_thread_budget(int32_t encoder, int32_t ingest, int32_t db) {
+	UNNU_RAGL_ENCODER_THREADS = std::max(encoder, 0);
+	UNNU_RAGL_INGEST_THREADS = std::max(ingest, 0);
+	UNNU_RAGL_DB_THREADS = std::max(db, 0);
+	if (UNNU_RAGL_DB_THREADS > 0) {
+		for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+			RaglConnectionLease lease(*kb);
+			auto result = lease.Conn().Query("SET threads = " + std::to_string(UNNU_RAGL_DB_THREADS) + ";");
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "info: delayed num_queued_batches() == MAX_QUEUED_BATCHES\n");
+			if (result->HasError()) {
+				fprintf(stderr, "error: setting database threads %s\n", result->GetError().c_str());
+			}
 #endif
-		delay(10);
+		}
 	}
-	auto _val = _encoder->forward_batch_async(_inputs_ids);
-	// bool _done = false;
-	while (!(_val.wait_for(zero_sec) == std::future_status::ready)) {
-		delay(50);
+}
+
+void unnu_rag_lite_set_connection_pool_size(int32_t sz) {
+	UNNU_RAGL_CONNECTION_POOL_SIZE = std::max(sz, 1);
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		kb->pool_cv.notify_all();
 	}
+}
 
-	ctranslate2::EncoderForwardOutput output = _val.get();
-	ctranslate2::Shape _shape = output.last_hidden_state.shape();
-	auto lsz = output.last_hidden_state.size();
-	std::vector<float> _data(lsz);
+void unnu_rag_lite_set_storage_mode(int32_t mode, int32_t rescore_factor) {
+	UNNU_RAGL_STORAGE_MODE = std::min(std::max(mode, 0), 2);
+	UNNU_RAGL_RESCORE_FACTOR = std::max(rescore_factor, 1);
+	_unnu_ragl_query_settings_changed();
+}
 
-	std::memcpy(_data.data(), output.last_hidden_state.to_vector<float>().data(), lsz * sizeof(float));
-	output.last_hidden_state.release();
+void unnu_rag_lite_set_reindex_batch(int32_t fragments) {
+	UNNU_RAGL_REINDEX_BATCH = std::max(fragments, 1);
+}
 
-	arma::fmat _mat(_data.data(), _shape[2], _shape[1], true, true);
-	arma::fmat _mean = UNNU_RAGL_POOLING_TYPE == 0 ? arma::mean(_mat, 1).eval() : UNNU_RAGL_POOLING_TYPE == 1 ? _mat.col(0).eval() : arma::max(_mat, 1).eval();
+void unnu_rag_lite_kb_model_status(int32_t handle, UnnuRaglModelStatus_t* status) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (status == nullptr || kb == nullptr) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(kb->reindex_mutex);
+	status->stale = kb->model_stale ? 1 : 0;
+	status->reindexing = kb->reindex_running ? 1 : 0;
+	status->failed = kb->reindex_failed ? 1 : 0;
+	status->failures = kb->reindex_failures;
+	status->reindexed = kb->reindexed;
+	status->fragments = kb->reindex_total;
+}
 
-	auto _normalised = arma::normalise(_mean.t(), 2, 1);
-	auto _embedding = _normalised.eval();
-	auto sz = _embedding.size();
-	std::vector<float> _vals(sz);
-	std::memcpy(_vals.data(), _embedding.memptr(), sz * sizeof(float));
+void unnu_rag_lite_set_filter_exact_limit(int32_t fragments) {
+	UNNU_RAGL_FILTER_EXACT_LIMIT = std::max(fragments, 0);
+}
 
-	return _vals;
+void unnu_rag_lite_set_exact_search_limit(int32_t fragments) {
+	UNNU_RAGL_EXACT_SEARCH_LIMIT = std::max(fragments, 0);
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		_unnu_ragl_exact_reset(*kb);
+		// a lower limit may leave a knowledge base without the index it now needs
+		_unnu_ragl_request_hnsw(*kb);
+	}
 }
 
-void _unnu_ragl_insert_embedding(const char* document_id, const char* text, int* errorCode) {
-	boost::uuids::random_generator gen;
-	std::string frag_id(boost::uuids::to_string(gen()).c_str());
-	auto embeddings = _unnu_ragl_process(text);
+void unnu_rag_lite_set_pipeline_depth(int32_t documents) {
+	UNNU_RAGL_PIPELINE_DEPTH = std::max(documents, 1);
+}
 
-	try {
-		duckdb::Connection conn(*database);
-		duckdb::vector<duckdb::Value> _array;
-		std::transform(embeddings.cbegin(), embeddings.cend(), std::back_inserter(_array), [](float d) { return duckdb::Value(d); });
+void unnu_rag_lite_throttle_ingest(int32_t max_batches) {
+	{
+		std::lock_guard<std::mutex> lock(_ingest_throttle_mutex);
+		UNNU_RAGL_INGEST_THROTTLE = std::max(max_batches, -1);
+	}
+	_ingest_throttle_cv.notify_all();
+}
 
-		auto embd = duckdb::Value::ARRAY(duckdb::LogicalType::FLOAT, _array);
-		try {
-			duckdb::Appender embd_appender(conn, "embeddings");
-			embd_appender.AppendRow(frag_id.c_str(), text, embd);
-		}
-		catch (...) {
-#if defined(_DEBUG) || defined(DEBUG)
-			fprintf(stderr, "error: embeddings appender %s, %s\n", frag_id.c_str(), text);
-#endif
+void unnu_rag_lite_set_bulk_commit(int32_t documents) {
+	UNNU_RAGL_BULK_COMMIT_DOCUMENTS = documents;
+	if (documents <= 1) {
+		for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+			_unnu_ragl_release_bulk_writer(*kb);
 		}
+	}
+}
 
-		try {
-			duckdb::Appender dm_appender(conn, "doxmap");
-			dm_appender.AppendRow(document_id, frag_id.c_str());
+void unnu_rag_lite_flush_ingest() {
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		_unnu_ragl_release_bulk_writer(*kb);
+	}
+}
+
+// SQL string literal of a path, COPY and read_parquet take no parameters
+static std::string _unnu_ragl_sql_string(const std::string& value) {
+	std::string literal("'");
+	for (char c : value) {
+		if (c == '\'') {
+			literal.push_back('\'');
 		}
-		catch (...) {
+		literal.push_back(c);
+	}
+	literal.push_back('\'');
+	return literal;
+}
+
+static std::string _unnu_ragl_export_file(const std::filesystem::path& dir, const char* name) {
+	return _unnu_ragl_sql_string((dir / name).string());
+}
+
+static bool _unnu_ragl_run_steps(duckdb::Connection& conn, const std::vector<std::string>& queries, const char* what) {
+	for (const std::string& query : queries) {
+		auto result = conn.Query(query);
+		if (result->HasError()) {
 #if defined(_DEBUG) || defined(DEBUG)
-			fprintf(stderr, "error: doxmap appender %s, %s\n", document_id, frag_id.c_str());
+			fprintf(stderr, "error: %s %s\n", what, result->GetError().c_str());
 #endif
+			return false;
 		}
 	}
-	catch (...) {
+	return true;
+}
+
+// Writes embeddings, doxinfo and doxmap as Parquet files next to a manifest
+// naming the model, dimensions and pooling the fragment ids were derived
+// from, all read in one transaction.
+static void _unnu_ragl_export(ragl_kb_t& kb, const char* dir, int* errorCode) {
+	_unnu_ragl_release_bulk_writer(kb);
+
+	const std::filesystem::path path(dir);
+	std::error_code ec;
+	std::filesystem::create_directories(path, ec);
+	if (ec) {
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: _unnu_ragl_insert_embedding %s, %s\n", document_id, frag_id.c_str());
+		fprintf(stderr, "error: creating export directory %s %s\n", dir, ec.message().c_str());
 #endif
+		*errorCode = 5642;
 		return;
 	}
 
-	if (embedding_cb != nullptr) {
-		int len = strlen(text);
-		if (len > 0) {
-			UnnuRagEmbdVec_t* response = (UnnuRagEmbdVec_t*)malloc(sizeof(UnnuRagEmbdVec_t));
-			response->type = UnnuRaglResultType::UNNU_RAGL_EMBEDDING;
-			response->length = len;
-			response->text = (char*)std::calloc(len + 1, sizeof(char));
-			std::memcpy(response->text, text, len * sizeof(char));
-			response->text[len] = '\0';
-			int reflen = frag_id.length();
-			response->reflen = reflen;
-			response->ref_id = (char*)std::calloc(reflen + 1, sizeof(char));
-			std::memcpy(response->ref_id, frag_id.c_str(), reflen * sizeof(char));
-			response->ref_id[reflen] = '\0';
-			int count = embeddings.size();
-			response->count = count;
-			response->values = (float*)calloc(count, sizeof(float));
-			std::memcpy(response->values, embeddings.data(), count * sizeof(float));
-			embedding_cb(response);
-		}
+	std::vector<std::string> queries;
+	queries.push_back("BEGIN TRANSACTION;");
+	queries.push_back("COPY embeddings TO " + _unnu_ragl_export_file(path, "embeddings.parquet") + " (FORMAT PARQUET);");
+	queries.push_back("COPY doxinfo TO " + _unnu_ragl_export_file(path, "doxinfo.parquet") + " (FORMAT PARQUET);");
+	queries.push_back("COPY doxmap TO " + _unnu_ragl_export_file(path, "doxmap.parquet") + " (FORMAT PARQUET);");
+	std::string manifest = "COPY (SELECT 1 AS format, ";
+	const ragl_model_ptr model = _unnu_ragl_model();
+	manifest.append(_unnu_ragl_sql_string(model != nullptr ? model->id : "")).append(" AS model_id, ");
+	manifest.append(std::to_string(UNNU_RAGL_EMBEDDING_SIZE)).append(" AS dims, ");
+	manifest.append(std::to_string(UNNU_RAGL_POOLING_TYPE)).append(" AS pooling, ");
+	manifest.append("(SELECT count(*) FROM embeddings) AS fragments, (SELECT count(*) FROM doxinfo) AS documents, now() AS exported_at) TO ");
+	manifest.append(_unnu_ragl_export_file(path, "manifest.json")).append(" (FORMAT JSON);");
+	queries.push_back(manifest);
+	queries.push_back("COMMIT;");
+
+	RaglConnectionLease lease(kb);
+	duckdb::Connection& conn = lease.Conn();
+	if (!_unnu_ragl_run_steps(conn, queries, "exporting knowledge base")) {
+		conn.Query("ROLLBACK;");
+		*errorCode = 5642;
+		return;
 	}
+	*errorCode = 0;
 }
 
-typedef struct embedding_context {
-	std::string document_id;
-	std::vector<std::string> chunks;
-} embedding_context_t;
+// Bulk loads an export made under the same model, dimensions and pooling, so
+// its fragment ids match the ones ingestion derives. The HNSW graph or the
+// codes and the BM25 index are built once after the load.
+static void _unnu_ragl_import(ragl_kb_t& kb, const char* dir, int* errorCode) {
+	const std::filesystem::path path(dir);
+	_unnu_ragl_release_bulk_writer(kb);
 
-static void _unnu_ragl_embed(embedding_context_t* context, size_t i) {
-	try {
-	std::string input = context->chunks[i];
-	int errorCode = 0;
-		_unnu_ragl_insert_embedding(context->document_id.c_str(), input.c_str(), &errorCode);
+	RaglConnectionLease lease(kb);
+	duckdb::Connection& conn = lease.Conn();
+
+	auto manifest = conn.Query("SELECT model_id, dims, pooling FROM read_json(" + _unnu_ragl_export_file(path, "manifest.json") + ");");
+	if (manifest->HasError() || manifest->RowCount() == 0) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: reading manifest of %s %s\n", dir, manifest->HasError() ? manifest->GetError().c_str() : "empty");
+#endif
+		*errorCode = 5642;
+		return;
 	}
-	catch (...) {
+	const std::string model_id = manifest->GetValue(0, 0).ToString();
+	const int32_t dims = manifest->GetValue(1, 0).GetValue<int32_t>();
+	const int32_t pooling = manifest->GetValue(2, 0).GetValue<int32_t>();
+	const ragl_model_ptr model = _unnu_ragl_model();
+	if (dims != UNNU_RAGL_EMBEDDING_SIZE || pooling != UNNU_RAGL_POOLING_TYPE || (model != nullptr && model_id != model->id)) {
 #if defined(_DEBUG) || defined(DEBUG)
-		fprintf(stderr, "error: _unnu_ragl_embed\n");
+		fprintf(stderr, "error: %s was exported with %s/%d/%d\n", dir, model_id.c_str(), pooling, dims);
 #endif
+		*errorCode = 5645;
+		return;
+	}
+
+	// the graph is rebuilt once over all rows instead of per inserted row
+	std::vector<std::string> queries;
+	if (kb.storage == 0) {
+		queries.push_back("DROP INDEX IF EXISTS embeddings_hnsw_index;");
 	}
+	queries.push_back("BEGIN TRANSACTION;");
+	queries.push_back("INSERT OR IGNORE INTO embeddings SELECT frag_id, text, embedding::FLOAT[" + std::to_string(dims) + "] FROM read_parquet(" + _unnu_ragl_export_file(path, "embeddings.parquet") + ");");
+	queries.push_back("INSERT OR IGNORE INTO doxinfo SELECT document_id, uri, embedding_size FROM read_parquet(" + _unnu_ragl_export_file(path, "doxinfo.parquet") + ");");
+	// by name, exports made before doxmap.corpus load with a NULL corpus
+	queries.push_back("INSERT OR IGNORE INTO doxmap BY NAME SELECT * FROM read_parquet(" + _unnu_ragl_export_file(path, "doxmap.parquet") + ");");
+	if (kb.storage != 0) {
+		queries.push_back(_unnu_ragl_codes_insert(kb.storage, std::string("frag_id NOT IN (SELECT frag_id FROM ") + _unnu_ragl_codes_table(kb.storage) + ")"));
+	}
+	queries.push_back("COMMIT;");
+	const bool loaded = _unnu_ragl_run_steps(conn, queries, "importing knowledge base");
+	if (!loaded) {
+		conn.Query("ROLLBACK;");
+	}
+	_unnu_ragl_exact_reset(kb);
+
+	// restore the index after a failed load too, if the rows still need one
+	kb.hnsw_indexed = false;
+	const bool indexed = _unnu_ragl_ensure_hnsw(kb, conn) && _unnu_ragl_run_steps(conn, { "CHECKPOINT;" }, "indexing imported knowledge base");
+	if (!loaded || !indexed) {
+		*errorCode = 5642;
+		return;
+	}
+	*errorCode = 0;
 }
 
-void _unnu_rag_lite_embed(std::string text) {
-	//std::string _text_in(text);
-	embedding_context_t context;
-	boost::uuids::random_generator gen;
-	context.document_id = boost::uuids::to_string(gen()).c_str();
-	context.chunks = _unnu_ragl_split_text_into_chunks(text, UNNU_RAGL_CHUNKING_SIZE, true);
-	int errorCode = 0;
+void unnu_rag_lite_export(int32_t handle, const char* dir, int* errorCode) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (kb == nullptr || dir == nullptr) {
+		*errorCode = 5642;
+		return;
+	}
+	_unnu_ragl_export(*kb, dir, errorCode);
+}
 
-	if (context.chunks.size() > 0) {
-		pthreadpool_t threadpool = pthreadpool_create(0);
-		pthreadpool_parallelize_1d(threadpool, (pthreadpool_task_1d_t)_unnu_ragl_embed,
-			(void*)&context, context.chunks.size(),
-			/*flags=*/0);
-		pthreadpool_destroy(threadpool);
-		threadpool = NULL;
+void unnu_rag_lite_import(int32_t handle, const char* dir, int* errorCode) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (kb == nullptr || dir == nullptr) {
+		*errorCode = 5642;
+		return;
 	}
+	_unnu_ragl_import(*kb, dir, errorCode);
+	if (*errorCode == 0) {
+		// the rebuild leases its own connection
+		_unnu_ragl_kb_changed(*kb);
+		_unnu_ragl_flush_fts(*kb);
+	}
+}
 
-	if (embedding_cb != nullptr) {
-		UnnuRagEmbdVec_t* vec = (UnnuRagEmbdVec_t*)malloc(sizeof(UnnuRagEmbdVec_t));
-		vec->type = UnnuRaglResultType::UNNU_RAGL_FINISH;
-		int reflen = context.document_id.length();
-		vec->reflen = reflen;
-		vec->ref_id = (char*)calloc(reflen + 1, sizeof(char));
-		std::memcpy(vec->ref_id, context.document_id.c_str(), reflen * sizeof(char));
-		vec->ref_id[reflen] = '\0';
-		vec->length = 0;
-		vec->count = 0;
-		embedding_cb(vec);
+void unnu_rag_lite_set_fts_debounce(int32_t ms) {
+	UNNU_RAGL_FTS_DEBOUNCE_MS = ms;
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		kb->maintenance_cv.notify_all();
 	}
-	_unnu_overwrite_fts_index(&errorCode);
 }
 
-void unnu_rag_lite_embed(const char* text) {
-	std::string input(text);
-	std::thread thr(_unnu_rag_lite_embed, input);
-	thr.detach();
+void unnu_rag_lite_set_compaction(float ratio, int32_t idle_ms) {
+	UNNU_RAGL_COMPACT_RATIO = std::max(ratio, 0.0f);
+	UNNU_RAGL_COMPACT_IDLE_MS = std::max(idle_ms, 0);
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		kb->maintenance_cv.notify_all();
+	}
 }
 
-void _unnu_rag_lite_query(std::string text) {
-	int errorCode = 0;
+void unnu_rag_lite_compact() {
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		_unnu_ragl_compact(*kb);
+	}
+}
 
-	std::vector<float> _vals(_unnu_ragl_process(text));
-	//if (response_cb != nullptr) {
-	//	_unnu_ragl_query(text.c_str(), _vals, QUERY_RESULT_LIMIT, &errorCode);
-	//	UnnuRaglResult_t* response = (UnnuRaglResult_t*)malloc(sizeof(UnnuRaglResult_t));
-	//	response->type = UnnuRaglResultType::UNNU_RAGL_FINISH;
-	//	response->count = 0;
-	//	response->length = 0;
-	//	response_cb(response);
-	//}
-	if (embedding_cb != nullptr) {
-		UnnuRagEmbdVec_t* vec = (UnnuRagEmbdVec_t*)malloc(sizeof(UnnuRagEmbdVec_t));
-		vec->type = UnnuRaglResultType::UNNU_RAGL_QUERY;
-		int len = text.size();
-		vec->length = len;
-		vec->text = (char*)calloc(len + 1, sizeof(char));
-		std::memcpy(vec->text, text.c_str(), len * sizeof(char));
-		vec->text[len] = '\0';
-		vec->reflen = 0;
-		int cnt = _vals.size();
-		vec->count = cnt;
-		vec->values = (float*)calloc(cnt, sizeof(float));
-		std::memcpy(vec->values, _vals.data(), cnt * sizeof(float));
-		embedding_cb(vec);
-		{
-			UnnuRagEmbdVec_t* endVec = (UnnuRagEmbdVec_t*)malloc(sizeof(UnnuRagEmbdVec_t));
-			endVec->type = UnnuRaglResultType::UNNU_RAGL_FINISH;
-			endVec->reflen = 0;
-			endVec->length = 0;
-			endVec->count = 0;
-			embedding_cb(endVec);
+void unnu_rag_lite_kb_maintenance_stats(int32_t handle, UnnuRaglMaintenanceStats_t* stats) {
+	ragl_kb_ptr kb = _unnu_ragl_kb(handle);
+	if (stats == nullptr || kb == nullptr) {
+		return;
+	}
+	int64_t live = -1;
+	try {
+		RaglConnectionLease lease(*kb);
+		auto result = lease.Conn().Query("SELECT count(*) FROM embeddings;");
+		if (!result->HasError() && result->RowCount() > 0) {
+			live = result->GetValue(0, 0).GetValue<int64_t>();
 		}
 	}
+	catch (...) {
+#if defined(_DEBUG) || defined(DEBUG)
+		fprintf(stderr, "error: unnu_rag_lite_kb_maintenance_stats\n");
+#endif
+	}
+	std::lock_guard<std::mutex> lock(kb->maintenance_mutex);
+	if (live >= 0) {
+		kb->live_fragments = live;
+	}
+	stats->fragments = kb->live_fragments;
+	stats->tombstones = kb->tombstones;
+	stats->fragmentation = kb->tombstones > 0 ? static_cast<double>(kb->tombstones) / (kb->live_fragments + kb->tombstones) : 0.0;
+	stats->compactions = kb->compactions;
+	stats->fts_pending = kb->fts_dirty_generation != kb->fts_built_generation ? 1 : 0;
+	stats->fts_failures = kb->fts_failures;
+	stats->compact_failures = kb->compact_failures;
 }
 
-void unnu_rag_lite_query(const char* text) {
-	std::string input(text);
-	std::thread thr(_unnu_rag_lite_query, input);
-	thr.detach();
+void unnu_rag_lite_flush_fts() {
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		_unnu_ragl_flush_fts(*kb);
+	}
 }
 
-
-void unnu_rag_lite_closeall_kb() {
-	pstmt = nullptr;
-	connection = nullptr;
-	database = nullptr;
+void unnu_rag_lite_set_pooling_type(int32_t val) {
+	if (UNNU_RAGL_POOLING_TYPE != val) {
+		_unnu_ragl_cache_clear();
+	}
+	UNNU_RAGL_POOLING_TYPE = val;
 }
 
-void unnu_rag_lite_update_dims(int32_t sz) {
-	UNNU_RAGL_EMBEDDING_SIZE = sz;
+void unnu_rag_lite_set_query_cache_capacity(int32_t sz) {
+	UNNU_RAGL_QUERY_CACHE_CAPACITY = sz;
+	std::lock_guard<std::mutex> lock(_query_cache_mutex);
+	while (_query_cache.size() > static_cast<size_t>(std::max(sz, 0))) {
+		_query_cache_index.erase(_query_cache.back().key);
+		_query_cache.pop_back();
+	}
 }
 
-void unnu_rag_lite_enable_paragraph_chunking(int8_t val) {
-	UNNU_RAGL_PARAGRAPH_CHUNKING = (val == 0);
+void unnu_rag_lite_enable_query_cache_persistence(int8_t val) {
+	UNNU_RAGL_QUERY_CACHE_PERSIST = (val != 0);
 }
 
-void unnu_rag_lite_set_chunk_size(int32_t val) {
-	UNNU_RAGL_CHUNKING_SIZE = val;
+void unnu_rag_lite_clear_query_cache() {
+	_unnu_ragl_cache_clear();
+	for (const ragl_kb_ptr& kb : _unnu_ragl_all_kbs()) {
+		RaglConnectionLease lease(*kb);
+		duckdb::PreparedStatement* statement = lease.Statement(RAGL_STMT_CLEAR_QUERY_CACHE);
+		if (statement != nullptr) {
+			statement->Execute();
+		}
+	}
 }
 
-void unnu_rag_lite_set_pooling_type(int32_t val) {
-	UNNU_RAGL_POOLING_TYPE = val;
+void unnu_rag_lite_query_cache_stats(UnnuRaglCacheStats_t* stats) {
+	if (stats == nullptr) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(_query_cache_mutex);
+	*stats = _query_cache_stats;
+	stats->entries = _query_cache.size();
 }
 
 void unnu_rag_lite_result_limit(int32_t sz) {
 	UNNU_RAGL_QUERY_RESULT_LIMIT = sz;
+	_unnu_ragl_query_settings_changed();
+}
+
+void unnu_rag_lite_set_candidate_limit(int32_t sz) {
+	UNNU_RAGL_CANDIDATE_LIMIT = sz;
+	_unnu_ragl_query_settings_changed();
+}
+
+void unnu_rag_lite_set_fusion_strategy(int32_t val) {
+	UNNU_RAGL_FUSION_STRATEGY = val;
+	_unnu_ragl_query_settings_changed();
+}
+
+void unnu_rag_lite_set_fusion_weights(float embedding, float fts) {
+	UNNU_RAGL_FUSION_EMBEDDING_WEIGHT = embedding;
+	UNNU_RAGL_FUSION_FTS_WEIGHT = fts;
+	_unnu_ragl_query_settings_changed();
+}
+
+void unnu_rag_lite_set_rrf_k(int32_t val) {
+	UNNU_RAGL_RRF_K = val;
+	_unnu_ragl_query_settings_changed();
+}
+
+void unnu_rag_lite_set_rerank_limit(int32_t sz) {
+	UNNU_RAGL_RERANK_LIMIT = sz;
+	_unnu_ragl_query_settings_changed();
 }
 
 
@@ -764,32 +5059,27 @@ void unnu_set_ragl_embedding_callback(UnnuRaglEmbeddingCallback callback) {
 	embedding_cb = callback;
 }
 
-void unnu_ragl_free_result(UnnuRaglResult_t* result) {
-	if (result != nullptr) {
-		if (result->length > 0) free(result->text);
-		if (result->reflen > 0) free(result->ref_id);
-		if (result->count > 0) {
-			for (int k = 0, n = result->count; k < n; k++) {
-				UnnuRaglFragment_t* fragment = result->fragments[k];
-				if (fragment != nullptr) {
-					if (fragment->length > 0) free(fragment->text);
-					free(fragment);
-				}
-			}
-		}
-		free(result);
+void unnu_set_ragl_pipeline_callback(UnnuRaglPipelineCallback callback) {
+	pipeline_cb = callback;
+}
+
+void unnu_unset_ragl_pipeline_callback() {
+	pipeline_cb = nullptr;
+}
+
+void unnu_ragl_free_stage_metrics(UnnuRaglStageMetrics_t* metrics) {
+	if (metrics != nullptr) {
+		free(metrics);
 	}
 }
 
+// Results and vectors are single blocks, see RaglArena.
+void unnu_ragl_free_result(UnnuRaglResult_t* result) {
+	free(result);
+}
+
 void unnu_ragl_free_embedvector(UnnuRagEmbdVec_t* vec) {
-	if (vec != nullptr) {
-		if (vec->length > 0) free(vec->text);
-		if (vec->reflen > 0) free(vec->ref_id);
-		if (vec->count > 0) {
-			free(vec->values);
-		}
-		free(vec);
-	}
+	free(vec);
 }
 
 void unnu_unset_ragl_result_callback() {
@@ -802,10 +5092,20 @@ void unnu_unset_ragl_embedding_callback() {
 
 void unnu_rag_lite_destroy() {
 	unnu_rag_lite_closeall_kb();
+	_unnu_ragl_stop_pipeline();
 	unnu_unset_ragl_result_callback();
 	unnu_unset_ragl_embedding_callback();
-	if (_encoder != nullptr) _encoder->clear_cache();
-	_encoder = nullptr;
-	_tokenizer = nullptr;
+	ragl_model_ptr model;
+	{
+		std::lock_guard<std::mutex> lock(_model_mutex);
+		model = std::move(_model);
+		_model = nullptr;
+	}
+	if (model != nullptr) model->encoder->clear_cache();
+	{
+		std::lock_guard<std::mutex> lock(_reranker_mutex);
+		_reranker = nullptr;
+	}
+	unnu_rag_lite_throttle_ingest(-1);
 }
 
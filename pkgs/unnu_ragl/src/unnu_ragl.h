@@ -32,6 +32,13 @@ typedef enum UnnuRaglResultType : uint8_t {
 typedef struct  UnnuRaglFragment {
 	char* text;
 	int length;
+	char* ref_id;
+	int reflen;
+	// ids of the documents mapping the fragment, comma separated
+	char* document_id;
+	int doclen;
+	float score;
+	int32_t kb;
 } UnnuRaglFragment_t;
 
 typedef struct  UnnuRaglResult {
@@ -54,10 +61,73 @@ typedef struct  UnnuRagEmbdVec {
 	int64_t count;
 } UnnuRagEmbdVec_t;
 
+typedef struct  UnnuRaglCacheStats {
+	int64_t lookups;
+	int64_t embedding_hits;
+	int64_t result_hits;
+	int64_t misses;
+	int64_t entries;
+	double saved_ms;
+} UnnuRaglCacheStats_t;
+
+// deleted fragments only leave tombstones in the HNSW graph until compaction;
+// fragmentation is tombstones / (fragments + tombstones). The failure counts
+// are consecutive failed BM25 rebuilds and checkpoints, retried with backoff
+typedef struct  UnnuRaglMaintenanceStats {
+	int64_t fragments;
+	int64_t tombstones;
+	double fragmentation;
+	int64_t compactions;
+	int8_t fts_pending;
+	int32_t fts_failures;
+	int32_t compact_failures;
+} UnnuRaglMaintenanceStats_t;
+
+// embedding model of a knowledge base against the loaded encoder; while stale
+// the stored vectors are re-embedded in the background, reindexed of fragments
+typedef struct  UnnuRaglModelStatus {
+	int8_t stale;
+	int8_t reindexing;
+	// the re-embedding gave up, ingestion is refused until the model is reloaded
+	int8_t failed;
+	int32_t failures;
+	int64_t reindexed;
+	int64_t fragments;
+} UnnuRaglModelStatus_t;
+
+// Scope of a filtered query: fragments mapped by a document that matches every
+// non-empty list (document ids, doxinfo uris, corpora given at ingestion).
+typedef struct  UnnuRaglFilter {
+	const char** document_ids;
+	int32_t document_count;
+	const char** uris;
+	int32_t uri_count;
+	const char** corpora;
+	int32_t corpus_count;
+} UnnuRaglFilter_t;
+
+typedef enum UnnuRaglStage : uint8_t {
+	UNNU_RAGL_STAGE_PREPARE,
+	UNNU_RAGL_STAGE_ENCODE,
+	UNNU_RAGL_STAGE_WRITE
+} UnnuRaglStage_t;
+
+// running totals of one ingestion stage, reported after every item it handles
+typedef struct  UnnuRaglStageMetrics {
+	UnnuRaglStage_t stage;
+	int64_t processed;
+	int64_t documents;
+	int32_t queued;
+	int32_t capacity;
+	double busy_ms;
+} UnnuRaglStageMetrics_t;
+
 typedef void (*UnnuRaglResponseCallback)(UnnuRaglResult_t* response);
 
 typedef void (*UnnuRaglEmbeddingCallback)(UnnuRagEmbdVec_t* embedding);
 
+typedef void (*UnnuRaglPipelineCallback)(UnnuRaglStageMetrics_t* metrics);
+
 #ifdef __cplusplus
 }
 #endif
@@ -67,12 +137,84 @@ FFI_PLUGIN_EXPORT void unnu_rag_lite_open_kb(char* db_path, int* errorCode);
 // FFI_PLUGIN_EXPORT void unnu_rag_lite_open_memory(char* mem_id, int* errorCode);
 
 FFI_PLUGIN_EXPORT void unnu_rag_lite_closeall_kb();
-// FFI_PLUGIN_EXPORT void unnu_rag_lite_close_kb(char* tag);
+
+// Knowledge base handles: several databases open at once, sharing the encoder.
+// The functions without a handle act on the knowledge base of unnu_rag_lite_open_kb.
+// returns the handle, 0 when the database could not be opened
+FFI_PLUGIN_EXPORT int32_t unnu_rag_lite_kb_open(const char* db_path, int* errorCode);
+
+// waits for the documents queued into this knowledge base; ingestion into the
+// others continues
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_close(int32_t kb);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_embed(int32_t kb, const char* text);
+
+// ingests text as a document of corpus, which filtered queries can scope to
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_embed_corpus(int32_t kb, const char* text, const char* corpus);
+
+// moves an ingested document to another corpus, NULL for none
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_set_corpus(int32_t kb, const char* document_id, const char* corpus);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_query(int32_t kb, const char* text);
+
+// searches the knowledge bases in parallel, fragments are merged by score
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_query_many(const int32_t* kbs, int32_t count, const char* text);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_retrieve(int32_t kb, const char* uri);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_mapping(int32_t kb, const char* uri, const char* document_id);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_delete(int32_t kb, const char* document_id, const char* uri);
+
+// Corpus distribution: embeddings, doxinfo and doxmap as Parquet files in dir
+// plus manifest.json with the model id, dimensions and pooling type. Import
+// requires the same model settings (errorCode 5645 otherwise) and builds the
+// vector and BM25 indexes once after the load.
+FFI_PLUGIN_EXPORT void unnu_rag_lite_export(int32_t kb, const char* dir, int* errorCode);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_import(int32_t kb, const char* dir, int* errorCode);
 
 FFI_PLUGIN_EXPORT void unnu_rag_lite_init(const char* path);
 
+// Loads a converted cross-encoder for re-ranking, nullptr unloads it. The
+// sequence-classification layer is not part of the CTranslate2 model: export
+// it to classifier.txt in the model directory as "labels hidden", the weights
+// row by row and the biases, with 1 or 2 labels. Without it the pooler output
+// must already be 1 or 2 logits wide, otherwise the fused order is kept. A
+// model that fails to load sets errorCode 5642 and keeps the previous one.
+FFI_PLUGIN_EXPORT void unnu_rag_lite_init_reranker(const char* path, int* errorCode);
+
+// Every knowledge base records the model id, dimensions and pooling of its
+// vectors. Opened under another model (or after init switched it), queries
+// fall back to BM25, ingestion waits, and the stored fragments are re-embedded
+// in batches, resumable across restarts, then swapped in atomically.
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_model_status(int32_t kb, UnnuRaglModelStatus_t* status);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_reindex_batch(int32_t fragments);
+
 FFI_PLUGIN_EXPORT void unnu_rag_lite_query(const char* text);
 
+// streams one UNNU_RAGL_QUERY result per fragment in score order, closed by an
+// UNNU_RAGL_FINISH result; count > 1 merges the knowledge bases by score
+FFI_PLUGIN_EXPORT void unnu_rag_lite_query_stream(const char* text);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_query_stream(const int32_t* kbs, int32_t count, const char* text);
+
+// hybrid query over the fragments in the filter scope; the vector and BM25
+// candidates are generated within the scope, stream as for kb_query_stream
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_query_filtered(const int32_t* kbs, int32_t count, const char* text, const UnnuRaglFilter_t* filter, int8_t stream);
+
+// filter scopes up to this many fragments are ranked exactly, broader ones
+// over-fetch from the vector index
+FFI_PLUGIN_EXPORT void unnu_rag_lite_query_filtered(const char* text, const UnnuRaglFilter_t* filter, int8_t stream);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_filter_exact_limit(int32_t fragments);
+
+// knowledge bases up to this many fragments (20000 by default) are ranked
+// exactly against an in-memory copy of their vectors; the HNSW index is only
+// built once a knowledge base grows past it, 0 always uses the index
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_exact_search_limit(int32_t fragments);
+
 FFI_PLUGIN_EXPORT void unnu_rag_lite_retrieve(const char* uri);
 
 FFI_PLUGIN_EXPORT void unnu_rag_lite_mapping(const char* uri, const char* document_id);
@@ -81,20 +223,97 @@ FFI_PLUGIN_EXPORT void unnu_rag_lite_delete(const char* document_id, const char*
 
 FFI_PLUGIN_EXPORT void unnu_rag_lite_embed(const char* text);
 
+FFI_PLUGIN_EXPORT void unnu_rag_lite_embed_corpus(const char* text, const char* corpus);
+
+// stored embedding width; smaller than the model output truncates the pooled
+// vector to its first sz values and renormalises it (Matryoshka models); open
+// knowledge bases of another width are re-embedded, see
+// unnu_rag_lite_kb_model_status
 FFI_PLUGIN_EXPORT void unnu_rag_lite_update_dims(int32_t sz);
 
+// keep the untruncated vectors to rescore the vector candidates with
+FFI_PLUGIN_EXPORT void unnu_rag_lite_keep_full_vectors(int8_t val);
+
 FFI_PLUGIN_EXPORT void unnu_rag_lite_result_limit(int32_t sz);
 
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_candidate_limit(int32_t sz);
+
+// 0 - weighted sum, 1 - reciprocal rank fusion
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_fusion_strategy(int32_t val);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_fusion_weights(float embedding, float fts);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_rrf_k(int32_t val);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_rerank_limit(int32_t sz);
+
 FFI_PLUGIN_EXPORT void unnu_rag_lite_enable_paragraph_chunking(int8_t val);
 
 FFI_PLUGIN_EXPORT void unnu_rag_lite_set_chunk_size(int32_t val);
 
+// chunk by tokens of the loaded tokenizer, tokens <= 0 falls back to characters
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_token_chunking(int32_t tokens, int32_t overlap);
+
 FFI_PLUGIN_EXPORT void unnu_rag_lite_set_pooling_type(int32_t val);
 
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_max_batch_tokens(int32_t val);
+
+// thread budgets, 0 keeps the default: encoder threads per replica (applied
+// on the next init), encode workers of the ingestion pipeline (applied when
+// it next starts, after unnu_rag_lite_destroy), database threads
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_thread_budget(int32_t encoder, int32_t ingest, int32_t db);
+
+// -1 unthrottled, 0 pauses ingestion, N allows N ingestion batches in flight
+FFI_PLUGIN_EXPORT void unnu_rag_lite_throttle_ingest(int32_t max_batches);
+
+// connections each knowledge base keeps open for queries and maintenance, minimum 1
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_connection_pool_size(int32_t sz);
+
+// 0 - float vectors with the HNSW index, 1 - int8 codes, 2 - binary codes;
+// quantized modes shortlist rescore_factor * candidates by code and rescore
+// them with the float vectors. The float vectors stay on disk in every mode,
+// so the codes add to the footprint (about dims + 4 bytes per fragment for
+// int8, dims / 8 for binary) rather than replace the 4 * dims bytes; what
+// they save is the HNSW index and its memory. The mode applies to knowledge
+// bases opened next.
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_storage_mode(int32_t mode, int32_t rescore_factor);
+
+// documents queued ahead of the ingestion pipeline, applied when it next
+// starts, after unnu_rag_lite_destroy
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_pipeline_depth(int32_t documents);
+
+// commit ingestion once every N documents (bulk import), 1 commits per document
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_bulk_commit(int32_t documents);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_flush_ingest();
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_fts_debounce(int32_t ms);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_flush_fts();
+
+// deletes are compacted and checkpointed in the background, right away once the
+// fragmentation reaches ratio, otherwise after idle_ms without queries or changes
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_compaction(float ratio, int32_t idle_ms);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_compact();
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_kb_maintenance_stats(int32_t kb, UnnuRaglMaintenanceStats_t* stats);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_set_query_cache_capacity(int32_t sz);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_enable_query_cache_persistence(int8_t val);
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_clear_query_cache();
+
+FFI_PLUGIN_EXPORT void unnu_rag_lite_query_cache_stats(UnnuRaglCacheStats_t* stats);
+
 FFI_PLUGIN_EXPORT void unnu_set_ragl_result_callback(UnnuRaglResponseCallback callback);
 
 FFI_PLUGIN_EXPORT void unnu_set_ragl_embedding_callback(UnnuRaglEmbeddingCallback callback);
 
+// Every callback payload is one allocation: the struct, the fragment pointers,
+// the fragments, the values and all strings live in a single block that the
+// matching free call releases at once. Pointers stay valid until then.
 FFI_PLUGIN_EXPORT void unnu_ragl_free_result(UnnuRaglResult_t* result);
 
 FFI_PLUGIN_EXPORT void unnu_ragl_free_embedvector(UnnuRagEmbdVec_t* vec);
@@ -103,6 +322,12 @@ FFI_PLUGIN_EXPORT void unnu_unset_ragl_result_callback();
 
 FFI_PLUGIN_EXPORT void unnu_unset_ragl_embedding_callback();
 
+FFI_PLUGIN_EXPORT void unnu_set_ragl_pipeline_callback(UnnuRaglPipelineCallback callback);
+
+FFI_PLUGIN_EXPORT void unnu_unset_ragl_pipeline_callback();
+
+FFI_PLUGIN_EXPORT void unnu_ragl_free_stage_metrics(UnnuRaglStageMetrics_t* metrics);
+
 FFI_PLUGIN_EXPORT void unnu_rag_lite_destroy();
 
 #endif // _UNNU_RAG_LITE_H
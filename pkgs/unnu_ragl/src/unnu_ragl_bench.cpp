@@ -0,0 +1,517 @@
+// Standalone ingestion and retrieval benchmark for unnu_ragl.
+//
+// Built from the same translation unit as the plugin (without Flutter), so it
+// can time the stages the pipeline threads overlap: prepare (chunking and
+// fragment reuse), tokenize, encode, pool and write. Ingests a synthetic corpus, or the .txt files of a directory, then
+// reports query latency of the vector, FTS and hybrid paths, recall@k of the
+// vector path against an exact scan and the peak resident set, as JSON.
+//
+//   unnu_ragl_bench --model <dir> [--db <file>] [--corpus <dir>] [--docs 200]
+//                   [--queries 200] [--k 10] [--dims 768] [--storage 0]
+//                   [--rescore 4] [--seed 42] [--out <file>]
+//
+// Comparing --storage 0|1|2 and --rescore on one --db file reports recall,
+// latency and the database size of each mode.
+
+#include "unnu_ragl.cpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+typedef struct ragl_bench_options {
+	std::string model;
+	std::string db;
+	std::string corpus;
+	std::string out;
+	int32_t docs = 200;
+	int32_t queries = 200;
+	int32_t k = 10;
+	int32_t dims = 0;
+	int32_t storage = 0;
+	int32_t rescore = 0;
+	uint32_t seed = 42;
+} ragl_bench_options_t;
+
+// busy time of one ingestion stage over all chunks
+typedef struct ragl_bench_stage {
+	int64_t busy_us = 0;
+	size_t chunks = 0;
+} ragl_bench_stage_t;
+
+static size_t _unnu_ragl_bench_peak_rss() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#if defined(__APPLE__)
+	return static_cast<size_t>(usage.ru_maxrss);
+#else
+	// kilobytes on Linux
+	return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Sentences over a fixed vocabulary with Zipf-like word frequencies, so BM25
+// sees both common and rare terms. The same seed yields the same corpus.
+static std::vector<std::string> _unnu_ragl_bench_synthetic(int32_t docs, std::mt19937& rng) {
+	static const char* vocabulary[] = {
+		"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "with", "was", "on", "be", "by",
+		"river", "mountain", "engine", "library", "harbor", "garden", "signal", "winter", "market", "bridge",
+		"theory", "language", "circuit", "protein", "galaxy", "violin", "archive", "compass", "glacier", "lantern",
+		"orchard", "quarry", "satellite", "tapestry", "volcano", "whistle", "algorithm", "ballad", "cathedral", "delta",
+		"ember", "fjord", "granite", "horizon", "index", "journal", "kernel", "lagoon", "meadow", "nebula",
+		"observatory", "parchment", "quartz", "reservoir", "sonnet", "turbine", "umbrella", "vector", "windmill", "zenith"
+	};
+	const size_t words = sizeof(vocabulary) / sizeof(vocabulary[0]);
+	std::vector<double> weights(words);
+	for (size_t w = 0; w < words; w++) {
+		weights[w] = 1.0 / static_cast<double>(w + 1);
+	}
+	std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+	std::uniform_int_distribution<int> sentence_words(6, 18);
+	std::uniform_int_distribution<int> doc_sentences(8, 40);
+
+	std::vector<std::string> corpus;
+	corpus.reserve(std::max(docs, 0));
+	for (int32_t d = 0; d < docs; d++) {
+		std::string text;
+		const int sentences = doc_sentences(rng);
+		for (int s = 0; s < sentences; s++) {
+			const int count = sentence_words(rng);
+			for (int w = 0; w < count; w++) {
+				std::string word = vocabulary[pick(rng)];
+				if (w == 0) {
+					word[0] = static_cast<char>(std::toupper(static_cast<unsigned char>(word[0])));
+				}
+				text += word;
+				text += (w + 1 == count) ? ". " : " ";
+			}
+		}
+		corpus.push_back(std::move(text));
+	}
+	return corpus;
+}
+
+// One document per .txt file of the directory, in path order.
+static std::vector<std::string> _unnu_ragl_bench_load(const std::string& dir, int32_t docs) {
+	std::vector<std::filesystem::path> paths;
+	for (const auto& entry : std::filesystem::recursive_directory_iterator(dir)) {
+		if (entry.is_regular_file() && entry.path().extension() == ".txt") {
+			paths.push_back(entry.path());
+		}
+	}
+	std::sort(paths.begin(), paths.end());
+	if (docs > 0 && paths.size() > static_cast<size_t>(docs)) {
+		paths.resize(docs);
+	}
+
+	std::vector<std::string> corpus;
+	corpus.reserve(paths.size());
+	for (const std::filesystem::path& path : paths) {
+		std::ifstream file(path, std::ios::binary);
+		std::stringstream buffer;
+		buffer << file.rdbuf();
+		corpus.push_back(buffer.str());
+	}
+	return corpus;
+}
+
+// A query is a run of 4 to 10 words from a random ingested chunk.
+static std::vector<std::string> _unnu_ragl_bench_queries(const std::vector<std::string>& chunks, int32_t queries, std::mt19937& rng) {
+	std::vector<std::string> result;
+	if (chunks.empty()) {
+		return result;
+	}
+	std::uniform_int_distribution<size_t> pick_chunk(0, chunks.size() - 1);
+	std::uniform_int_distribution<size_t> pick_length(4, 10);
+	for (int32_t q = 0; q < queries; q++) {
+		std::istringstream stream(chunks[pick_chunk(rng)]);
+		std::vector<std::string> words{ std::istream_iterator<std::string>(stream), std::istream_iterator<std::string>() };
+		if (words.empty()) {
+			continue;
+		}
+		const size_t length = std::min(pick_length(rng), words.size());
+		std::uniform_int_distribution<size_t> pick_start(0, words.size() - length);
+		const size_t start = pick_start(rng);
+		std::string text;
+		for (size_t w = start; w < start + length; w++) {
+			text += (w == start ? "" : " ") + words[w];
+		}
+		result.push_back(std::move(text));
+	}
+	return result;
+}
+
+// Exact top-k by cosine similarity. The cast to a list keeps the planner off
+// the HNSW index, so this is the brute-force reference for recall.
+static std::vector<std::string> _unnu_ragl_bench_exact(duckdb::Connection& conn, const std::vector<float>& embedding, int32_t k) {
+	std::vector<std::string> ids;
+	duckdb::vector<duckdb::Value> values;
+	values.reserve(embedding.size());
+	for (float v : embedding) {
+		values.emplace_back(v);
+	}
+	auto stmt = conn.Prepare(
+		"SELECT frag_id FROM embeddings "
+		"ORDER BY list_cosine_similarity(embedding::FLOAT[], $1::FLOAT[]) DESC LIMIT $2;");
+	if (stmt->HasError()) {
+		return ids;
+	}
+	auto result = stmt->Execute(duckdb::Value::LIST(duckdb::LogicalType::FLOAT, values), k);
+	if (result->HasError()) {
+		return ids;
+	}
+	while (auto chunk = result->Fetch()) {
+		for (idx_t row = 0; row < chunk->size(); row++) {
+			ids.push_back(chunk->GetValue(0, row).GetValue<std::string>());
+		}
+	}
+	return ids;
+}
+
+// Bytes of the used blocks after a checkpoint; 0 for an in-memory database.
+static size_t _unnu_ragl_bench_database_bytes(duckdb::Connection& conn) {
+	conn.Query("CHECKPOINT;");
+	auto result = conn.Query("SELECT block_size, used_blocks FROM pragma_database_size() WHERE database_name = current_database();");
+	if (result->HasError() || result->RowCount() == 0) {
+		return 0;
+	}
+	return static_cast<size_t>(result->GetValue(0, 0).GetValue<int64_t>()) * static_cast<size_t>(result->GetValue(1, 0).GetValue<int64_t>());
+}
+
+static double _unnu_ragl_bench_percentile(std::vector<int64_t> samples, double p) {
+	if (samples.empty()) {
+		return 0.0;
+	}
+	std::sort(samples.begin(), samples.end());
+	const size_t idx = std::min(samples.size() - 1, static_cast<size_t>(p * (samples.size() - 1) + 0.5));
+	return samples[idx] / 1000.0;
+}
+
+static std::string _unnu_ragl_bench_json_string(const std::string& value) {
+	std::string out = "\"";
+	for (unsigned char c : value) {
+		switch (c) {
+		case '"': out += "\\\""; break;
+		case '\\': out += "\\\\"; break;
+		case '\n': out += "\\n"; break;
+		case '\r': out += "\\r"; break;
+		case '\t': out += "\\t"; break;
+		default:
+			if (c < 0x20) {
+				char escaped[8];
+				snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+				out += escaped;
+			}
+			else {
+				out.push_back(static_cast<char>(c));
+			}
+		}
+	}
+	return out + "\"";
+}
+
+static void _unnu_ragl_bench_write_stage(FILE* out, const char* name, const ragl_bench_stage_t& stage, bool last) {
+	const double seconds = stage.busy_us / 1e6;
+	fprintf(out, "      %s: { \"ms\": %.3f, \"chunks_per_sec\": %.2f, \"ms_per_chunk\": %.4f }%s\n",
+		_unnu_ragl_bench_json_string(name).c_str(), stage.busy_us / 1000.0,
+		seconds > 0.0 ? stage.chunks / seconds : 0.0,
+		stage.chunks > 0 ? stage.busy_us / 1000.0 / stage.chunks : 0.0,
+		last ? "" : ",");
+}
+
+static void _unnu_ragl_bench_write_latency(FILE* out, const char* name, const std::vector<int64_t>& samples, bool last) {
+	fprintf(out, "    %s: { \"count\": %zu, \"p50_ms\": %.3f, \"p99_ms\": %.3f }%s\n",
+		_unnu_ragl_bench_json_string(name).c_str(), samples.size(),
+		_unnu_ragl_bench_percentile(samples, 0.50), _unnu_ragl_bench_percentile(samples, 0.99),
+		last ? "" : ",");
+}
+
+static bool _unnu_ragl_bench_parse(int argc, char** argv, ragl_bench_options_t& options) {
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		if (i + 1 >= argc) {
+			fprintf(stderr, "error: %s expects a value\n", arg.c_str());
+			return false;
+		}
+		const char* value = argv[++i];
+		if (arg == "--model") options.model = value;
+		else if (arg == "--db") options.db = value;
+		else if (arg == "--corpus") options.corpus = value;
+		else if (arg == "--out") options.out = value;
+		else if (arg == "--docs") options.docs = std::atoi(value);
+		else if (arg == "--queries") options.queries = std::atoi(value);
+		else if (arg == "--k") options.k = std::max(std::atoi(value), 1);
+		else if (arg == "--dims") options.dims = std::atoi(value);
+		else if (arg == "--storage") options.storage = std::min(std::max(std::atoi(value), 0), 2);
+		else if (arg == "--rescore") options.rescore = std::max(std::atoi(value), 1);
+		else if (arg == "--seed") options.seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+		else {
+			fprintf(stderr, "error: unknown option %s\n", arg.c_str());
+			return false;
+		}
+	}
+	if (options.model.empty()) {
+		fprintf(stderr, "usage: unnu_ragl_bench --model <dir> [--db <file>] [--corpus <dir>] [--docs n] [--queries n] [--k n] [--dims n] [--storage 0|1|2] [--rescore n] [--seed n] [--out <file>]\n");
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	ragl_bench_options_t options;
+	if (!_unnu_ragl_bench_parse(argc, argv, options)) {
+		return 2;
+	}
+	std::mt19937 rng(options.seed);
+
+	if (options.dims > 0) {
+		UNNU_RAGL_EMBEDDING_SIZE = options.dims;
+	}
+	UNNU_RAGL_STORAGE_MODE = options.storage;
+	if (options.rescore > 0) {
+		UNNU_RAGL_RESCORE_FACTOR = options.rescore;
+	}
+	// every timed query has to reach the database
+	UNNU_RAGL_QUERY_CACHE_CAPACITY = 0;
+
+	const size_t rss_start = _unnu_ragl_bench_peak_rss();
+	unnu_rag_lite_init(options.model.c_str());
+	// stored vectors are a prefix of the pooled output, never padded
+	const size_t hidden = _unnu_ragl_process("dimensions").size();
+	if (hidden < static_cast<size_t>(UNNU_RAGL_EMBEDDING_SIZE)) {
+		fprintf(stderr, "error: the model has %zu dimensions, %d are stored\n", hidden, UNNU_RAGL_EMBEDDING_SIZE);
+		unnu_rag_lite_destroy();
+		return 1;
+	}
+
+	int errorCode = 0;
+	ragl_kb_ptr kb = _unnu_ragl_open_kb(options.db.empty() ? nullptr : options.db.c_str(), &errorCode);
+	if (kb == nullptr || errorCode != 0) {
+		fprintf(stderr, "error: opening knowledge base (%d)\n", errorCode);
+		return 1;
+	}
+
+	std::vector<std::string> corpus = options.corpus.empty()
+		? _unnu_ragl_bench_synthetic(options.docs, rng)
+		: _unnu_ragl_bench_load(options.corpus, options.docs);
+
+	// ingestion, one stage after the other so each can be timed on its own;
+	// chunking, fragment reuse and claims, pooling and the writers are the
+	// ones of the pipeline (see _unnu_ragl_prepare_stage and the stages after it)
+	ragl_bench_stage_t prepare, tokenize, encode, pool, write;
+	std::vector<std::string> ingested;
+	size_t bytes = 0;
+	const auto ingest_start = std::chrono::steady_clock::now();
+	{
+		boost::uuids::random_generator gen;
+		for (const std::string& text : corpus) {
+			bytes += text.size();
+			embedding_context_t context;
+			context.kb = kb;
+			context.document_id = boost::uuids::to_string(gen());
+			context.model = _unnu_ragl_model();
+			context.space = _unnu_ragl_fragment_space(*context.model);
+
+			auto start = std::chrono::steady_clock::now();
+			if (UNNU_RAGL_CHUNKING_TOKENS > 0) {
+				context.chunks = _unnu_ragl_split_text_into_token_chunks(*context.model, text, UNNU_RAGL_CHUNKING_TOKENS, UNNU_RAGL_CHUNKING_OVERLAP_TOKENS, context.ids);
+			}
+			else {
+				context.chunks = _unnu_ragl_split_text_into_chunks(text, UNNU_RAGL_CHUNKING_SIZE, true);
+			}
+			if (context.chunks.empty()) {
+				continue;
+			}
+			context.writer = _unnu_ragl_acquire_writer(*kb);
+			_unnu_ragl_reuse_fragments(context);
+			prepare.busy_us += _unnu_ragl_elapsed_us(start);
+			prepare.chunks += context.chunks.size();
+
+			if (!context.chunks.empty()) {
+				start = std::chrono::steady_clock::now();
+				if (context.ids.empty()) {
+					context.ids = _unnu_ragl_tokenize_batch(*context.model, context.chunks);
+				}
+				context.batches = _unnu_ragl_plan_batches(context.ids, UNNU_RAGL_MAX_BATCH_TOKENS);
+				tokenize.busy_us += _unnu_ragl_elapsed_us(start);
+				tokenize.chunks += context.chunks.size();
+			}
+
+			const size_t dims = UNNU_RAGL_EMBEDDING_SIZE;
+			for (const std::vector<size_t>& batch : context.batches) {
+				std::vector<std::vector<size_t>> inputs;
+				std::vector<size_t> lengths;
+				inputs.reserve(batch.size());
+				lengths.reserve(batch.size());
+				for (size_t idx : batch) {
+					inputs.push_back(context.ids[idx]);
+					lengths.push_back(context.ids[idx].size());
+				}
+
+				start = std::chrono::steady_clock::now();
+				auto result = _unnu_ragl_submit_batch(*context.model, inputs);
+				ctranslate2::EncoderForwardOutput output = _unnu_ragl_await_batch(result);
+				encode.busy_us += _unnu_ragl_elapsed_us(start);
+				encode.chunks += batch.size();
+
+				start = std::chrono::steady_clock::now();
+				const size_t width = output.last_hidden_state.dim(2);
+				std::vector<float> pooled(batch.size() * width);
+				std::vector<float*> dest(batch.size());
+				for (size_t b = 0; b < batch.size(); b++) {
+					dest[b] = pooled.data() + b * width;
+				}
+				_unnu_ragl_pool_batch(output.last_hidden_state, lengths, dest.data());
+				for (size_t b = 0; b < batch.size(); b++) {
+					_unnu_ragl_truncate_into(pooled.data() + b * width, pooled.data() + b * dims, dims);
+				}
+				pool.busy_us += _unnu_ragl_elapsed_us(start);
+				pool.chunks += batch.size();
+
+				start = std::chrono::steady_clock::now();
+				for (size_t b = 0; b < batch.size(); b++) {
+					const size_t idx = batch[b];
+					if (context.writer->Append(context.document_id, context.corpus, context.frag_ids[idx], context.chunks[idx], pooled.data() + b * dims, dims)) {
+						ingested.push_back(context.chunks[idx]);
+					}
+				}
+				write.busy_us += _unnu_ragl_elapsed_us(start);
+				write.chunks += batch.size();
+			}
+			start = std::chrono::steady_clock::now();
+			context.writer->EndDocument(UNNU_RAGL_BULK_COMMIT_DOCUMENTS);
+			context.writer = nullptr;
+			write.busy_us += _unnu_ragl_elapsed_us(start);
+		}
+		const auto start = std::chrono::steady_clock::now();
+		_unnu_ragl_release_bulk_writer(*kb);
+		write.busy_us += _unnu_ragl_elapsed_us(start);
+	}
+	_unnu_ragl_flush_fts(*kb);
+	// built here rather than on the first query, so no query waits for it
+	_unnu_ragl_update_hnsw(*kb);
+	const int64_t ingest_us = _unnu_ragl_elapsed_us(ingest_start);
+
+	// retrieval
+	std::vector<std::string> queries = _unnu_ragl_bench_queries(ingested, options.queries, rng);
+	std::vector<int64_t> embed_us, vector_us, fts_us, hybrid_us;
+	double recall_sum = 0.0;
+	size_t recall_count = 0;
+	// vector queries answered by the in-memory exact search
+	size_t exact_count = 0;
+	int queryError = 0;
+	for (const std::string& text : queries) {
+		auto start = std::chrono::steady_clock::now();
+		const std::vector<float> embedding = _unnu_ragl_process(text);
+		// what _unnu_ragl_search ranks the stored vectors with
+		const std::vector<float> query = _unnu_ragl_truncate_embedding(embedding, UNNU_RAGL_EMBEDDING_SIZE);
+		embed_us.push_back(_unnu_ragl_elapsed_us(start));
+
+		std::map<std::string, ragl_candidate_t> vector_candidates;
+		{
+			RaglConnectionLease lease(*kb);
+			start = std::chrono::steady_clock::now();
+			if (UNNU_RAGL_STORAGE_MODE != 0) {
+				_unnu_ragl_quantized_candidates(lease, UNNU_RAGL_STORAGE_MODE, query, options.k, vector_candidates, &queryError);
+			}
+			else if (_unnu_ragl_exact_candidates(*kb, lease.Conn(), query, options.k, vector_candidates, &queryError)) {
+				exact_count++;
+			}
+			else {
+				_unnu_ragl_vector_candidates(lease.Conn(), query, options.k, vector_candidates, &queryError);
+			}
+			vector_us.push_back(_unnu_ragl_elapsed_us(start));
+
+			std::map<std::string, ragl_candidate_t> fts_candidates;
+			start = std::chrono::steady_clock::now();
+			_unnu_ragl_fts_candidates(lease, text, ragl_filter_t(), options.k, fts_candidates, &queryError);
+			fts_us.push_back(_unnu_ragl_elapsed_us(start));
+
+			std::vector<std::string> exact = _unnu_ragl_bench_exact(lease.Conn(), query, options.k);
+			if (!exact.empty()) {
+				size_t hits = 0;
+				for (const std::string& frag_id : exact) {
+					hits += vector_candidates.count(frag_id);
+				}
+				recall_sum += static_cast<double>(hits) / exact.size();
+				recall_count++;
+			}
+		}
+
+		start = std::chrono::steady_clock::now();
+		_unnu_ragl_search(*kb, text, embedding, options.k, true, ragl_filter_t(), &queryError);
+		hybrid_us.push_back(_unnu_ragl_elapsed_us(start));
+	}
+	const size_t rss_peak = _unnu_ragl_bench_peak_rss();
+	size_t database_bytes = 0;
+	{
+		RaglConnectionLease lease(*kb);
+		database_bytes = _unnu_ragl_bench_database_bytes(lease.Conn());
+	}
+
+	FILE* out = options.out.empty() ? stdout : fopen(options.out.c_str(), "w");
+	if (out == nullptr) {
+		fprintf(stderr, "error: writing %s\n", options.out.c_str());
+		return 1;
+	}
+	fprintf(out, "{\n");
+	fprintf(out, "  \"model_id\": %s,\n", _unnu_ragl_bench_json_string(_unnu_ragl_model()->id).c_str());
+	fprintf(out, "  \"dims\": %d,\n", UNNU_RAGL_EMBEDDING_SIZE);
+	fprintf(out, "  \"storage\": %d,\n", UNNU_RAGL_STORAGE_MODE);
+	fprintf(out, "  \"rescore_factor\": %d,\n", UNNU_RAGL_RESCORE_FACTOR);
+	fprintf(out, "  \"corpus\": %s,\n", _unnu_ragl_bench_json_string(options.corpus.empty() ? "synthetic" : options.corpus).c_str());
+	fprintf(out, "  \"seed\": %u,\n", options.seed);
+	fprintf(out, "  \"ingest\": {\n");
+	fprintf(out, "    \"documents\": %zu,\n", corpus.size());
+	fprintf(out, "    \"bytes\": %zu,\n", bytes);
+	fprintf(out, "    \"chunks\": %zu,\n", ingested.size());
+	fprintf(out, "    \"ms\": %.3f,\n", ingest_us / 1000.0);
+	fprintf(out, "    \"chunks_per_sec\": %.2f,\n", ingest_us > 0 ? ingested.size() / (ingest_us / 1e6) : 0.0);
+	fprintf(out, "    \"stages\": {\n");
+	_unnu_ragl_bench_write_stage(out, "prepare", prepare, false);
+	_unnu_ragl_bench_write_stage(out, "tokenize", tokenize, false);
+	_unnu_ragl_bench_write_stage(out, "encode", encode, false);
+	_unnu_ragl_bench_write_stage(out, "pool", pool, false);
+	_unnu_ragl_bench_write_stage(out, "write", write, true);
+	fprintf(out, "    }\n");
+	fprintf(out, "  },\n");
+	fprintf(out, "  \"query\": {\n");
+	fprintf(out, "    \"k\": %d,\n", options.k);
+	_unnu_ragl_bench_write_latency(out, "embed", embed_us, false);
+	_unnu_ragl_bench_write_latency(out, "vector", vector_us, false);
+	_unnu_ragl_bench_write_latency(out, "fts", fts_us, false);
+	_unnu_ragl_bench_write_latency(out, "hybrid", hybrid_us, false);
+	fprintf(out, "    \"recall_at_k\": %.4f,\n", recall_count > 0 ? recall_sum / recall_count : 0.0);
+	fprintf(out, "    \"exact_queries\": %zu,\n", exact_count);
+	fprintf(out, "    \"errors\": %d\n", queryError);
+	fprintf(out, "  },\n");
+	fprintf(out, "  \"memory\": { \"rss_start_bytes\": %zu, \"rss_peak_bytes\": %zu, \"database_bytes\": %zu }\n", rss_start, rss_peak, database_bytes);
+	fprintf(out, "}\n");
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	kb = nullptr;
+	unnu_rag_lite_destroy();
+	return 0;
+}